@@ -3,6 +3,7 @@
 //
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
 
 #ifndef WIN32
 //%%%%
@@ -13,6 +14,20 @@
 #include <termios.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <glob.h>
+#include <dirent.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <sys/un.h>
+#include <errno.h>
 #else
 //%%%%
 #include <windows.h>
@@ -24,15 +39,120 @@
 #include "parts.h"
 #include "patcher.h"
 #include "exploit.h"
+#include "crc16.h"
+#include "frames.h"
+#include "sha256.h"
+#include "bootimg.h"
 
 
+// The port state is kept per thread, every device is served by its own thread
 #ifndef WIN32
-int siofd;
-struct termios sioparm;
+#define THREADLOCAL __thread
+#else
+#define THREADLOCAL
+#endif
+
+// the device status is written by its thread and polled by the main one
+#ifndef WIN32
+#define SETSTATUS(d,s) __atomic_store_n(&(d)->status,(s),__ATOMIC_RELEASE)
+#define GETSTATUS(d) __atomic_load_n(&(d)->status,__ATOMIC_ACQUIRE)
+#else
+#define SETSTATUS(d,s) ((d)->status=(s))
+#define GETSTATUS(d) ((d)->status)
+#endif
+
+#ifndef WIN32
+THREADLOCAL int siofd;
+THREADLOCAL struct termios sioparm;
 #else
 static HANDLE hSerial;
 #endif
-FILE* ldr;
+
+// maximum number of data packets in flight (see -w)
+#define MAXWINDOW 32
+THREADLOCAL int wsize;  // current window of the device
+
+// number of retransmissions of a rejected or unanswered packet (see -r)
+THREADLOCAL int maxretry=3;
+
+#ifndef WIN32
+// reply timeouts, microseconds
+#define REPLYTIMEOUT 3000000  // header, end of data and before the first RTT sample
+#define MINRTO 20000
+#define MAXRTO 3000000
+
+// round trip time estimator and retransmission statistics
+struct {
+  unsigned int srtt;    // smoothed RTT
+  unsigned int rttvar;  // RTT variance
+  unsigned int rto;     // current retransmission timeout
+  unsigned int minrtt, maxrtt, maxrto;
+  unsigned int samples;
+  unsigned int packets, retries, timeouts, naks;
+} THREADLOCAL rtt={0,0,REPLYTIMEOUT,0xffffffff,0,0};
+#endif
+
+// maximum number of devices flashed at once
+#define MAXDEV 64
+
+// Device being flashed
+struct device {
+  char port[100];
+  char usbpath[32];    // USB topology of a discovered port (bus-port.port...)
+  struct frames* fr;   // prepared packets, shared by all devices
+  int xflag;           // secuboot bypass
+  int window;          // packets in flight
+  int retry;           // retransmissions of a packet
+  int status;          // 0 - in progress, 1 - finished, -1 - failed
+  const char* msg;     // current stage or error
+  int bl;              // current component
+  unsigned int done;   // bytes of the current component confirmed
+  unsigned int retries;
+  uint64_t start,end;  // microseconds
+#ifndef WIN32
+  pthread_t thread;
+#endif
+};
+
+// several devices at once - per-device progress goes to the status table
+int multi=0;
+THREADLOCAL struct device* curdev;
+
+// Download options, from the command line or from a station job
+struct options {
+  int fbflag,tflag,mflag,bflag,cflag,xflag,waitflag;
+  int json;              // --json: -m output for scripts
+  int window;            // -w
+  int retry;             // -r
+  char ptfile[100];      // -t
+  char* sigfile;         // -d
+  uint8_t fileflag[41];  // partitions that need to have the file flag set
+  int nports;            // ports to load, one on Windows
+#ifndef WIN32
+  struct device* devs;   // -p
+  char* station;         // --station socket
+  char* submit;          // --submit socket
+  char* cache;           // --cache directory
+  int cachesize;         // --cache-size, megabytes
+#else
+  char devname[50];
+#endif
+};
+
+// Loader prepared for the download
+struct image {
+  uint8_t key[32];       // SHA-256 of the loader and of the options changing it
+  char* map;             // private mapping of the loader file
+  size_t mapsize;
+  char* pbuf[2];         // component images
+  struct frames fr;      // all packets of the download
+  struct ptable_t* ptable;  // partition table in usbldr, NULL - not found
+  int patchoff;          // file offset of the removed eraseall, 0 - not patched
+  int family;            // signature family of the removed eraseall
+  struct bootinfo boot;  // -f: the kernel header cut off, file offset
+  int refs;              // station jobs using the image
+  uint64_t used;         // last use, for the station cache
+};
 
 
 //*************************************************
@@ -70,38 +190,134 @@ for (i=0;i<len;i+=16) {
 //*************************************************
 void csum(unsigned char* buf, int len) {
 
-unsigned  int i,c,csum=0;
+unsigned int csum;
 
-unsigned int cconst[]={0,0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7, 0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF};
-
-for (i=0;i<(len-2);i++) {
-  c=(buf[i]&0xff);
-  csum=((csum<<4)&0xffff)^cconst[(c>>4)^(csum>>12)];
-  csum=((csum<<4)&0xffff)^cconst[(c&0xf)^(csum>>12)];
-}  
+csum=crc16_update(0,buf,len-2);
 buf[len-2]=(csum>>8)&0xff;
 buf[len-1]=csum&0xff;
   
 }
 
+#ifndef WIN32
+//*************************************************
+//*   Current time in microseconds
+//*************************************************
+uint64_t now_us() {
+
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC,&ts);
+return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
 //*************************************************
-//*   Sending a command packet to the modem
+//*   Waiting for the modem reply no longer than timeout microseconds
 //*************************************************
-int sendcmd(unsigned char* cmdbuf, int len) {
+int readreply(unsigned char* buf, int len, unsigned int timeout) {
+
+struct pollfd pfd;
+int res;
+
+pfd.fd=siofd;
+pfd.events=POLLIN;
+if (poll(&pfd,1,(timeout+999)/1000) <= 0) return 0;
+res=read(siofd,buf,len);
+return (res>0)?res:0;
+}
+
+//*************************************************
+//*   RTT measurement update (RFC 6298 estimator)
+//*************************************************
+void rtt_sample(unsigned int r) {
+
+unsigned int delta;
+
+if (r<rtt.minrtt) rtt.minrtt=r;
+if (r>rtt.maxrtt) rtt.maxrtt=r;
+if (rtt.samples++ == 0) {
+  rtt.srtt=r;
+  rtt.rttvar=r/2;
+}
+else {
+  delta=(rtt.srtt>r)?(rtt.srtt-r):(r-rtt.srtt);
+  rtt.rttvar=(3*rtt.rttvar+delta)/4;
+  rtt.srtt=(7*rtt.srtt+r)/8;
+}
+rtt.rto=rtt.srtt+4*rtt.rttvar;
+if (rtt.rto<MINRTO) rtt.rto=MINRTO;
+if (rtt.rto>MAXRTO) rtt.rto=MAXRTO;
+if (rtt.rto>rtt.maxrto) rtt.maxrto=rtt.rto;
+}
+
+//*************************************************
+//*   Printing the transfer statistics
+//*************************************************
+void showstats() {
+
+printf("\n Packets: %u, retransmitted: %u (timeouts %u, rejected %u)",rtt.packets,rtt.retries,rtt.timeouts,rtt.naks);
+if (rtt.samples != 0) 
+  printf("\n RTT min/avg/max: %u/%u/%u us, RTO %u us (max %u us)",rtt.minrtt,rtt.srtt,rtt.maxrtt,rtt.rto,rtt.maxrto);
+printf("\n");
+}
+#endif
+
+//*************************************************
+//*   Sending a ready frame, given as a scatter list, to the modem
+//*
+//* A rejected or unanswered packet is sent again up to maxretry times.
+//* Data packets wait for the reply with the adaptive timeout, which is
+//* doubled after every loss; the header and end of data packets keep the
+//* fixed timeout since the boot ROM may need time to process them.
+//*************************************************
+int sendframev(struct iovec* iov, int cnt) {
 
 unsigned char replybuf[1024];
 unsigned int replylen;
+unsigned char ftype=((unsigned char*)iov[0].iov_base)[0];
 
 #ifndef WIN32
-csum(cmdbuf,len);
-write(siofd,cmdbuf,len);  // sending a command
-tcdrain(siofd);
-replylen=read(siofd,replybuf,1024);
+int attempt;
+unsigned int timeout;
+uint64_t t;
+
+for(attempt=0;attempt<=maxretry;attempt++) {
+  if (attempt != 0) {
+    rtt.retries++;
+    tcflush(siofd,TCIFLUSH); // drop late replies to the previous attempt
+  }
+  timeout=(ftype == 0xda)?rtt.rto:REPLYTIMEOUT;
+  t=now_us();
+  writev(siofd,iov,cnt);  // sending a command
+  tcdrain(siofd);
+  replylen=readreply(replybuf,1024,timeout);
+  if (replylen == 0) {
+    // no reply - back off
+    rtt.timeouts++;
+    if (ftype == 0xda) {
+      rtt.rto=(rtt.rto*2>MAXRTO)?MAXRTO:rtt.rto*2;
+      if (rtt.rto>rtt.maxrto) rtt.maxrto=rtt.rto;
+    }
+    continue;
+  }
+  if (replybuf[0] == 0xaa) {
+    rtt.packets++;
+    // Karn's rule: retransmitted packets give no RTT sample
+    if ((attempt == 0) && (ftype == 0xda)) rtt_sample(now_us()-t);
+    return 1;
+  }
+  rtt.naks++;
+}
+return 0;
 #else
     DWORD bytes_written = 0;
     DWORD t;
+    unsigned char cmdbuf[FRAMELEN];
+    int i, len = 0;
 
-    csum(cmdbuf, len);
+    for (i = 0; i < cnt; i++) {
+        memcpy(cmdbuf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
     WriteFile(hSerial, cmdbuf, len, &bytes_written, NULL);
     FlushFileBuffers(hSerial);
 
@@ -109,12 +325,116 @@ replylen=read(siofd,replybuf,1024);
     do {
         ReadFile(hSerial, replybuf, 1024, (LPDWORD)&replylen, NULL);
     } while (replylen == 0 && GetTickCount() - t < 1000);
-#endif
 if (replylen == 0) return 0;    
 if (replybuf[0] == 0xaa) return 1;
 return 0;
+#endif
 }
 
+//*************************************************
+//*   Sending a ready contiguous frame to the modem
+//*************************************************
+int sendframe(unsigned char* cmdbuf, int len) {
+
+struct iovec iov;
+
+iov.iov_base=cmdbuf;
+iov.iov_len=len;
+return sendframev(&iov,1);
+}
+
+//*************************************************
+//*   Sending a command packet to the modem
+//*************************************************
+int sendcmd(unsigned char* cmdbuf, int len) {
+
+csum(cmdbuf,len);
+return sendframe(cmdbuf,len);
+}
+
+//*************************************************
+//*   Download progress of the current device
+//*************************************************
+void progress(int bl, unsigned int done) {
+
+struct frames* fr=curdev->fr;
+
+curdev->bl=bl;
+curdev->done=done;
+if (!multi) printf("\r %s    %08x %8i   %i%%",bl?"usbboot":"raminit",fr->blk[bl].adr,fr->blk[bl].size,done*100/fr->blk[bl].size); 
+}
+
+#ifndef WIN32
+//*************************************************
+//*   Pipelined sending of the block data packets
+//*
+//* Up to wsize packets are kept in flight. The boot ROM answers every
+//* packet strictly in order, so each received byte acknowledges the oldest
+//* outstanding packet (pktcount sequence). After the first rejected or
+//* missing reply the remaining replies are drained, the window is reduced to
+//* stop-and-wait and the transfer continues from the unacknowledged packet.
+//* The frames are taken ready-made from the arena.
+//*************************************************
+int sendwindow(struct frames* fr, int bl) {
+
+unsigned char replybuf[MAXWINDOW];
+struct iovec iov[MAXWINDOW*3];
+unsigned int npkt,size,base,next,i;
+int n,r,cnt;
+
+npkt=fr->blk[bl].npkt;
+size=fr->blk[bl].size;
+base=0;  // oldest unacknowledged packet
+next=0;  // next packet to send
+
+while (base<npkt) {
+  // fill the window, all new frames in one gather write
+  cnt=0;
+  while ((next<npkt) && (next-base<wsize)) {
+    if (wsize == 1) {
+      // stop-and-wait after a failure
+      frame_iov(fr,bl,next,iov);
+      if (!sendframev(iov,3)) return 0;
+      base++;
+      next++;
+      progress(bl,(base==npkt)?size:base*DATALEN);
+      continue;
+    }
+    cnt+=frame_iov(fr,bl,next,iov+cnt);
+    next++;
+  }
+  if (cnt != 0) writev(siofd,iov,cnt);
+  if (base == npkt) break;
+
+  // collect replies
+  n=readreply(replybuf,next-base,rtt.rto);
+  if (n == 0) rtt.timeouts++;
+  for(i=0;(n>0)&&(i<n);i++) {
+    if (replybuf[i] != 0xaa) {
+      rtt.naks++;
+      break;
+    }
+    rtt.packets++;
+    base++;
+  }
+  progress(bl,(base==npkt)?size:base*DATALEN);
+  if ((n>0) && (i == n)) continue;
+
+  // rejected or lost packet - drain replies to the remaining packets in flight
+  if (!multi) printf("\n Packet %i not acknowledged, switching to stop-and-wait\n",base+1);
+  for(n=(n>0)?(n-i-1):0;n<(int)(next-base-1);) {
+    r=readreply(replybuf,MAXWINDOW,rtt.rto);
+    if (r<=0) break;
+    n+=r;
+  }
+  tcflush(siofd,TCIFLUSH);
+  wsize=1;
+  next=base;
+}
+return 1;
+}
+#endif
+
 //*************************************
 // Opening and configuring the serial port
 //*************************************
@@ -193,19 +513,6 @@ return 1;
 #endif
 }
 
-//*************************************
-//* Search for the linux kernel in the partition image
-//*************************************
-int locate_kernel(char* pbuf, uint32_t size) {
-  
-int off;
-
-for(off=(size-8);off>0;off--) {
-  if (strncmp(pbuf+off,"ANDROID!",8) == 0) return off;
-}
-return 0;
-}
-
 #ifdef WIN32
 
 DEFINE_GUID(GUID_DEVCLASS_PORTS, 0x4D36E978, 0xE325, 0x11CE, 0xBF, 0xC1, 0x08, 0x00, 0x2B, 0xE1, 0x03, 0x18);
@@ -262,159 +569,665 @@ static int find_port(int* port_no, char* port_name)
   return result;
 }
 
-#endif
+#else
 
-//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//*************************************************
+//*  USB identifiers of the emergency boot mode
+//*************************************************
+static const struct {
+  uint16_t vid,pid;
+} bootids[]={
+  {0x12d1,0x1443},   // Huawei Balong boot ROM
+};
 
-void main(int argc, char* argv[]) {
+//*************************************************
+//*  Reading the USB identifiers of a sysfs device directory
+//*************************************************
+static int usb_ids(const char* dir, unsigned int* vid, unsigned int* pid) {
+
+char path[PATH_MAX];
+FILE* f;
+int res;
+
+snprintf(path,sizeof(path),"%s/idVendor",dir);
+f=fopen(path,"r");
+if (f == NULL) return 0;
+res=fscanf(f,"%x",vid);
+fclose(f);
+if (res != 1) return 0;
+
+snprintf(path,sizeof(path),"%s/idProduct",dir);
+f=fopen(path,"r");
+if (f == NULL) return 0;
+res=fscanf(f,"%x",pid);
+fclose(f);
+return res == 1;
+}
 
-unsigned int i,res,opt,datasize,pktcount,adr;
-int bl;    // current block
-unsigned char c;
-int fbflag=0, tflag=0, mflag=0, bflag=0, cflag=0, xflag=0;
-int koff;  // offset to ANDROID-header
-char ptfile[100];
+//*************************************************
+//*  Checking whether a tty belongs to a device in the boot mode
+//*
+//* The device link is followed up to the USB device that owns the
+//* interface; on success its topology path (bus-port.port...) is returned.
+//*************************************************
+static int boot_tty(const char* name, char* usbpath, int len) {
+
+char path[PATH_MAX], dev[PATH_MAX];
+unsigned int vid,pid;
+int i;
+
+snprintf(path,sizeof(path),"/sys/class/tty/%s/device",name);
+// virtual terminals and ptys have no device
+if (realpath(path,dev) == NULL) return 0;
+for(;;) {
+  if (strlen(dev)<=sizeof("/sys/devices")) return 0;
+  if (usb_ids(dev,&vid,&pid)) break;
+  *strrchr(dev,'/')=0;
+}
+for(i=0;i<sizeof(bootids)/sizeof(bootids[0]);i++) {
+  if ((bootids[i].vid == vid) && (bootids[i].pid == pid)) {
+    snprintf(usbpath,len,"%s",strrchr(dev,'/')+1);
+    return 1;
+  }
+}
+return 0;
+}
 
-FILE* pt;
-char ptbuf[2048];
-uint32_t ptoff;
+//*************************************************
+//*  Search for the emergency boot ports in sysfs
+//*
+//* Ports with a boot-mode VID:PID are added to the list together with the
+//* USB topology path. Returns the new list size.
+//*************************************************
+int find_ports(struct device* devs, int ndev) {
+
+struct dirent** names;
+int i,n;
+
+n=scandir("/sys/class/tty",&names,NULL,alphasort);
+if (n<0) return ndev;
+for(i=0;i<n;i++) {
+  if ((names[i]->d_name[0] == '.') || (ndev>=MAXDEV)) continue;
+  if (!boot_tty(names[i]->d_name,devs[ndev].usbpath,sizeof(devs[0].usbpath))) continue;
+  snprintf(devs[ndev].port,sizeof(devs[0].port),"/dev/%s",names[i]->d_name);
+  ndev++;
+}
+for(i=0;i<n;i++) free(names[i]);
+free(names);
+return ndev;
+}
 
-struct ptable_t* ptable;
+//*************************************************
+//*  Checking that the awaited port can be opened
+//*
+//* The node is created by devtmpfs before the uevent is sent, while udev
+//* may still be applying the permissions - give it a moment.
+//*************************************************
+static int port_ready(struct device* dev, int settle) {
 
-unsigned char cmdhead[14]={0xfe,0, 0xff};
-unsigned char cmddata[1040]={0xda,0,0};
-unsigned char cmdeod[5]={0xed,0,0,0,0};
+uint64_t limit=now_us()+settle*1000ULL;
 
-// list of partitions that need to have the file flag set
-uint8_t fileflag[41];
+do {
+  if (access(dev->port,R_OK|W_OK) == 0) return 1;
+  if (!settle) return 0;
+  usleep(1000);
+} while (now_us()<limit);
+return 0;
+}
 
-struct {
-  int lmode;  // boot mode: 1 - direct start, 2 - via A-core restart
-  int size;   // component size
-  int adr;    // component loading address in memory
-  int offset; // offset to the component from the beginning of the file
-  char* pbuf; // buffer for loading the component image
-} blk[10];
+//*************************************************
+//*  Waiting for the boot port to appear (--wait)
+//*
+//* Kernel uevents are received through netlink, so the port goes to the
+//* handshake as soon as its tty is registered. A port given with -p is
+//* awaited by name, otherwise the first tty with a boot-mode VID:PID is
+//* taken. Without netlink sysfs is polled instead.
+//*************************************************
+int wait_port(struct device* dev) {
+
+int nl,named,len;
+struct sockaddr_nl sa;
+struct pollfd pfd;
+char msg[8192];
+char* p;
+char* devname;
+int add,tty;
+uint64_t t;
+
+named=(dev->port[0] != 0);
+// a bare number is a ttyUSB port, as in open_port()
+if (named && (strspn(dev->port,"0123456789") == strlen(dev->port))) {
+  snprintf(msg,sizeof(msg),"/dev/ttyUSB%s",dev->port);
+  snprintf(dev->port,sizeof(dev->port),"%s",msg);
+}
+// subscribe first, so that a port appearing during the first check is not missed
+nl=socket(AF_NETLINK,SOCK_DGRAM|SOCK_CLOEXEC,NETLINK_KOBJECT_UEVENT);
+if (nl >= 0) {
+  memset(&sa,0,sizeof(sa));
+  sa.nl_family=AF_NETLINK;
+  sa.nl_groups=1;  // kernel events
+  if (bind(nl,(struct sockaddr*)&sa,sizeof(sa)) != 0) {
+    close(nl);
+    nl=-1;
+  }
+}
+if (nl<0) printf("\n No kernel uevents, polling sysfs");
+fflush(stdout);
+
+// the port may be there already; the periodic rescan also covers
+// ports without uevents (ptys) and events lost on a socket overflow
+for(;;) {
+  if (named) {
+    if (port_ready(dev,0)) break;
+  }
+  else if (find_ports(dev,0)) break;
+  if (nl<0) {
+    usleep(10000);
+    continue;
+  }
+  pfd.fd=nl;
+  pfd.events=POLLIN;
+  if (poll(&pfd,1,100) <= 0) continue;
+  len=recv(nl,msg,sizeof(msg)-1,0);
+  if (len<=0) continue;
+  msg[len]=0;
+  t=now_us();
+  // "action@devpath" followed by KEY=value strings
+  add=tty=0;
+  devname=NULL;
+  for(p=msg;p<msg+len;p+=strlen(p)+1) {
+    if (strcmp(p,"ACTION=add") == 0) add=1;
+    else if (strcmp(p,"SUBSYSTEM=tty") == 0) tty=1;
+    else if (strncmp(p,"DEVNAME=",8) == 0) devname=p+8;
+  }
+  if (!add || !tty || (devname == NULL)) continue;
+  if (named) {
+    if ((strncmp(dev->port,"/dev/",5) != 0) || (strcmp(dev->port+5,devname) != 0)) continue;
+    if (!port_ready(dev,1000)) continue;
+  }
+  else {
+    if (strchr(devname,'/') != NULL) continue;
+    if (!boot_tty(devname,dev->usbpath,sizeof(dev->usbpath))) continue;
+    snprintf(dev->port,sizeof(dev->port),"/dev/%s",devname);
+    if (!port_ready(dev,1000)) continue;
+  }
+  printf("\n Port %s ready %.1f ms after the uevent",dev->port,(now_us()-t)/1000.0);
+  break;
+}
 
+if (nl >= 0) close(nl);
+if (dev->usbpath[0] != 0) printf("\n Port: %s (USB %s)",dev->port,dev->usbpath);
+else printf("\n Port: %s",dev->port);
+return 1;
+}
+#endif
 
-#ifndef WIN32
-unsigned char devname[50]="/dev/ttyUSB0";
-#else
-char devname[50]="";
+//*************************************************
+//*  Failure of the current device
+//*************************************************
+int devfail(struct device* dev, const char* msg) {
+
+dev->msg=msg;
+SETSTATUS(dev,-1);
+if (!multi) printf("\n %s\n",msg);
+return 0;
+}
+
+//*************************************************
+//*  Loading the prepared packets into one device
+//*************************************************
+int flash(struct device* dev) {
+
+struct frames* fr=dev->fr;
+struct iovec iov[3];
+unsigned int n;
+int bl;
+unsigned char c;
+#ifdef WIN32
 DWORD bytes_written, bytes_read;
-int port_no;
-char port_name[256];
 #endif
 
+curdev=dev;
+wsize=dev->window;
+maxretry=dev->retry;
+dev->msg="handshake";
+if (!open_port(dev->port)) return devfail(dev,"Serial port does not open");
+
+// Checking the boot port
+c=0;
 #ifndef WIN32
-bzero(fileflag,sizeof(fileflag));
+write(siofd,"A",1);
+read(siofd,&c,1);
 #else
-memset(fileflag, 0, sizeof(fileflag));
+    WriteFile(hSerial, "A", 1, &bytes_written, NULL);
+    FlushFileBuffers(hSerial);
+    Sleep(100);
+    ReadFile(hSerial, &c, 1, &bytes_read, NULL);
 #endif
+if (c != 0x55) return devfail(dev,"! The port is not in USB Boot mode");
 
-while ((opt = getopt(argc, argv, "hp:ft:ms:bcx:")) != -1) {
-  switch (opt) {
-   case 'h': 
-     
-printf("\n The utility is intended for emergency USB-boot of devices on the Balong V7 chipset\n\n\
-%s [keys] <file name to download>\n\n\
- The following keys are valid:\n\n"
+//----------------------------------
+// main download cycle - load all blocks found in the header
+//%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%    
+
+switch (dev->xflag) {
+    case 1:
+        secuboot_exploit_v7r1();
+        break;
+    case 2:
+        secuboot_exploit_v7r11();
+        break;
+    case 3:
+        secuboot_exploit_v7r22();
+        break;
+    case 4:
+        secuboot_exploit_v7r5();
+        break;
+    case 6:
+        secuboot_exploit_5000();
+        break;
+}
+
+if (!multi) printf("\n\n Component    Address    Size   %%download\n------------------------------------------\n");
+
+for(bl=0;bl<fr->nblk;bl++) {
+
+  dev->msg=bl?"usbboot":"raminit";
+  // send the block start packet
+  if (!sendframe(fr->arena+fr->blk[bl].head,14)) return devfail(dev,"Modem rejected header packet");
+  
+  // ---------- Block data loading cycle ---------------------
 #ifndef WIN32
-"-p <tty> - serial port for communication with the bootloader (default /dev/ttyUSB0)\n"
-#else
-"-p # - serial port number for communication with the bootloader (for example, -p8)\n"
-"  if the -p key is not specified, the port is automatically detected\n"
+  if (wsize>1) {
+    if (!sendwindow(fr,bl)) {
+      if (!multi) showstats();
+      return devfail(dev,"Modem rejected data packet");
+    }
+  }
+  else
 #endif
-"-f       - load usbloader only to fastboot (without starting linux)\n\
--b       - similar to -f, additionally disable checking for bad blocks when erasing\n\
--t <file>- take the partition table from the specified file\n\
--m       - show the bootloader partition table and exit\n\
--s n     - set the file flag for partition n (the key can be specified several times)\n\
--c       - do not perform automatic patch for erasing partitions\n\
--x <1-6> - bypass secuboot and load an unsigned bootloader (1=Balong V7R1, 2=V7R2/V7R11, 3=V7R22, 4=V7R5, 5=V7R65, 6=5000)\n\
-           (1) V7R1:  E3272, E3276, E5372 (Hi6920)\n\
-           (2) V7R2:  E3372s, E5373, E5377, E5786 (Hi6930)\n\
-           (2) V7R11: E3372h, E8372h, E5573, E5576, B310, B315s (Hi6921)\n\
-           (3) V7R22: E5785, E5885, B316, B525, B528, B535 (Hi6932)\n\
-           (4) V7R5:  B612s, B618s, B715s (Hi6950)\n\
-           (5) V7R65: B625, B818 (Hi6965)\n\
-           (6) 5000:  H112, H122, E6878 (Hi9500)\
-\n",argv[0]);
-    return;
+  for(n=0;n<fr->blk[bl].npkt;n++) {
 
-   case 'p':
-    strcpy(devname,optarg);
+    progress(bl,n*DATALEN+frame_payload(fr,bl,n));
+    frame_iov(fr,bl,n,iov);
+    if (!sendframev(iov,3)) {
+#ifndef WIN32
+      if (!multi) showstats();
+#endif
+      return devfail(dev,"Modem rejected data packet");
+    }  
+  }
+
+  if (dev->xflag == 5 && bl == 1) {
+    secuboot_exploit_v7r65(fr->blk[bl].adr + 0x1000);
     break;
+  }
 
-   case 'f':
-     fbflag=1;
-     break;
+  // send the end of data packet
+  if (!sendframe(fr->arena+fr->blk[bl].eod,5)) {
+    if (!multi) printf("\nModem rejected end of data packet");
+  }
+  if (!multi) printf("\n");  
+} 
+dev->msg="done";
+SETSTATUS(dev,1);
+return 1;
+}
 
-   case 'c':
-     cflag=1;
-     break;
+#ifndef WIN32
+//*************************************************
+//*  Device thread
+//*************************************************
+void* flash_thread(void* arg) {
 
-   case 'b':
-     fbflag=1;
-     bflag=1;
-     break;
+struct device* dev=arg;
 
-   case 'm':
-     mflag=1;
-     break;
+dev->start=now_us();
+flash(dev);
+dev->end=now_us();
+dev->retries=rtt.retries;
+if (siofd>0) close(siofd);
+return NULL;
+}
+
+//*************************************************
+//*  Status table of the devices
+//*
+//* On a terminal the table is redrawn in place, otherwise only the final
+//* state is printed.
+//*************************************************
+void show_devices(struct device* devs, int ndev, int redraw) {
+
+int i;
+struct device* dev;
+struct frames* fr;
+uint64_t t;
+unsigned int bytes;
+
+if (redraw) printf("\033[%iA",ndev);
+for(i=0;i<ndev;i++) {
+  dev=&devs[i];
+  fr=dev->fr;
+  t=(dev->end?dev->end:now_us())-dev->start;
+  bytes=(dev->bl?fr->blk[0].size:0)+dev->done;
+  printf("\r %-20s %-8s %3i%% %8.1f KB/s  %-36s\n",dev->port,dev->bl?"usbboot":"raminit",
+    dev->done*100/fr->blk[dev->bl].size,t?(bytes*1e6/1024/t):0.0,dev->msg);
+}
+fflush(stdout);
+}
+
+//*************************************************
+//*  Loading the prepared packets into all devices concurrently
+//*************************************************
+void flash_all(struct device* devs, int ndev) {
+
+int i,running,ok=0,tty;
+char started[MAXDEV];
+uint64_t start,bytes=0;
+double sec;
+
+multi=1;
+tty=isatty(1);
+start=now_us();
+printf("\n\n Port                 Stage    Done   Speed\n--------------------------------------------------------------------\n");
+for(i=0;i<ndev;i++) {
+  started[i]=(pthread_create(&devs[i].thread,NULL,flash_thread,&devs[i]) == 0);
+  if (started[i]) continue;
+  // the device is shown as failed and not joined
+  devs[i].start=devs[i].end=now_us();
+  devs[i].msg="cannot start a thread";
+  SETSTATUS(&devs[i],-1);
+}
+
+if (tty) {
+  show_devices(devs,ndev,0);
+  do {
+    usleep(250000);
+    for(i=0,running=0;i<ndev;i++) if (GETSTATUS(&devs[i]) == 0) running++;
+    show_devices(devs,ndev,1);
+  } while (running);
+}
+for(i=0;i<ndev;i++) if (started[i]) pthread_join(devs[i].thread,NULL);
+if (!tty) show_devices(devs,ndev,0);
+
+for(i=0;i<ndev;i++) {
+  if (devs[i].status == 1) ok++;
+  bytes+=(devs[i].bl?devs[i].fr->blk[0].size:0)+devs[i].done;
+}
+sec=(now_us()-start)/1e6;
+printf("\n Devices: %i, loaded: %i, failed: %i, %.1f s, aggregate %.1f KB/s\n",ndev,ok,ndev-ok,sec,sec>0?bytes/1024.0/sec:0.0);
+}
+
+//*************************************************
+//*  Adding ports from the -p argument: comma-separated names or globs
+//*************************************************
+int add_ports(struct device* devs, int ndev, char* arg) {
+
+char* name;
+char* save;
+glob_t g;
+size_t i;
+
+for(name=strtok_r(arg,",",&save);name != NULL;name=strtok_r(NULL,",",&save)) {
+  if (strpbrk(name,"*?[") != NULL) {
+    if (glob(name,0,NULL,&g) != 0) continue;
+    for(i=0;(i<g.gl_pathc) && (ndev<MAXDEV);i++) {
+      strncpy(devs[ndev++].port,g.gl_pathv[i],sizeof(devs[0].port)-1);
+    }
+    globfree(&g);
+  }
+  else if (ndev<MAXDEV) strncpy(devs[ndev++].port,name,sizeof(devs[0].port)-1);
+}
+return ndev;
+}
+#endif
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+// long options
+static struct option longopts[]={
+#ifndef WIN32
+  {"wait",no_argument,NULL,'W'},
+  {"station",required_argument,NULL,'S'},
+  {"submit",required_argument,NULL,'J'},
+  {"cache",required_argument,NULL,'C'},
+  {"cache-size",required_argument,NULL,'Z'},
+#endif
+  {"json",no_argument,NULL,'j'},
+  {NULL,0,NULL,0}
+};
+
+//*************************************************
+//*  Parsing the keys
+//*
+//* Returns the index of the file name, 0 - stop (help or an error)
+//*************************************************
+int parse_opts(int argc, char* argv[], struct options* o) {
+
+int i,opt;
+
+#ifndef WIN32
+optind=0;  // full reinitialization, the station parses every job
+#endif
+while ((opt = getopt_long(argc, argv, "hp:ft:ms:bcx:w:r:d:", longopts, NULL)) != -1) {
+  switch (opt) {
+   case 'h':
+
+printf("\n The utility is intended for emergency USB-boot of devices on the Balong V7 chipset\n\n\
+%s [keys] <file name to download>\n\n\
+ The following keys are valid:\n\n"
+#ifndef WIN32
+"-p <tty> - serial port for communication with the bootloader\n"
+"           if the -p key is not specified, all ports in the boot mode are found via sysfs\n"
+"           several ports, comma-separated, repeated -p or a mask (-p '/dev/ttyUSB*')\n"
+"           are loaded at the same time\n"
+"-w n     - send up to n data packets without waiting for confirmation (1-32, default 1)\n"
+"-r n     - resend a rejected or unanswered packet up to n times (default 3)\n"
+"--wait   - wait for the boot port to appear and start the download at once\n"
+"           (the loader is prepared beforehand, the port is caught via kernel uevents)\n"
+"--station <socket> - flashing station: take jobs from a Unix socket and load them\n"
+"           into the boot ports as they appear, prepared loaders stay in memory\n"
+"--submit <socket>  - pass the download to the station instead of loading it\n"
+"--cache <dir> - keep the prepared loaders in the directory and reuse them\n"
+"           on later runs with the same loader, keys and signatures\n"
+"--cache-size n - limit the cache to n megabytes, the least recently used\n"
+"           loaders are removed (default 256)\n"
+#else
+"-p # - serial port number for communication with the bootloader (for example, -p8)\n"
+"  if the -p key is not specified, the port is automatically detected\n"
+#endif
+"-f       - load usbloader only to fastboot (without starting linux)\n\
+-b       - similar to -f, additionally disable checking for bad blocks when erasing\n\
+-t <file>- take the partition table from the specified file\n\
+-m       - show the bootloader partition table and exit\n\
+--json   - with -m: print the loader header and the partition table as JSON\n\
+-s n     - set the file flag for partition n (the key can be specified several times)\n\
+-c       - do not perform automatic patch for erasing partitions\n\
+-d <file>- take the patch signatures from the specified file instead of the built-in ones\n\
+-x <1-6> - bypass secuboot and load an unsigned bootloader (1=Balong V7R1, 2=V7R2/V7R11, 3=V7R22, 4=V7R5, 5=V7R65, 6=5000)\n\
+           (1) V7R1:  E3272, E3276, E5372 (Hi6920)\n\
+           (2) V7R2:  E3372s, E5373, E5377, E5786 (Hi6930)\n\
+           (2) V7R11: E3372h, E8372h, E5573, E5576, B310, B315s (Hi6921)\n\
+           (3) V7R22: E5785, E5885, B316, B525, B528, B535 (Hi6932)\n\
+           (4) V7R5:  B612s, B618s, B715s (Hi6950)\n\
+           (5) V7R65: B625, B818 (Hi6965)\n\
+           (6) 5000:  H112, H122, E6878 (Hi9500)\
+\n",argv[0]);
+    return 0;
+
+   case 'p':
+#ifndef WIN32
+    o->nports=add_ports(o->devs,o->nports,optarg);
+#else
+    strcpy(o->devname,optarg);
+#endif
+    break;
+
+#ifndef WIN32
+   case 'W':
+    o->waitflag=1;
+    break;
+
+   case 'S':
+    o->station=optarg;
+    break;
+
+   case 'J':
+    o->submit=optarg;
+    break;
+
+   case 'C':
+    o->cache=optarg;
+    break;
+
+   case 'Z':
+    o->cachesize=atoi(optarg);
+    if (o->cachesize<1) {
+      printf("\n Cache size must be at least 1 MB\n");
+      return 0;
+    }
+    break;
+#endif
+
+   case 'f':
+     o->fbflag=1;
+     break;
+
+   case 'c':
+     o->cflag=1;
+     break;
+
+   case 'b':
+     o->fbflag=1;
+     o->bflag=1;
+     break;
+
+   case 'm':
+     o->mflag=1;
+     break;
+
+   case 'j':
+     o->json=1;
+     break;
+
+   case 'd':
+     o->sigfile=optarg;
+     break;
 
    case 't':
-     tflag=1;
-     strcpy(ptfile,optarg);
+     o->tflag=1;
+     strncpy(o->ptfile,optarg,sizeof(o->ptfile)-1);
      break;
 
    case 's':
      i=atoi(optarg);
-     if (i>41) {
+     if ((i<0) || (i>=41)) {
        printf("\n Partition #%i does not exist\n",i);
-       return;
+       return 0;
+     }
+     o->fileflag[i]=1;
+     break;
+
+   case 'r':
+     o->retry=atoi(optarg);
+     break;
+
+   case 'w':
+     o->window=atoi(optarg);
+     if ((o->window<1) || (o->window>MAXWINDOW)) {
+       printf("\n Window size must be between 1 and %i\n",MAXWINDOW);
+       return 0;
      }
-     fileflag[i]=1;
      break;
 
     case 'x':
-     xflag=atoi(optarg);
-     if (xflag>6) {
-       printf("\n Secuboot bypass %d is not supported\n", xflag);
-       return;
+     o->xflag=atoi(optarg);
+     if (o->xflag>6) {
+       printf("\n Secuboot bypass %d is not supported\n", o->xflag);
+       return 0;
      }
      break;
 
    case '?':
-   case ':':  
-     return;
-    
+   case ':':
+     return 0;
+
   }
-}  
+}
+return optind;
+}
 
-printf("\n Balong chipset emergency USB loader, version 2.20, (c) forth32, 2015");
-#ifdef WIN32
-printf("\n Port for Windows 32bit  (c) rust3028, 2016");
+//*************************************************
+//*  Releasing a prepared loader
+//*************************************************
+void release_image(struct image* img) {
+
+free_frames(&img->fr);
+#ifndef WIN32
+if (img->map != NULL) munmap(img->map,img->mapsize);
+img->map=NULL;
+#else
+free(img->pbuf[0]);
+free(img->pbuf[1]);
+img->pbuf[0]=img->pbuf[1]=NULL;
 #endif
+}
+
+//*************************************************
+//*  Preparation errors
+//*************************************************
+static char preperr[300];
 
+static int prepfail(struct image* img, const char* fmt, ...) {
 
-if (optind>=argc) {
-    printf("\n - No file name specified for download\n");
-    return;
-}  
+va_list ap;
 
-ldr=fopen(argv[optind],"rb");
-if (ldr == 0) {
-  printf("\n Error opening %s",argv[optind]);
-  return;
+va_start(ap,fmt);
+vsnprintf(preperr,sizeof(preperr),fmt,ap);
+va_end(ap);
+release_image(img);
+return 0;
 }
 
+//*************************************************
+//*  Preparing the loader for the download
+//*
+//* The components are read, patched according to the options and all packets
+//* are built. On an error 0 is returned and the reason is left in preperr.
+//*************************************************
+int prepare(struct image* img, const char* file, struct options* o) {
+
+FILE* ldr;
+unsigned int i,res;
+int bl;
+int koff;  // offset to ANDROID-header
+FILE* pt;
+char ptbuf[2048];
+uint32_t ptoff;
+uint32_t hits[MAXSIG];  // patch signatures found
+
+struct {
+  int lmode;  // boot mode: 1 - direct start, 2 - via A-core restart
+  int size;   // component size
+  int adr;    // component loading address in memory
+  int offset; // offset to the component from the beginning of the file
+  char* pbuf; // buffer for loading the component image
+} blk[10];
+
+#ifndef WIN32
+struct stat ldrstat;
+#endif
+
+memset(img,0,sizeof(*img));
+ldr=fopen(file,"rb");
+if (ldr == 0) return prepfail(img,"Error opening %s",file);
+
 // Checking the usloader signature
 fread(&i,1,4,ldr);
 if (i != 0x20000) {
-  printf("\n The file %s is not a usbloader loader\n",argv[optind]);
-  return;
-}  
+  fclose(ldr);
+  return prepfail(img,"The file %s is not a usbloader loader",file);
+}
 
 fseek(ldr,36,SEEK_SET); // beginning of block descriptors for loading
 
@@ -425,230 +1238,1313 @@ fread(&blk[1],1,16,ldr);  // usbldr
 
 //---------------------------------------------------------------------
 // Reading components into memory
+#ifndef WIN32
+// The loader is mapped privately: the frames are sent straight from the
+// mapping, and only the pages touched by the patches get copied.
+fstat(fileno(ldr),&ldrstat);
+img->map=mmap(NULL,ldrstat.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fileno(ldr),0);
+if (img->map == MAP_FAILED) {
+  img->map=NULL;
+  fclose(ldr);
+  return prepfail(img,"Error mapping %s",file);
+}
+img->mapsize=ldrstat.st_size;
+fclose(ldr);
+#endif
+
 for(bl=0;bl<2;bl++) {
 
+#ifndef WIN32
+  if ((uint64_t)(unsigned)blk[bl].offset+(unsigned)blk[bl].size > (uint64_t)ldrstat.st_size) {
+      res=(blk[bl].offset<ldrstat.st_size)?(ldrstat.st_size-blk[bl].offset):0;
+      return prepfail(img,"Unexpected end of file: read %i expected %i",res,blk[bl].size);
+  }
+  blk[bl].pbuf=img->map+blk[bl].offset;
+#else
   // allocate memory for the full partition image
   blk[bl].pbuf=(char*)malloc(blk[bl].size);
+  img->pbuf[bl]=blk[bl].pbuf;
 
   // read the partition image into memory
   fseek(ldr,blk[bl].offset,SEEK_SET);
   res=fread(blk[bl].pbuf,1,blk[bl].size,ldr);
   if (res != blk[bl].size) {
-      printf("\n Unexpected end of file: read %i expected %i\n",res,blk[bl].size);
-      return;
+      fclose(ldr);
+      return prepfail(img,"Unexpected end of file: read %i expected %i",res,blk[bl].size);
   }
+  if (bl == 1) fclose(ldr);
+#endif
   if (bl == 0) continue; // for raminit nothing more needs to be done
 
-  //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%    
+  //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
   // fastboot-patch
-  if (fbflag) {
-    koff=locate_kernel(blk[bl].pbuf,blk[bl].size);
+  if (o->fbflag) {
+    koff=locate_kernel(blk[bl].pbuf,blk[bl].size,&img->boot);
     if (koff != 0) {
+      img->boot.off+=blk[bl].offset;
       blk[bl].pbuf[koff]=0x55; // patch signature
       blk[bl].size=koff+8; // truncate the partition to the beginning of the kernel
     }
-    else {
-        printf("\n There is no ANDROID-component in the loader - fastboot-boot is not possible\n");
-        exit(0);
-    }    
-  }  
+    else return prepfail(img,"There is no ANDROID-component in the loader - fastboot-boot is not possible");
+  }
 
-  //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%    
+  //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
   // Search for the partition table in the loader
   ptoff=find_ptable_ram(blk[bl].pbuf,blk[bl].size);
-  
-  //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%    
+
+  //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
   // patch partition table
-  if (tflag) {
-    pt=fopen(ptfile,"rb");
-    if (pt == 0) { 
-      printf("\n File not found %s - replacing the partition table is not possible\n",ptfile);
-      return;
-    }  
+  if (o->tflag) {
+    pt=fopen(o->ptfile,"rb");
+    if (pt == 0) return prepfail(img,"File not found %s - replacing the partition table is not possible",o->ptfile);
     fread(ptbuf,1,2048,pt);
     fclose(pt);
-    if (memcmp(headmagic,ptbuf,sizeof(headmagic)) != 0) {
-      printf("\n The file %s is not a partition table\n",ptfile);
-      return;
-    }  
-    if (ptoff == 0) {
-          printf("\n Partition table not found in the loader - replacement is not possible");
-	  return;
-    }
+    if (memcmp(headmagic,ptbuf,sizeof(headmagic)) != 0) return prepfail(img,"The file %s is not a partition table",o->ptfile);
+    if (ptoff == 0) return prepfail(img,"Partition table not found in the loader - replacement is not possible");
     memcpy(blk[bl].pbuf+ptoff,ptbuf,2048);
   }
-  ptable=(struct ptable_t*)(blk[bl].pbuf+ptoff);
-  
-  //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%    
+  if (ptoff != 0) img->ptable=(struct ptable_t*)(blk[bl].pbuf+ptoff);
+
+  //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
   // Patch file flags
   for(i=0;i<41;i++) {
-    if (fileflag[i]) {
-      ptable->part[i].nproperty |= 1;
-    }  
-  }  
-
-  //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%    
-  // Output of the partition table
-  if (mflag) {
-    if (ptoff == 0) {
-      printf("\n Partition table not found - map output is not possible\n");
-      return;
+    if (o->fileflag[i]) {
+      if (ptoff == 0) return prepfail(img,"Partition table not found in the loader - the file flag cannot be set");
+      img->ptable->part[i].nproperty |= 1;
     }
-    show_map(*ptable);
-    return;
   }
 
+  // All patch signatures are found in one pass
+  if (o->bflag || !o->cflag) scan_signatures((uint8_t*)blk[bl].pbuf, blk[bl].size, hits);
+
   // Patch erase-procedure to ignore bad blocks
-  if (bflag) {
-    res=perasebad(blk[bl].pbuf, blk[bl].size);
-    if (res == 0) { 
-      printf("\n! isbad signature not found - loading is not possible\n");  
-      return;
-    }  
+  if (o->bflag) {
+    res=pisbad((uint8_t*)blk[bl].pbuf, blk[bl].size, hits);
+    if (res == 0) return prepfail(img,"! isbad signature not found - loading is not possible");
   }
   // Removing the flash_eraseall procedure
-  if (!cflag) {
-      res = pv7r1(blk[bl].pbuf, blk[bl].size);
-      if (res == 0)
-          res = pv7r2(blk[bl].pbuf, blk[bl].size);
-      if (res == 0)
-          res = pv7r11(blk[bl].pbuf, blk[bl].size);
-      if (res == 0)
-          res = pv7r22(blk[bl].pbuf, blk[bl].size);
-      if (res == 0)
-          res = pv7r22_2(blk[bl].pbuf, blk[bl].size);
-      if (res == 0)
-          res = pv7r22_3(blk[bl].pbuf, blk[bl].size);
-      if (res != 0)  printf("\n\n * Removed flash_eraseall procedure at offset %08x", blk[bl].offset + res);
-      else {
-          printf("\n The eraseall procedure was not found in the loader - use the -c key to load without a patch!\n");
-          return;
-      }
+  if (!o->cflag) {
+      res = peraseall((uint8_t*)blk[bl].pbuf, blk[bl].size, hits, &img->family);
+      if (res == 0) return prepfail(img,"The eraseall procedure was not found in the loader - use the -c key to load without a patch!");
+      img->patchoff=blk[bl].offset + res;
   }
 
 }
 
 //---------------------------------------------------------------------
+// Building all packets of the download before the port is opened
 
-#ifdef WIN32
-if (*devname == '\0')
-{
-  printf("\n\nSearching for emergency boot port...\n");
-  
-  if (find_port(&port_no, port_name) == 0)
-  {
-    sprintf(devname, "%d", port_no);
-    printf("Port: \"%s\"\n", port_name);
-  }
-  else
-  {
-    printf("Port not found!\n");
-    return;
+for(bl=0;bl<2;bl++) {
+  if (!build_frames(&img->fr,bl,blk[bl].lmode,blk[bl].adr,(uint8_t*)blk[bl].pbuf,blk[bl].size)) {
+    return prepfail(img,"Not enough memory for the packets of the download");
   }
 }
-#endif
+return 1;
+}
 
-if (!open_port(devname)) {
-  printf("\n Serial port does not open\n");
-  return;
-}  
+//*************************************************
+//*  JSON string from a fixed-size field
+//*************************************************
+static void json_field(const char* str, int len) {
 
+int i;
 
-// Checking the boot port
-c=0;
+putchar('"');
+for(i=0;(i<len) && (str[i] != 0);i++) {
+  if ((str[i] == '"') || (str[i] == '\\')) printf("\\%c",str[i]);
+  else if ((uint8_t)str[i]<0x20) printf("\\u%04x",(uint8_t)str[i]);
+  else putchar(str[i]);
+}
+putchar('"');
+}
+
+//*************************************************
+//*  Output of the partition table (-m)
+//*
+//* Only the header and the usbldr component up to the table are read,
+//* nothing is copied, patched or built, so the map of a large loader or of
+//* one on a network share comes in milliseconds. -t and -s are applied to
+//* the table shown; the fastboot truncation (-f) is not.
+//*************************************************
+static int inspect(const char* file, struct options* o) {
+
+FILE* ldr;
+FILE* pt;
+uint32_t hdr[17];     // signature, reserved, raminit and usbldr descriptors
+uint32_t* blk;
+struct ptable_t ptable;
+uint32_t ptoff;
+long fsize;
+int i,bl,n;
+static const char* blkname[2]={"raminit","usbldr"};
 #ifndef WIN32
-write(siofd,"A",1);
-res=read(siofd,&c,1);
+char* map;
+uint32_t pg;
 #else
-    WriteFile(hSerial, "A", 1, &bytes_written, NULL);
-    FlushFileBuffers(hSerial);
-    Sleep(100);
-    ReadFile(hSerial, &c, 1, &bytes_read, NULL);
+uint64_t pos;
 #endif
-if (c != 0x55) {
-  printf("\n ! The port is not in USB Boot mode\n");
-  return;
-}  
-
-//----------------------------------
-// main download cycle - load all blocks found in the header
-//%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%    
 
-switch (xflag) {
-    case 1:
-        secuboot_exploit_v7r1();
-        break;
-    case 2:
-        secuboot_exploit_v7r11();
-        break;
-    case 3:
-        secuboot_exploit_v7r22();
-        break;
-    case 4:
-        secuboot_exploit_v7r5();
-        break;
-    case 6:
-        secuboot_exploit_5000();
-        break;
+ldr=fopen(file,"rb");
+if (ldr == 0) {
+  printf("\n Error opening %s\n",file);
+  return 0;
+}
+if ((fread(hdr,1,sizeof(hdr),ldr) != sizeof(hdr)) || (hdr[0] != 0x20000)) {
+  fclose(ldr);
+  printf("\n The file %s is not a usbloader loader\n",file);
+  return 0;
+}
+fseek(ldr,0,SEEK_END);
+fsize=ftell(ldr);
+// usbldr: lmode, size, address, offset
+blk=hdr+13;
+if ((uint64_t)blk[3]+blk[1] > (uint64_t)fsize) {
+  fclose(ldr);
+  printf("\n Unexpected end of file: read %li expected %u\n",(blk[3]<fsize)?fsize-(long)blk[3]:0,blk[1]);
+  return 0;
 }
 
-printf("\n\n Component    Address    Size   %%download\n------------------------------------------\n");
+// the table is searched in the usbldr image only
+memset(&ptable,0,sizeof(ptable));
+#ifndef WIN32
+// read-only mapping from usbldr on: only the pages up to the table are read
+pg=blk[3]&~(uint32_t)(sysconf(_SC_PAGESIZE)-1);
+map=mmap(NULL,fsize-pg,PROT_READ,MAP_PRIVATE,fileno(ldr),pg);
+fclose(ldr);
+if (map == MAP_FAILED) {
+  printf("\n Error mapping %s\n",file);
+  return 0;
+}
+ptoff=find_ptable_ram(map+blk[3]-pg,blk[1]);
+if (ptoff != 0) {
+  ptoff+=blk[3];
+  memcpy(&ptable,map+ptoff-pg,(fsize-ptoff<sizeof(ptable))?fsize-ptoff:sizeof(ptable));
+}
+munmap(map,fsize-pg);
+#else
+fseek(ldr,blk[3],SEEK_SET);
+pos=find_ptable(ldr);
+if ((pos != 0) && (pos+16 > (uint64_t)blk[3]+blk[1])) pos=0;
+ptoff=(uint32_t)pos;
+if (ptoff != 0) fread(&ptable,1,sizeof(ptable),ldr);
+fclose(ldr);
+#endif
 
-for(bl=0;bl<2;bl++) {
+if (o->tflag) {
+  pt=fopen(o->ptfile,"rb");
+  if (pt == 0) {
+    printf("\n File not found %s\n",o->ptfile);
+    return 0;
+  }
+  memset(&ptable,0,sizeof(ptable));
+  fread(&ptable,1,sizeof(ptable),pt);
+  fclose(pt);
+  if (memcmp(headmagic,ptable.head,sizeof(headmagic)) != 0) {
+    printf("\n The file %s is not a partition table\n",o->ptfile);
+    return 0;
+  }
+}
+for(i=0;i<41;i++) {
+  if (o->fileflag[i]) ptable.part[i].nproperty |= 1;
+}
 
-  datasize=1024;
-  pktcount=1;
+if (!o->json) {
+  if (ptoff == 0) {
+    printf("\n Partition table not found - map output is not possible\n");
+    return 0;
+  }
+  show_map(ptable);
+  return 1;
+}
 
+printf("{\"file\": ");
+json_field(file,strlen(file));
+printf(", \"size\": %li",fsize);
+for(bl=0;bl<2;bl++) {
+  printf(", \"%s\": {\"mode\": %u, \"size\": %u, \"address\": %u, \"offset\": %u}",
+    blkname[bl],hdr[9+4*bl],hdr[10+4*bl],hdr[11+4*bl],hdr[12+4*bl]);
+}
+if (ptoff == 0) {
+  printf(", \"ptable\": null}\n");
+  return 0;
+}
+printf(", \"ptable\": {\"offset\": %u, \"version\": ",ptoff);
+json_field((char*)ptable.version,16);
+printf(", \"product\": ");
+json_field((char*)ptable.product,16);
+printf(", \"partitions\": [");
+// the list ends like in show_map()
+for(n=0;(n<41) && (ptable.part[n].name[0] != 0) && (strcmp(ptable.part[n].name,"T") != 0);n++) {
+  printf("%s\n  {\"n\": %i, \"name\": ",n?",":"",n);
+  json_field(ptable.part[n].name,16);
+  printf(", \"start\": %u, \"length\": %u, \"lsize\": %u, \"loadaddr\": %u, \"entry\": %u, \"flags\": %u, \"type\": %u, \"count\": %u}",
+    ptable.part[n].start,ptable.part[n].length,ptable.part[n].lsize,ptable.part[n].loadaddr,
+    ptable.part[n].entry,ptable.part[n].nproperty,ptable.part[n].type,ptable.part[n].count);
+}
+printf("%s]}}\n",n?"\n":"");
+return 1;
+}
 
-  // form the block start packet
-  *((unsigned int*)&cmdhead[4])=htonl(blk[bl].size);
-  *((unsigned int*)&cmdhead[8])=htonl(blk[bl].adr);
-  cmdhead[3]=blk[bl].lmode;
-  
-  // send the block start packet
-  res=sendcmd(cmdhead,14);
-  if (!res) {
-    printf("\nModem rejected header packet\n");
-    return;
-  }  
+#ifndef WIN32
+//*************************************************
+//*  On-disk cache of prepared loaders (--cache)
+//*
+//* An entry <key>.ldr holds the patched components and the packet arena
+//* of one prepared loader and is mapped as it is on a hit. Since hashing
+//* the loader costs more than preparing it, the contents hash of a loader
+//* file is kept in <dev>-<inode>.id and trusted while the size and the
+//* modification and change times of the file are the same. The
+//* modification time of the files is their last use; the oldest ones are
+//* removed when the directory grows over the limit.
+//*************************************************
 
-  
-  // ---------- Block data loading cycle ---------------------
-  for(adr=0;adr<blk[bl].size;adr+=1024) {
+#define CACHEVERSION 2
+
+static char* cachedir=NULL;
+static uint64_t cachelimit=256ULL<<20;
+static unsigned int cachehits=0,cachemisses=0;
+static int cacheevicted;  // entries removed by the last cache_store()
+
+// contents hash of a loader file
+struct fileid {
+  char magic[8];
+  int64_t size;
+  int64_t mtime[2];      // seconds, nanoseconds
+  int64_t ctime[2];
+  uint8_t hash[32];
+};
+
+// head of a cache entry, the component images and the arena follow
+struct cachehdr {
+  char magic[8];
+  uint8_t key[32];
+  uint64_t size;         // whole entry
+  int32_t patchoff;
+  int32_t family;
+  struct bootinfo boot;
+  uint32_t nblk;
+  struct {
+    uint32_t lmode,adr,size;
+    uint32_t offset;     // of the image in the entry
+  } blk[MAXFRAMEBLK];
+  uint32_t arenaoff,arenasize;
+};
+
+static const char idmagic[8]="BLDRID1";
+static const char entrymagic[8]="BLDRIMG";
 
-    // form the size of the last loaded packet
-    if ((adr+1024)>=blk[bl].size) datasize=blk[bl].size-adr;  
+//*************************************************
+//*  Writing a whole buffer
+//*************************************************
+static int writeall(int fd, const void* buf, size_t len) {
 
-    printf("\r %s    %08x %8i   %i%%",bl?"usbboot":"raminit",blk[bl].adr,blk[bl].size,(adr+datasize)*100/blk[bl].size); 
-  
-    // prepare a data packet
-    cmddata[1]=pktcount;
-    cmddata[2]=(~pktcount)&0xff;
-    memcpy(cmddata+3,blk[bl].pbuf+adr,datasize);
-    
-    pktcount++;
-    if (!sendcmd(cmddata,datasize+5)) {
-      printf("\nModem rejected data packet");
-      return;
-    }  
-  }
-  free(blk[bl].pbuf);
+const char* p=buf;
+ssize_t res;
 
-  // Form the end of data packet
-  cmdeod[1]=pktcount;
-  cmdeod[2]=(~pktcount)&0xff;
+while (len>0) {
+  res=write(fd,p,len);
+  if (res <= 0) return 0;
+  p+=res;
+  len-=res;
+}
+return 1;
+}
 
-  if (xflag == 5 && bl == 1) {
-    secuboot_exploit_v7r65(blk[bl].adr + 0x1000);
-    break;
+//*************************************************
+//*  Replacing a cache file: written under a temporary name and renamed,
+//*  so a reader never sees it half written
+//*************************************************
+static int cache_write(const char* name, const void* head, size_t hlen, struct frames* fr) {
+
+char path[PATH_MAX],tmp[PATH_MAX];
+int fd,bl,ok;
+
+mkdir(cachedir,0755);
+snprintf(path,sizeof(path),"%s/%s",cachedir,name);
+snprintf(tmp,sizeof(tmp),"%s/.%s.%i",cachedir,name,getpid());
+fd=open(tmp,O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+if (fd<0) return 0;
+ok=writeall(fd,head,hlen);
+if (fr != NULL) {
+  for(bl=0;bl<fr->nblk;bl++) ok=ok && writeall(fd,fr->blk[bl].payload,fr->blk[bl].size);
+  ok=ok && writeall(fd,fr->arena,fr->size);
+}
+if ((close(fd) != 0) || !ok || (rename(tmp,path) != 0)) {
+  unlink(tmp);
+  return 0;
+}
+return 1;
+}
+
+//*************************************************
+//*  Contents hash of a loader file from the cache
+//*************************************************
+static int cached_hash(struct stat* st, uint8_t* hash) {
+
+char path[PATH_MAX];
+struct fileid id;
+int fd,res;
+
+if (cachedir == NULL) return 0;
+snprintf(path,sizeof(path),"%s/%llx-%llx.id",cachedir,(unsigned long long)st->st_dev,(unsigned long long)st->st_ino);
+fd=open(path,O_RDONLY|O_CLOEXEC);
+if (fd<0) return 0;
+res=read(fd,&id,sizeof(id));
+if (res == sizeof(id)) futimens(fd,NULL);
+close(fd);
+if ((res != sizeof(id)) || (memcmp(id.magic,idmagic,8) != 0) || (id.size != st->st_size) ||
+    (id.mtime[0] != st->st_mtim.tv_sec) || (id.mtime[1] != st->st_mtim.tv_nsec) ||
+    (id.ctime[0] != st->st_ctim.tv_sec) || (id.ctime[1] != st->st_ctim.tv_nsec)) return 0;
+memcpy(hash,id.hash,32);
+return 1;
+}
+
+static void store_hash(struct stat* st, uint8_t* hash) {
+
+char name[80];
+struct fileid id;
+
+if (cachedir == NULL) return;
+memset(&id,0,sizeof(id));
+memcpy(id.magic,idmagic,8);
+id.size=st->st_size;
+id.mtime[0]=st->st_mtim.tv_sec;
+id.mtime[1]=st->st_mtim.tv_nsec;
+id.ctime[0]=st->st_ctim.tv_sec;
+id.ctime[1]=st->st_ctim.tv_nsec;
+memcpy(id.hash,hash,32);
+snprintf(name,sizeof(name),"%llx-%llx.id",(unsigned long long)st->st_dev,(unsigned long long)st->st_ino);
+cache_write(name,&id,sizeof(id),NULL);
+}
+
+//*************************************************
+//*  Cache key of a prepared loader
+//*
+//* SHA-256 over the hash of the loader contents, the options that change
+//* the image, the replacement partition table and the signature database.
+//* The contents hash is remembered per file (device, inode, size,
+//* modification and change times, as in the .id record), so an unchanged
+//* loader is not read again.
+//*************************************************
+#define MAXHASHES 32
+
+static struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime,ctime;
+  uint8_t hash[32];
+} filehash[MAXHASHES];
+static int nexthash=0;
+
+int image_key(const char* file, struct options* o, uint8_t* key) {
+
+int fd,i;
+struct stat st;
+void* map;
+uint8_t hash[32];
+uint8_t flags[3];
+uint64_t sigs;
+int version=CACHEVERSION;
+char ptbuf[2048];
+FILE* pt;
+struct sha256 ctx;
+
+fd=open(file,O_RDONLY);
+if (fd<0) return 0;
+if ((fstat(fd,&st) != 0) || (st.st_size == 0)) {
+  close(fd);
+  return 0;
+}
+for(i=0;i<MAXHASHES;i++) {
+  if ((filehash[i].ino == st.st_ino) && (filehash[i].dev == st.st_dev) && (filehash[i].size == st.st_size) &&
+      (filehash[i].mtime.tv_sec == st.st_mtim.tv_sec) && (filehash[i].mtime.tv_nsec == st.st_mtim.tv_nsec) &&
+      (filehash[i].ctime.tv_sec == st.st_ctim.tv_sec) && (filehash[i].ctime.tv_nsec == st.st_ctim.tv_nsec)) break;
+}
+if (i<MAXHASHES) {
+  close(fd);
+  memcpy(hash,filehash[i].hash,32);
+}
+else {
+  if (cached_hash(&st,hash)) close(fd);
+  else {
+    map=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    sha256(map,st.st_size,hash);
+    munmap(map,st.st_size);
+    store_hash(&st,hash);
+  }
+  i=nexthash;
+  nexthash=(nexthash+1)%MAXHASHES;
+  filehash[i].dev=st.st_dev;
+  filehash[i].ino=st.st_ino;
+  filehash[i].size=st.st_size;
+  filehash[i].mtime=st.st_mtim;
+  filehash[i].ctime=st.st_ctim;
+  memcpy(filehash[i].hash,hash,32);
+}
+
+flags[0]=o->fbflag;
+flags[1]=o->bflag;
+flags[2]=o->cflag;
+sigs=sig_digest();
+sha256_init(&ctx);
+sha256_update(&ctx,&version,sizeof(version));
+sha256_update(&ctx,hash,sizeof(hash));
+sha256_update(&ctx,flags,sizeof(flags));
+sha256_update(&ctx,o->fileflag,sizeof(o->fileflag));
+sha256_update(&ctx,&sigs,sizeof(sigs));
+if (o->tflag) {
+  pt=fopen(o->ptfile,"rb");
+  if (pt == NULL) return 0;
+  memset(ptbuf,0,sizeof(ptbuf));
+  fread(ptbuf,1,sizeof(ptbuf),pt);
+  fclose(pt);
+  sha256_update(&ctx,ptbuf,sizeof(ptbuf));
+}
+sha256_final(&ctx,key);
+return 1;
+}
+
+//*************************************************
+//*  Name of the cache entry of a key
+//*************************************************
+static void entry_name(const uint8_t* key, char* name) {
+
+sha256_hex(key,name);
+strcpy(name+64,".ldr");
+}
+
+//*************************************************
+//*  Mapping a prepared loader from the cache
+//*************************************************
+static int cache_load(struct image* img, const uint8_t* key) {
+
+char path[PATH_MAX],name[80];
+struct stat st;
+struct cachehdr* h;
+char* map;
+uint64_t need;
+int fd,bl;
+
+entry_name(key,name);
+snprintf(path,sizeof(path),"%s/%s",cachedir,name);
+fd=open(path,O_RDONLY|O_CLOEXEC);
+if (fd<0) return 0;
+if ((fstat(fd,&st) != 0) || (st.st_size<sizeof(struct cachehdr))) {
+  close(fd);
+  return 0;
+}
+map=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+if (map == MAP_FAILED) {
+  close(fd);
+  return 0;
+}
+futimens(fd,NULL);  // the last use
+close(fd);
+
+memset(img,0,sizeof(*img));
+img->map=map;
+img->mapsize=st.st_size;
+h=(struct cachehdr*)map;
+if ((memcmp(h->magic,entrymagic,8) != 0) || (memcmp(h->key,key,32) != 0) || (h->size != st.st_size) ||
+    (h->nblk != MAXFRAMEBLK) || ((uint64_t)h->arenaoff+h->arenasize > st.st_size)) goto bad;
+// the arena must have the layout restore_frames() expects
+need=0;
+for(bl=0;bl<h->nblk;bl++) {
+  if ((h->blk[bl].size == 0) || ((uint64_t)h->blk[bl].offset+h->blk[bl].size > st.st_size)) goto bad;
+  need+=14+(h->blk[bl].size+DATALEN-1)/DATALEN*5+5;
+}
+if (need != h->arenasize) goto bad;
+for(bl=0;bl<h->nblk;bl++) {
+  if (!restore_frames(&img->fr,bl,h->blk[bl].lmode,h->blk[bl].adr,(uint8_t*)map+h->blk[bl].offset,h->blk[bl].size,(uint8_t*)map+h->arenaoff)) goto bad;
+}
+img->patchoff=h->patchoff;
+img->family=h->family;
+img->boot=h->boot;
+memcpy(img->key,key,32);
+return 1;
+
+bad:
+release_image(img);
+memset(img,0,sizeof(*img));
+return 0;
+}
+
+//*************************************************
+//*  Removing the least recently used files over the size limit
+//*************************************************
+struct cachefile {
+  char name[80];
+  struct timespec used;
+  off_t size;
+};
+
+static int older(const void* a, const void* b) {
+
+const struct cachefile* x=a;
+const struct cachefile* y=b;
+
+if (x->used.tv_sec != y->used.tv_sec) return (x->used.tv_sec<y->used.tv_sec)?-1:1;
+if (x->used.tv_nsec != y->used.tv_nsec) return (x->used.tv_nsec<y->used.tv_nsec)?-1:1;
+return 0;
+}
+
+static int cache_trim(const char* keep) {
+
+struct dirent** names;
+struct cachefile* files;
+struct stat st;
+char path[PATH_MAX];
+uint64_t total=0;
+int i,n,nf=0,evicted=0;
+const char* ext;
+
+n=scandir(cachedir,&names,NULL,NULL);
+if (n<0) return 0;
+files=malloc(n*sizeof(struct cachefile));
+for(i=0;i<n;i++) {
+  ext=strrchr(names[i]->d_name,'.');
+  if ((files != NULL) && (ext != NULL) && (names[i]->d_name[0] != '.') && ((strcmp(ext,".ldr") == 0) || (strcmp(ext,".id") == 0)) &&
+      (strlen(names[i]->d_name)<sizeof(files[0].name))) {
+    snprintf(path,sizeof(path),"%s/%s",cachedir,names[i]->d_name);
+    if ((stat(path,&st) == 0) && S_ISREG(st.st_mode)) {
+      strcpy(files[nf].name,names[i]->d_name);
+      files[nf].used=st.st_mtim;
+      files[nf].size=st.st_size;
+      total+=st.st_size;
+      nf++;
+    }
+  }
+  free(names[i]);
+}
+free(names);
+if (total>cachelimit) {
+  qsort(files,nf,sizeof(struct cachefile),older);
+  for(i=0;(i<nf) && (total>cachelimit);i++) {
+    if (strcmp(files[i].name,keep) == 0) continue;
+    snprintf(path,sizeof(path),"%s/%s",cachedir,files[i].name);
+    if (unlink(path) != 0) continue;
+    total-=files[i].size;
+    evicted++;
   }
+}
+free(files);
+return evicted;
+}
+
+//*************************************************
+//*  Storing a prepared loader in the cache
+//*************************************************
+static int cache_store(struct image* img) {
+
+struct cachehdr h;
+char name[80];
+uint32_t off;
+int bl;
+
+memset(&h,0,sizeof(h));
+memcpy(h.magic,entrymagic,8);
+memcpy(h.key,img->key,32);
+h.patchoff=img->patchoff;
+h.family=img->family;
+h.boot=img->boot;
+h.nblk=img->fr.nblk;
+off=sizeof(h);
+for(bl=0;bl<img->fr.nblk;bl++) {
+  h.blk[bl].lmode=img->fr.blk[bl].lmode;
+  h.blk[bl].adr=img->fr.blk[bl].adr;
+  h.blk[bl].size=img->fr.blk[bl].size;
+  h.blk[bl].offset=off;
+  off+=img->fr.blk[bl].size;
+}
+h.arenaoff=off;
+h.arenasize=img->fr.size;
+h.size=off+img->fr.size;
+
+entry_name(img->key,name);
+cacheevicted=0;
+if (!cache_write(name,&h,sizeof(h),&img->fr)) return 0;
+cacheevicted=cache_trim(name);
+return 1;
+}
+
+//*************************************************
+//*  Prepared loader, from the disk cache if there is one
+//*
+//* key is the image_key() of the loader and the options. *cached is 1 if
+//* the loader came from the cache; a loader prepared now is stored there.
+//*************************************************
+int load_image(struct image* img, const char* file, struct options* o, const uint8_t* key, int* cached) {
 
-  if (!sendcmd(cmdeod,5)) {
-    printf("\nModem rejected end of data packet");
+*cached=0;
+if (cachedir != NULL) {
+  if (cache_load(img,key)) {
+    cachehits++;
+    *cached=1;
+    return 1;
   }
-printf("\n");  
-} 
-printf("\n Download finished\n");  
+  cachemisses++;
+}
+if (!prepare(img,file,o)) return 0;
+memcpy(img->key,key,32);
+if ((cachedir != NULL) && !cache_store(img)) printf("\n Warning: cannot write the loader cache in %s",cachedir);
+return 1;
+}
+
+//*************************************************
+//*  Flashing station (--station)
+//*
+//* A job is one line of the usual keys and the loader name, for example
+//* "-c -x2 /srv/usblsafe-e303.bin", sent over the Unix socket. Prepared
+//* loaders stay in memory keyed by image_key(), so a repeated job costs only
+//* the transfer. Queued jobs are loaded into the boot ports in the order the
+//* ports appear; a job with -p waits for its own port. The client gets the
+//* progress of its job as text lines:
+//*   queued <n> | start <port> | done <port> <seconds> <KB/s> | failed <port> <reason> | error <reason>
+//*************************************************
+
+#define MAXIMAGES 16   // prepared loaders kept in memory
+#define MAXJOBS 64     // connections: jobs being received, queued and running
+
+struct job {
+  int fd;              // client connection, -1 - free slot
+  int state;           // 0 - receiving, 1 - queued, 2 - running
+  int gone;            // the client has hung up
+  char line[1024];     // job text
+  int len;
+  unsigned int no;
+  struct image* img;
+  struct device dev;   // -p port (empty - any), then the device being loaded
+};
+
+static struct image images[MAXIMAGES];
+static int nimages=0;
+
+// ports that got their job and have not left the boot mode yet
+static char doneports[MAXDEV][100];
+static int ndone=0;
+
+//*************************************************
+//*  Message to the job client
+//*************************************************
+static void jobmsg(struct job* j, const char* fmt, ...) {
+
+char buf[400];
+va_list ap;
+int len;
+
+va_start(ap,fmt);
+len=vsnprintf(buf,sizeof(buf)-1,fmt,ap);
+va_end(ap);
+if (len>sizeof(buf)-2) len=sizeof(buf)-2;
+buf[len++]='\n';
+send(j->fd,buf,len,MSG_NOSIGNAL);
+}
+
+//*************************************************
+//*  Closing a job
+//*************************************************
+static void endjob(struct job* j) {
+
+if (j->img != NULL) j->img->refs--;
+j->img=NULL;
+close(j->fd);
+j->fd=-1;
+}
+
+//*************************************************
+//*  Moving a prepared loader into anonymous memory
+//*
+//* The station keeps the image for its whole life, and a private file
+//* mapping still reads the untouched pages from the file: a loader rewritten
+//* in place would go out with stale CRCs, a truncated one would fault.
+//*************************************************
+static int detach_image(struct image* img) {
+
+char* copy;
+int bl;
+
+copy=mmap(NULL,img->mapsize,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+if (copy == MAP_FAILED) {
+  snprintf(preperr,sizeof(preperr),"Not enough memory for the loader");
+  release_image(img);
+  return 0;
+}
+memcpy(copy,img->map,img->mapsize);
+for(bl=0;bl<img->fr.nblk;bl++) img->fr.blk[bl].payload=(uint8_t*)copy+(img->fr.blk[bl].payload-(uint8_t*)img->map);
+if (img->ptable != NULL) img->ptable=(struct ptable_t*)(copy+((char*)img->ptable-img->map));
+munmap(img->map,img->mapsize);
+img->map=copy;
+return 1;
+}
+
+//*************************************************
+//*  Prepared loader for a job, from memory, the disk cache or made now
+//*
+//* *cached: 2 - in memory, 1 - from the disk cache, 0 - prepared
+//*************************************************
+static struct image* get_image(const char* file, struct options* o, int* cached) {
+
+uint8_t key[32];
+struct image* img=NULL;
+int i;
+
+if (!image_key(file,o,key)) {
+  snprintf(preperr,sizeof(preperr),"Error reading %s",file);
+  return NULL;
+}
+for(i=0;i<nimages;i++) {
+  if (memcmp(images[i].key,key,32) == 0) {
+    *cached=2;
+    images[i].used=now_us();
+    return &images[i];
+  }
+}
+if (nimages<MAXIMAGES) img=&images[nimages++];
+else {
+  // evicting the least recently used image not taken by a job
+  for(i=0;i<nimages;i++) {
+    if (images[i].refs != 0) continue;
+    if ((img == NULL) || (images[i].used<img->used)) img=&images[i];
+  }
+  if (img == NULL) {
+    snprintf(preperr,sizeof(preperr),"All %i cached loaders are in use",MAXIMAGES);
+    return NULL;
+  }
+  release_image(img);
+}
+if (!load_image(img,file,o,key,cached) || !detach_image(img)) {
+  // the slot stays empty for the next loader
+  memset(img,0,sizeof(*img));
+  return NULL;
+}
+img->used=now_us();
+return img;
+}
+
+//*************************************************
+//*  Accepting a received job line
+//*************************************************
+static void take_job(struct job* j, struct options* defaults) {
+
+struct options o;
+struct device devs[MAXDEV];
+char* argv[64];
+int argc=0;
+char* save;
+char* p;
+int fi,cached;
+uint64_t t;
+static const char* source[]={"prepared","loaded from the disk cache","cached"};
+
+// the line is split into words as the shell would do it without quotes
+*strchr(j->line,'\n')=0;
+argv[argc++]="job";
+for(p=strtok_r(j->line," \t\r\n",&save);(p != NULL) && (argc<63);p=strtok_r(NULL," \t\r\n",&save)) argv[argc++]=p;
+argv[argc]=NULL;
+
+memset(&o,0,sizeof(o));
+memset(devs,0,sizeof(devs));
+o.window=o.retry=-1;
+o.devs=devs;
+fi=parse_opts(argc,argv,&o);
+if (o.window<0) o.window=defaults->window;
+if (o.retry<0) o.retry=defaults->retry;
+if ((fi == 0) || (fi>=argc)) {
+  jobmsg(j,"error bad keys or no file name");
+  endjob(j);
+  return;
+}
+if (o.mflag || o.waitflag || (o.station != NULL) || (o.submit != NULL) || (o.sigfile != NULL) || (o.cache != NULL) || (o.nports>1)) {
+  jobmsg(j,"error -m, -d, --wait, --station, --submit, --cache and several ports are not accepted in a job");
+  endjob(j);
+  return;
+}
+
+t=now_us();
+j->img=get_image(argv[fi],&o,&cached);
+if (j->img == NULL) {
+  jobmsg(j,"error %s",preperr);
+  endjob(j);
+  return;
+}
+j->img->refs++;
+printf("\n job %u: %s, %s in %.1f ms%s%s",j->no,argv[fi],source[cached],(now_us()-t)/1000.0,
+  o.nports?", port ":"",o.nports?devs[0].port:"");
+if (cached != 2) {
+  if (cachedir != NULL) printf(" (disk cache: %u hits, %u misses)",cachehits,cachemisses);
+  if (cacheevicted != 0) printf(", %i old files removed",cacheevicted);
+  cacheevicted=0;
+}
+fflush(stdout);
+
+memset(&j->dev,0,sizeof(j->dev));
+// a bare number is a ttyUSB port, as in open_port()
+if ((devs[0].port[0] != 0) && (strspn(devs[0].port,"0123456789") == strlen(devs[0].port))) {
+  snprintf(j->dev.port,sizeof(j->dev.port),"/dev/ttyUSB%s",devs[0].port);
+}
+else strcpy(j->dev.port,devs[0].port);
+j->dev.fr=&j->img->fr;
+j->dev.xflag=o.xflag;
+j->dev.window=o.window;
+j->dev.retry=o.retry;
+j->state=1;
+jobmsg(j,"queued %u",j->no);
+}
+
+//*************************************************
+//*  Starting the first queued job suitable for the port
+//*************************************************
+static int start_job(struct job* jobs, struct device* port) {
+
+int i;
+struct job* j=NULL;
+
+for(i=0;i<MAXJOBS;i++) {
+  if ((jobs[i].fd<0) || (jobs[i].state != 1)) continue;
+  if ((jobs[i].dev.port[0] != 0) && (strcmp(jobs[i].dev.port,port->port) != 0)) continue;
+  if ((j == NULL) || (jobs[i].no<j->no)) j=&jobs[i];
+}
+if (j == NULL) return 0;
+strcpy(j->dev.port,port->port);
+strcpy(j->dev.usbpath,port->usbpath);
+j->state=2;
+if (pthread_create(&j->dev.thread,NULL,flash_thread,&j->dev) != 0) {
+  jobmsg(j,"failed %s cannot start a thread",j->dev.port);
+  endjob(j);
+  return 0;
+}
+printf("\n job %u: loading into %s",j->no,j->dev.port);
+fflush(stdout);
+jobmsg(j,"start %s",j->dev.port);
+return 1;
+}
+
+//*************************************************
+//*  Station main loop
+//*************************************************
+void station(struct options* o) {
+
+int lfd,nl,cfd;
+struct sockaddr_un sa;
+struct sockaddr_nl snl;
+struct stat st;
+struct pollfd pfd[MAXJOBS+2];
+struct job jobs[MAXJOBS];
+struct job* pj[MAXJOBS+2];
+struct device ports[MAXDEV];
+int nfd,nports,i,k,busy,len;
+unsigned int jobno=0;
+char buf[256];
+double sec;
+struct device* dev;
+
+multi=1;  // the devices must not print their progress
+memset(&sa,0,sizeof(sa));
+sa.sun_family=AF_UNIX;
+if (strlen(o->station)>=sizeof(sa.sun_path)) {
+  printf("\n Socket name is too long\n");
+  return;
+}
+strcpy(sa.sun_path,o->station);
+// only a socket left by an earlier station is removed
+if (lstat(o->station,&st) == 0) {
+  if (!S_ISSOCK(st.st_mode)) {
+    printf("\n %s exists and is not a socket\n",o->station);
+    return;
+  }
+  unlink(o->station);
+}
+lfd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+if ((lfd<0) || (bind(lfd,(struct sockaddr*)&sa,sizeof(sa)) != 0) || (listen(lfd,16) != 0)) {
+  printf("\n Cannot listen on %s\n",o->station);
+  return;
+}
+
+// uevents only wake the loop up early, the ports are rescanned anyway
+nl=socket(AF_NETLINK,SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK,NETLINK_KOBJECT_UEVENT);
+if (nl >= 0) {
+  memset(&snl,0,sizeof(snl));
+  snl.nl_family=AF_NETLINK;
+  snl.nl_groups=1;
+  if (bind(nl,(struct sockaddr*)&snl,sizeof(snl)) != 0) {
+    close(nl);
+    nl=-1;
+  }
+}
+
+for(i=0;i<MAXJOBS;i++) jobs[i].fd=-1;
+printf("\n Station is waiting for jobs on %s\n",o->station);
+fflush(stdout);
+
+for(;;) {
+  //--- finished downloads
+  for(i=0;i<MAXJOBS;i++) {
+    if ((jobs[i].fd<0) || (jobs[i].state != 2) || (GETSTATUS(&jobs[i].dev) == 0)) continue;
+    dev=&jobs[i].dev;
+    pthread_join(dev->thread,NULL);
+    // the device stays in the boot mode until the loader restarts it
+    if (ndone<MAXDEV) strcpy(doneports[ndone++],dev->port);
+    sec=(dev->end-dev->start)/1e6;
+    if (dev->status == 1) {
+      printf("\n job %u: %s loaded in %.2f s",jobs[i].no,dev->port,sec);
+      jobmsg(&jobs[i],"done %s %.2f %.1f",dev->port,sec,
+        sec>0?(dev->fr->blk[0].size+dev->fr->blk[1].size)/1024.0/sec:0.0);
+    }
+    else {
+      printf("\n job %u: %s failed: %s",jobs[i].no,dev->port,dev->msg);
+      jobmsg(&jobs[i],"failed %s %s",dev->port,dev->msg);
+    }
+    fflush(stdout);
+    endjob(&jobs[i]);
+  }
+
+  //--- boot ports present now: discovered ones and those named by the jobs
+  nports=find_ports(ports,0);
+  for(i=0;(i<MAXJOBS) && (nports<MAXDEV);i++) {
+    if ((jobs[i].fd<0) || (jobs[i].state != 1) || (jobs[i].dev.port[0] == 0)) continue;
+    if (!port_ready(&jobs[i].dev,0)) continue;
+    memset(&ports[nports],0,sizeof(ports[0]));
+    strcpy(ports[nports++].port,jobs[i].dev.port);
+  }
+  // a port that left and came back can take a new job
+  for(k=0;k<ndone;) {
+    for(i=0;i<nports;i++) if (strcmp(ports[i].port,doneports[k]) == 0) break;
+    if (i == nports) {
+      ndone--;
+      if (k<ndone) strcpy(doneports[k],doneports[ndone]);
+    }
+    else k++;
+  }
+  for(i=0;i<nports;i++) {
+    for(k=0;k<ndone;k++) if (strcmp(ports[i].port,doneports[k]) == 0) break;
+    if (k<ndone) continue;
+    for(k=0,busy=0;k<MAXJOBS;k++) {
+      if ((jobs[k].fd >= 0) && (jobs[k].state == 2) && (strcmp(jobs[k].dev.port,ports[i].port) == 0)) busy=1;
+    }
+    if (!busy) start_job(jobs,&ports[i]);
+  }
+
+  //--- waiting for connections, job lines, client hangups and uevents
+  nfd=0;
+  pfd[nfd].fd=lfd;
+  pfd[nfd].events=POLLIN;
+  pj[nfd++]=NULL;
+  if (nl >= 0) {
+    pfd[nfd].fd=nl;
+    pfd[nfd].events=POLLIN;
+    pj[nfd++]=NULL;
+  }
+  for(i=0;i<MAXJOBS;i++) {
+    if ((jobs[i].fd<0) || jobs[i].gone) continue;
+    pfd[nfd].fd=jobs[i].fd;
+    pfd[nfd].events=POLLIN;
+    pj[nfd++]=&jobs[i];
+  }
+  if (poll(pfd,nfd,100) <= 0) continue;
+
+  if (pfd[0].revents & POLLIN) {
+    cfd=accept(lfd,NULL,NULL);
+    for(i=0;i<MAXJOBS;i++) if (jobs[i].fd<0) break;
+    if ((cfd >= 0) && (i == MAXJOBS)) {
+      send(cfd,"error station is full\n",22,MSG_NOSIGNAL);
+      close(cfd);
+    }
+    else if (cfd >= 0) {
+      memset(&jobs[i],0,sizeof(jobs[i]));
+      jobs[i].fd=cfd;
+      jobs[i].no=++jobno;
+    }
+  }
+  if ((nl >= 0) && (pfd[1].revents & POLLIN)) {
+    while (recv(nl,buf,sizeof(buf),0)>0);
+  }
+  for(k=1;k<nfd;k++) {
+    if ((pj[k] == NULL) || (pfd[k].revents == 0) || (pj[k]->fd != pfd[k].fd)) continue;
+    if (pj[k]->state == 0) {
+      len=read(pj[k]->fd,pj[k]->line+pj[k]->len,sizeof(pj[k]->line)-1-pj[k]->len);
+      if (len <= 0) {
+        endjob(pj[k]);
+        continue;
+      }
+      pj[k]->len+=len;
+      pj[k]->line[pj[k]->len]=0;
+      if (strchr(pj[k]->line,'\n') != NULL) take_job(pj[k],o);
+      else if (pj[k]->len == sizeof(pj[k]->line)-1) {
+        jobmsg(pj[k],"error job line is too long");
+        endjob(pj[k]);
+      }
+    }
+    else {
+      // nothing more is expected from the client: a hangup cancels a queued job,
+      // a running one is finished anyway
+      len=read(pj[k]->fd,buf,sizeof(buf));
+      if (len>0) continue;
+      if (pj[k]->state == 1) {
+        printf("\n job %u: cancelled",pj[k]->no);
+        fflush(stdout);
+        endjob(pj[k]);
+      }
+      else pj[k]->gone=1;
+    }
+  }
+}
+}
+
+//*************************************************
+//*  Appending a key to the job line, 0 - no room left
+//*************************************************
+static int jobkey(char* line, size_t size, const char* fmt, ...) {
+
+size_t len=strlen(line);
+va_list ap;
+int res;
+
+va_start(ap,fmt);
+res=vsnprintf(line+len,size-len,fmt,ap);
+va_end(ap);
+return (res >= 0) && (res<size-len);
+}
+
+//*************************************************
+//*  Passing the download to the station (--submit)
+//*
+//* The job line is rebuilt from the parsed keys with absolute file names,
+//* then the station replies are shown until the job ends.
+//*************************************************
+void submit(struct options* o, const char* file) {
+
+char line[1024];
+char path[PATH_MAX];
+char buf[512];
+struct sockaddr_un sa;
+int fd,i,res=1,ok=1;
+FILE* f;
+
+if ((o->sigfile != NULL) || (o->cache != NULL)) {
+  printf("\n The station uses its own signatures and cache, -d and --cache cannot be passed\n");
+  return;
+}
+if (strlen(o->submit) >= sizeof(sa.sun_path)) {
+  printf("\n Station socket name is too long: %s\n",o->submit);
+  return;
+}
+line[0]=0;
+if (o->fbflag) ok&=jobkey(line,sizeof(line)," -f");
+if (o->bflag) ok&=jobkey(line,sizeof(line)," -b");
+if (o->cflag) ok&=jobkey(line,sizeof(line)," -c");
+if (o->xflag) ok&=jobkey(line,sizeof(line)," -x%i",o->xflag);
+if (o->window>0) ok&=jobkey(line,sizeof(line)," -w%i",o->window);
+if (o->retry >= 0) ok&=jobkey(line,sizeof(line)," -r%i",o->retry);
+for(i=0;i<41;i++) if (o->fileflag[i]) ok&=jobkey(line,sizeof(line)," -s%i",i);
+if (o->nports == 1) ok&=jobkey(line,sizeof(line)," -p %s",o->devs[0].port);
+else if (o->nports>1) {
+  printf("\n A station job takes one port\n");
+  return;
+}
+if (o->tflag) {
+  if (realpath(o->ptfile,path) == NULL) {
+    printf("\n File not found %s\n",o->ptfile);
+    return;
+  }
+  ok&=jobkey(line,sizeof(line)," -t %s",path);
+}
+if (realpath(file,path) == NULL) {
+  printf("\n Error opening %s\n",file);
+  return;
+}
+// the station takes the same line length
+ok&=jobkey(line,sizeof(line)," %s\n",path);
+if (!ok) {
+  printf("\n Job line is too long\n");
+  return;
+}
+
+memset(&sa,0,sizeof(sa));
+sa.sun_family=AF_UNIX;
+strncpy(sa.sun_path,o->submit,sizeof(sa.sun_path)-1);
+fd=socket(AF_UNIX,SOCK_STREAM,0);
+if ((fd<0) || (connect(fd,(struct sockaddr*)&sa,sizeof(sa)) != 0)) {
+  printf("\n Station %s is not available\n",o->submit);
+  return;
+}
+write(fd,line+1,strlen(line+1));
+
+printf("\n");
+f=fdopen(fd,"r");
+while (fgets(buf,sizeof(buf),f) != NULL) {
+  printf(" %s",buf);
+  fflush(stdout);
+  if (strncmp(buf,"done ",5) == 0) res=0;
+}
+fclose(f);
+exit(res);
+}
+#endif
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+void main(int argc, char* argv[]) {
+
+unsigned int i;
+int fi;    // index of the file name
+
+struct options opt;
+struct image img;
+char sigerr[300];
+#ifndef WIN32
+uint8_t key[32];
+uint64_t t;
+int cached;
+#endif
+struct device devs[MAXDEV];
+
+#ifdef WIN32
+int port_no;
+char port_name[256];
+#endif
+
+memset(&opt,0,sizeof(opt));
+memset(devs,0,sizeof(devs));
+opt.window=opt.retry=-1;  // not given
+#ifndef WIN32
+opt.devs=devs;
+#endif
+
+fi=parse_opts(argc,argv,&opt);
+if (fi == 0) return;
+
+// the JSON output is not mixed with the banner
+if (!opt.mflag || !opt.json) {
+  printf("\n Balong chipset emergency USB loader, version 2.20, (c) forth32, 2015");
+#ifdef WIN32
+  printf("\n Port for Windows 32bit  (c) rust3028, 2016");
+#endif
+}
+
+// the signature database is compiled once for all loaders
+if ((opt.sigfile != NULL) && !load_signatures(opt.sigfile,sigerr,sizeof(sigerr))) {
+  printf("\n %s\n",sigerr);
+  return;
+}
+
+#ifndef WIN32
+// only the keys given explicitly are passed to the station
+if ((opt.submit != NULL) && (fi<argc)) {
+  submit(&opt,argv[fi]);
+  return;
+}
+cachedir=opt.cache;
+if (opt.cachesize>0) cachelimit=(uint64_t)opt.cachesize<<20;
+#endif
+if (opt.window<0) opt.window=1;
+if (opt.retry<0) opt.retry=3;
+
+#ifndef WIN32
+if (opt.station != NULL) {
+  station(&opt);
+  return;
+}
+#endif
+
+if (fi>=argc) {
+    printf("\n - No file name specified for download\n");
+    return;
+}
+
+//%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
+// Output of the partition table
+if (opt.mflag) {
+  inspect(argv[fi],&opt);
+  return;
+}
+
+#ifndef WIN32
+t=now_us();
+if ((cachedir != NULL) && image_key(argv[fi],&opt,key)) {
+  if (!load_image(&img,argv[fi],&opt,key,&cached)) {
+    printf("\n %s\n",preperr);
+    return;
+  }
+  if (cached) printf("\n Loader cache: hit, %.1f ms",(now_us()-t)/1000.0);
+  else {
+    printf("\n Loader cache: miss, prepared and stored in %.1f ms",(now_us()-t)/1000.0);
+    if (cacheevicted != 0) printf(", %i old files removed",cacheevicted);
+  }
+}
+else
+#endif
+if (!prepare(&img,argv[fi],&opt)) {
+  printf("\n %s\n",preperr);
+  return;
+}
+
+if (img.patchoff != 0)  printf("\n\n * Removed flash_eraseall procedure (%s) at offset %08x", signame(img.family), img.patchoff);
+if (img.boot.off != 0) {
+  printf("\n\n * Boot image header at offset %08x cut off",img.boot.off);
+  if (img.boot.valid) printf(": kernel %u bytes, ramdisk %u bytes, page %u",img.boot.ksize,img.boot.rdsize,img.boot.pagesize);
+  else printf(" (the header is not valid)");
+}
+
+//---------------------------------------------------------------------
+
+#ifdef WIN32
+if (*opt.devname == '\0')
+{
+  printf("\n\nSearching for emergency boot port...\n");
+
+  if (find_port(&port_no, port_name) == 0)
+  {
+    sprintf(opt.devname, "%d", port_no);
+    printf("Port: \"%s\"\n", port_name);
+  }
+  else
+  {
+    printf("Port not found!\n");
+    return;
+  }
+}
+strcpy(devs[0].port,opt.devname);
+opt.nports=1;
+#else
+if (opt.waitflag) {
+  if (opt.nports>1) {
+    printf("\n Only one port can be awaited\n");
+    return;
+  }
+  printf("\n\n Waiting for the boot port...");
+  wait_port(&devs[0]);
+  opt.nports=1;
+}
+else if (opt.nports == 0) {
+  printf("\n\n Searching for emergency boot ports...");
+  opt.nports=find_ports(devs,0);
+  if (opt.nports == 0) {
+    printf("\n Port not found!\n");
+    return;
+  }
+  for(i=0;i<opt.nports;i++) printf("\n Port: %s (USB %s)",devs[i].port,devs[i].usbpath);
 }
+#endif
 
+for(i=0;i<opt.nports;i++) {
+  devs[i].fr=&img.fr;
+  devs[i].xflag=opt.xflag;
+  devs[i].window=opt.window;
+  devs[i].retry=opt.retry;
+}
 
+#ifndef WIN32
+if (opt.nports>1) {
+  flash_all(devs,opt.nports);
+  return;
+}
+#endif
+if (!flash(&devs[0])) return;
+printf("\n Download finished\n");
+#ifndef WIN32
+showstats();
+#endif
+}
@@ -0,0 +1,67 @@
+#ifndef WIN32
+#define _GNU_SOURCE  // memrchr
+#endif
+#include <stdint.h>
+#include <string.h>
+
+#include "bootimg.h"
+
+//*************************************
+//* Checking the Android boot image header at off
+//*
+//* Header: magic, kernel size and address, ramdisk size and address,
+//* second stage size and address, tags address, page size
+//*************************************
+static int boot_header(char* pbuf, uint32_t size, uint32_t off, struct bootinfo* bi) {
+
+uint32_t h[8];
+
+memset(bi,0,sizeof(*bi));
+bi->off=off;
+if (size-off < 8+sizeof(h)) return 0;
+memcpy(h,pbuf+off+8,sizeof(h));
+bi->ksize=h[0];
+bi->rdsize=h[2];
+bi->pagesize=h[7];
+// a page of 2K...64K, a kernel and the sizes within 256M
+bi->valid=(h[7] >= 2048) && (h[7] <= 65536) && ((h[7]&(h[7]-1)) == 0) &&
+          (h[0] != 0) && (h[0] < 0x10000000) && (h[2] < 0x10000000) && (h[4] < 0x10000000);
+return bi->valid;
+}
+
+//*************************************
+//* Search for the linux kernel in the partition image
+//*
+//* The last magic followed by a valid boot image header is taken; if no
+//* header is valid, the last "ANDROID!" as before. The candidates are found by
+//* the reverse search of the first byte of the magic.
+//*************************************
+int locate_kernel(char* pbuf, uint32_t size, struct bootinfo* bi) {
+
+char* p;
+uint32_t end,last=0;
+struct bootinfo cand;
+
+memset(bi,0,sizeof(*bi));
+if (size<9) return 0;
+// candidates 1 ... size-8
+end=size-7;
+for(;;) {
+#ifndef WIN32
+  p=memrchr(pbuf+1,'A',end-1);
+#else
+  for(p=pbuf+end-1;(p>pbuf) && (*p != 'A');p--);
+  if (p == pbuf) p=NULL;
+#endif
+  if (p == NULL) break;
+  end=p-pbuf;
+  if (memcmp(p,"ANDROID!",8) != 0) continue;
+  if (boot_header(pbuf,size,end,&cand)) {
+    *bi=cand;
+    return end;
+  }
+  if (last == 0) last=end;
+}
+if (last != 0) boot_header(pbuf,size,last,bi);
+return last;
+}
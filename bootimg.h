@@ -0,0 +1,17 @@
+// Android boot image (fastboot kernel) inside the usbldr component
+
+// Android boot image header found by locate_kernel()
+struct bootinfo {
+  uint32_t off;          // offset of the header, 0 - not found
+  uint32_t ksize;        // kernel size
+  uint32_t rdsize;       // ramdisk size
+  uint32_t pagesize;
+  int32_t valid;         // the sizes are consistent, 0 - only the magic matched
+};
+
+//***********************************************************************
+//* Offset of the boot image in the component, 0 - none. The last magic
+//* followed by a valid header is taken, otherwise the last bare
+//* "ANDROID!"; the header is described in bi.
+//***********************************************************************
+int locate_kernel(char* pbuf, uint32_t size, struct bootinfo* bi);
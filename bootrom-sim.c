@@ -0,0 +1,446 @@
+// Balong boot ROM emulator for offline testing of balong-usbdload.
+//
+// Opens a pseudo-terminal and speaks the emergency-port protocol on it:
+// the 'A' -> 0x55 handshake, 0xFE block header, 0xDA data and 0xED
+// end-of-data frames with the CRC of crc16.c, answering 0xAA (ACK) or 0x55 (NAK).
+// Replies are delayed according to a link model (latency, jitter, bandwidth)
+// so that transfer speed changes can be benchmarked without hardware.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc16.h"
+
+#define ACK 0xaa
+#define NAK 0x55
+#define HELLO 0x55
+#define MAXFRAME 1029
+#define MAXREPLY 4096
+
+// Link profile
+struct profile {
+  const char* name;
+  uint32_t latency;   // reply delay per frame, us
+  uint32_t jitter;    // random extra delay 0..jitter, us
+  uint32_t bandwidth; // host->device bytes per second, 0 - unlimited
+};
+
+static const struct profile profiles[]={
+  {"ideal", 0, 0, 0},
+  {"usb20", 500, 100, 4000000},
+  {"usb11", 2000, 500, 800000},
+  {"slow", 10000, 5000, 200000},
+  {NULL, 0, 0, 0}
+};
+
+static struct profile ln={"usb20", 500, 100, 4000000};
+static uint32_t nakrate=0;    // NAK injection rate, per mille of data frames
+static uint32_t droprate=0;   // lost data frames, per mille
+static char* outprefix=NULL;  // where to store received blocks
+static int oneshot=0;
+static int verbose=0;
+
+// Protocol state of one download session
+static struct {
+  uint8_t frame[MAXFRAME];
+  uint32_t flen;      // bytes collected in frame[]
+  uint32_t need;      // expected frame length, 0 - not yet known
+
+  int active;         // header accepted, data expected
+  uint32_t lmode,size,adr;
+  uint32_t received;
+  uint32_t seq;       // expected packet number
+  uint32_t lastlen;   // length of the last accepted data frame
+  uint8_t* image;
+
+  uint64_t start;
+  uint32_t frames,acks,naks,dups,drops,junk,blocks;
+  uint64_t bytes;
+} st;
+
+// Pending replies, sent in order when their due time is reached
+static struct {
+  uint64_t due;
+  uint8_t c;
+} rq[MAXREPLY];
+static uint32_t rqhead=0,rqtail=0;
+static uint64_t link_free=0,last_due=0;
+
+//***********************************************************************
+//* Monotonic time in microseconds
+//***********************************************************************
+static uint64_t now_us() {
+
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC,&ts);
+return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+static int crc_ok(const uint8_t* buf, uint32_t len) {
+
+uint16_t c=crc16_update(0,buf,len-2);
+
+return (buf[len-2] == (c>>8)) && (buf[len-1] == (c&0xff));
+}
+
+//***********************************************************************
+//* Queue a reply to a frame of len bytes received at time t
+//***********************************************************************
+static void reply(uint8_t c, uint32_t len, uint64_t t) {
+
+uint64_t due;
+
+if (link_free<t) link_free=t;
+if (ln.bandwidth) link_free+=(uint64_t)len*1000000/ln.bandwidth;
+due=link_free+ln.latency;
+if (ln.jitter) due+=rand()%(ln.jitter+1);
+if (due<last_due) due=last_due;  // replies never overtake each other
+last_due=due;
+
+if (rqtail-rqhead >= MAXREPLY) {
+  printf("\n Reply queue overflow\n");
+  exit(1);
+}
+rq[rqtail%MAXREPLY].due=due;
+rq[rqtail%MAXREPLY].c=c;
+rqtail++;
+}
+
+static void ack(uint32_t len, uint64_t t) {
+
+if (verbose) printf(" %02x:%02x ACK\n",st.frame[0],st.frame[1]);
+st.acks++;
+reply(ACK,len,t);
+}
+
+static void nak(uint32_t len, uint64_t t) {
+
+if (verbose) printf(" %02x:%02x NAK\n",st.frame[0],st.frame[1]);
+st.naks++;
+reply(NAK,len,t);
+}
+
+//***********************************************************************
+//* Save a completely received block
+//***********************************************************************
+static void save_block() {
+
+char fname[512];
+FILE* out;
+
+if ((outprefix == NULL) || (st.image == NULL)) return;
+snprintf(fname,sizeof(fname),"%s-%08x.bin",outprefix,st.adr);
+out=fopen(fname,"wb");
+if (out == NULL) {
+  printf("\n Error creating %s: %s",fname,strerror(errno));
+  return;
+}
+fwrite(st.image,1,st.size,out);
+fclose(out);
+}
+
+//***********************************************************************
+//* Process a complete frame
+//***********************************************************************
+static void process_frame(uint64_t t) {
+
+uint8_t* f=st.frame;
+uint32_t len=st.flen;
+uint32_t seq;
+
+st.frames++;
+st.bytes+=len;
+
+switch (f[0]) {
+  case 0xfe:
+    if ((f[1] != 0) || (f[2] != 0xff) || !crc_ok(f,len)) {
+      nak(len,t);
+      break;
+    }
+    free(st.image);
+    st.lmode=f[3];
+    st.size=((uint32_t)f[4]<<24)|(f[5]<<16)|(f[6]<<8)|f[7];
+    st.adr=((uint32_t)f[8]<<24)|(f[9]<<16)|(f[10]<<8)|f[11];
+    st.image=outprefix?malloc(st.size):NULL;
+    st.received=0;
+    st.seq=1;
+    st.lastlen=0;
+    st.active=1;
+    ack(len,t);
+    break;
+
+  case 0xda:
+    seq=f[1];
+    if (droprate && ((uint32_t)(rand()%1000) < droprate)) {
+      // frame lost on the way, no reply
+      if (verbose) printf(" %02x:%02x lost\n",f[0],f[1]);
+      st.drops++;
+      break;
+    }
+    if (!st.active || !crc_ok(f,len) || (f[2] != ((~f[1])&0xff))) {
+      nak(len,t);
+      break;
+    }
+    if ((seq == ((st.seq-1)&0xff)) && (len == st.lastlen)) {
+      // retransmission of a packet that is already accepted
+      st.dups++;
+      ack(len,t);
+      break;
+    }
+    if ((seq != (st.seq&0xff)) || (nakrate && ((uint32_t)(rand()%1000) < nakrate))) {
+      nak(len,t);
+      break;
+    }
+    if (st.image) memcpy(st.image+st.received,f+3,len-5);
+    st.received+=len-5;
+    st.lastlen=len;
+    st.seq++;
+    ack(len,t);
+    break;
+
+  case 0xed:
+    if (!st.active || !crc_ok(f,len) || (f[1] != (st.seq&0xff)) ||
+        (f[2] != ((~f[1])&0xff)) || (st.received != st.size)) {
+      nak(len,t);
+      break;
+    }
+    save_block();
+    st.active=0;
+    st.blocks++;
+    ack(len,t);
+    break;
+}
+}
+
+//***********************************************************************
+//* Frame length as soon as it can be determined from the collected bytes
+//***********************************************************************
+static uint32_t frame_length() {
+
+uint32_t remain;
+
+switch (st.frame[0]) {
+  case 0xfe:
+    return 14;
+
+  case 0xed:
+    return 5;
+
+  case 0xda:
+    if (!st.active) return 5+1024;
+    if (st.flen<2) return 0;
+    // a repeated packet has the length of the last accepted one
+    if ((st.frame[1] == ((st.seq-1)&0xff)) && (st.lastlen != 0)) return st.lastlen;
+    remain=st.size-st.received;
+    return 5+((remain>1024)?1024:remain);
+}
+return 0;
+}
+
+//***********************************************************************
+//* Feed received bytes into the frame parser
+//***********************************************************************
+static void feed(const uint8_t* buf, int n, uint64_t t) {
+
+int i;
+
+for(i=0;i<n;i++) {
+  if (st.flen == 0) {
+    if (buf[i] == 'A') {
+      // boot port probe
+      if (st.start == 0) st.start=t;
+      reply(HELLO,1,t);
+      continue;
+    }
+    if ((buf[i] != 0xfe) && (buf[i] != 0xda) && (buf[i] != 0xed)) {
+      st.junk++;
+      continue;
+    }
+  }
+  st.frame[st.flen++]=buf[i];
+  if (st.need == 0) st.need=frame_length();
+  if ((st.need != 0) && (st.flen >= st.need)) {
+    st.flen=st.need;
+    process_frame(t);
+    st.flen=0;
+    st.need=0;
+  }
+}
+}
+
+//***********************************************************************
+//* Print session statistics and reset the protocol state
+//***********************************************************************
+static void end_session() {
+
+double sec=(now_us()-st.start)/1e6;
+
+printf("\n Session: %u frames, %llu bytes, %u blocks, %u ACK, %u NAK, %u repeated, %u lost, %u junk bytes",
+       st.frames,(unsigned long long)st.bytes,st.blocks,st.acks,st.naks,st.dups,st.drops,st.junk);
+if (sec>0) printf("\n          %.3f s, %.1f KB/s",sec,st.bytes/1024.0/sec);
+printf("\n");
+fflush(stdout);
+
+free(st.image);
+memset(&st,0,sizeof(st));
+rqhead=rqtail=0;
+link_free=last_due=0;
+}
+
+//***********************************************************************
+//* Flush due replies, returns poll timeout in ms
+//***********************************************************************
+static int send_replies(int fd) {
+
+uint64_t t=now_us();
+uint8_t out[MAXREPLY];
+int n=0;
+
+while ((rqhead != rqtail) && (rq[rqhead%MAXREPLY].due <= t)) {
+  out[n++]=rq[rqhead%MAXREPLY].c;
+  rqhead++;
+}
+if (n) write(fd,out,n);
+if (rqhead == rqtail) return 100;
+return (int)((rq[rqhead%MAXREPLY].due-t+999)/1000);
+}
+
+static void usage(const char* prog) {
+
+int i;
+
+printf("\n Balong boot ROM emulator on a pseudo-terminal\n\n");
+printf("%s [keys]\n\n The following keys are valid:\n\n",prog);
+printf("-P <name> - link profile:");
+for(i=0;profiles[i].name;i++) printf(" %s",profiles[i].name);
+printf(" (default usb20)\n");
+printf("-l <us>   - reply latency per frame, microseconds\n");
+printf("-j <us>   - random reply jitter, microseconds\n");
+printf("-r <B/s>  - link bandwidth, bytes per second (0 - unlimited)\n");
+printf("-e <n>    - reject n of every 1000 data frames with NAK\n");
+printf("-d <n>    - lose n of every 1000 data frames without a reply\n");
+printf("-o <pref> - save received blocks to <pref>-<address>.bin\n");
+printf("-v        - print every received frame\n");
+printf("-1        - exit after the first session\n\n");
+}
+
+//#######################################################################################################
+int main(int argc, char* argv[]) {
+
+int opt,i,fd,sfd,n,timeout;
+struct termios tio;
+struct pollfd pfd;
+uint8_t buf[8192];
+char* sname;
+
+while ((opt = getopt(argc, argv, "hP:l:j:r:e:d:o:v1")) != -1) {
+  switch (opt) {
+   case 'h':
+     usage(argv[0]);
+     return 0;
+
+   case 'P':
+     for(i=0;profiles[i].name;i++) {
+       if (strcmp(profiles[i].name,optarg) == 0) break;
+     }
+     if (profiles[i].name == NULL) {
+       printf("\n Unknown profile %s\n",optarg);
+       return 1;
+     }
+     ln=profiles[i];
+     break;
+
+   case 'l':
+     ln.latency=strtoul(optarg,NULL,0);
+     break;
+
+   case 'j':
+     ln.jitter=strtoul(optarg,NULL,0);
+     break;
+
+   case 'r':
+     ln.bandwidth=strtoul(optarg,NULL,0);
+     break;
+
+   case 'e':
+     nakrate=strtoul(optarg,NULL,0);
+     break;
+
+   case 'd':
+     droprate=strtoul(optarg,NULL,0);
+     break;
+
+   case 'o':
+     outprefix=optarg;
+     break;
+
+   case 'v':
+     verbose=1;
+     break;
+
+   case '1':
+     oneshot=1;
+     break;
+
+   case '?':
+   case ':':
+     return 1;
+  }
+}
+
+signal(SIGPIPE,SIG_IGN);
+srand(time(NULL));
+
+fd=posix_openpt(O_RDWR|O_NOCTTY);
+if ((fd == -1) || (grantpt(fd) != 0) || (unlockpt(fd) != 0) || ((sname=ptsname(fd)) == NULL)) {
+  printf("\n Error creating pseudo-terminal: %s\n",strerror(errno));
+  return 1;
+}
+
+// raw mode on the slave side, kept while the master is open
+sfd=open(sname,O_RDWR|O_NOCTTY);
+if (sfd != -1) {
+  tcgetattr(sfd,&tio);
+  cfmakeraw(&tio);
+  tcsetattr(sfd,TCSANOW,&tio);
+  close(sfd);
+}
+
+printf("%s\n",sname);
+printf(" Profile %s: latency %u us, jitter %u us, bandwidth %u B/s, NAK rate %u/1000, loss rate %u/1000\n",
+       ln.name,ln.latency,ln.jitter,ln.bandwidth,nakrate,droprate);
+fflush(stdout);
+
+pfd.fd=fd;
+pfd.events=POLLIN;
+timeout=100;
+for(;;) {
+  n=poll(&pfd,1,timeout);
+  if ((n>0) && (pfd.revents & POLLIN)) {
+    n=read(fd,buf,sizeof(buf));
+    if (n>0) feed(buf,n,now_us());
+  }
+  else if ((n>0) && (pfd.revents & POLLHUP)) {
+    // no process has the slave side open
+    if (st.start != 0) {
+      end_session();
+      if (oneshot) break;
+    }
+    usleep(10000);
+  }
+  timeout=send_replies(fd);
+}
+close(fd);
+return 0;
+}
@@ -0,0 +1,128 @@
+// Benchmark of the CRC-16 implementations of crc16.c against the nibble
+// routine of the original csum(): every implementation must give the same
+// CRC on the data frames of the given loaders, on the whole files, on
+// short pieces and when extended over split points.
+//
+// crc16-bench <usbloader> ...
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc16.h"
+
+static const char* names[]={"pclmul","slice8","byte","nibble"};
+
+static double now() {
+
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC,&ts);
+return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+//***********************************************************************
+//* Comparing the chosen implementation with the nibble routine
+//***********************************************************************
+static int verify(const uint8_t* buf, uint32_t size) {
+
+uint8_t frame[1027];
+uint32_t off,len,split,i;
+int bad=0;
+
+// data frames: 0xda, seq, ~seq, payload
+for(off=0,i=1;off<size;off+=1024,i++) {
+  len=(size-off<1024)?(size-off):1024;
+  frame[0]=0xda;
+  frame[1]=i&0xff;
+  frame[2]=(~i)&0xff;
+  memcpy(frame+3,buf+off,len);
+  if (crc16_update(0,frame,len+3) != crc16_nibble(0,frame,len+3)) bad++;
+  // header and payload as two pieces, as frames.c builds them
+  if (crc16_update(crc16_update(0,frame,3),buf+off,len) != crc16_nibble(0,frame,len+3)) bad++;
+}
+if (crc16_update(0,buf,size) != crc16_nibble(0,buf,size)) bad++;
+// short pieces at every alignment and running CRCs over split points
+for(len=0;(len<300) && (len<size);len++) {
+  off=(len*7919)%(size-len+1);
+  if (crc16_update(0x1d0f,buf+off,len) != crc16_nibble(0x1d0f,buf+off,len)) bad++;
+  split=(size<4096)?size:4096;
+  split=len*split/300;
+  if (crc16_update(crc16_update(0,buf,split),buf+split,size-split) != crc16_nibble(0,buf,size)) bad++;
+}
+return bad;
+}
+
+//***********************************************************************
+//* Speed on the data frames, MB/s
+//***********************************************************************
+static double speed(uint8_t** bufs, uint32_t* sizes, int n) {
+
+double t0,t;
+uint64_t bytes=0;
+uint32_t off,len;
+uint16_t sink=0;
+int i;
+
+t0=now();
+do {
+  for(i=0;i<n;i++) {
+    for(off=0;off<sizes[i];off+=1024) {
+      len=(sizes[i]-off<1024)?(sizes[i]-off):1024;
+      sink^=crc16_update(0,bufs[i]+off,len);
+      bytes+=len;
+    }
+  }
+  t=now()-t0;
+} while (t<0.3);
+if (sink == 0x5a5a) printf(" ");  // keeps the loop
+return bytes/1048576.0/t;
+}
+
+//#######################################################################################################
+int main(int argc, char* argv[]) {
+
+uint8_t** bufs;
+uint32_t* sizes;
+FILE* f;
+int i,k,n,bad,total=0;
+
+if (argc<2) {
+  printf("\n %s <usbloader> ...\n\n",argv[0]);
+  return 1;
+}
+n=argc-1;
+bufs=calloc(n,sizeof(uint8_t*));
+sizes=calloc(n,sizeof(uint32_t));
+for(i=0;i<n;i++) {
+  f=fopen(argv[i+1],"rb");
+  if (f == NULL) {
+    printf("\n Error opening %s\n",argv[i+1]);
+    return 1;
+  }
+  fseek(f,0,SEEK_END);
+  sizes[i]=ftell(f);
+  rewind(f);
+  bufs[i]=malloc(sizes[i]+1);
+  if (fread(bufs[i],1,sizes[i],f) != sizes[i]) {
+    printf("\n Error reading %s\n",argv[i+1]);
+    return 1;
+  }
+  fclose(f);
+}
+
+printf("\n Default implementation: %s\n\n",crc16_impl());
+for(k=0;k<sizeof(names)/sizeof(names[0]);k++) {
+  if (!crc16_force(names[k])) {
+    printf(" %-7s not available on this CPU\n",names[k]);
+    continue;
+  }
+  for(i=0,bad=0;i<n;i++) bad+=verify(bufs[i],sizes[i]);
+  total+=bad;
+  printf(" %-7s %7.0f MB/s  %s\n",names[k],speed(bufs,sizes,n),bad?"MISMATCH":"same as nibble");
+}
+printf("\n");
+return total != 0;
+}
@@ -0,0 +1,196 @@
+#include <stdint.h>
+#include <string.h>
+#include "crc16.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC16_X86
+#include <immintrin.h>
+#endif
+
+// packets shorter than this are not worth the slice-by-8 loop
+#define SLICE_MIN 16
+// nor the setup of the carry-less multiply folding
+#define CLMUL_MIN 64
+
+typedef uint16_t (*crc16_t)(uint16_t, const uint8_t*, uint32_t);
+
+static uint16_t crctab[8][256];
+static int crcinit=0;
+
+//***********************************************************************
+//* Building the tables
+//*
+//* crctab[0][v] - CRC of the byte v
+//* crctab[k][v] - CRC of the byte v followed by k zero bytes
+//***********************************************************************
+static void crc16_mktab() {
+
+uint32_t i,j,k,c;
+
+for(i=0;i<256;i++) {
+  c=i<<8;
+  for(j=0;j<8;j++) c=(c&0x8000)?((c<<1)^0x1021):(c<<1);
+  crctab[0][i]=c;
+}
+for(k=1;k<8;k++) {
+  for(i=0;i<256;i++) {
+    c=crctab[k-1][i];
+    crctab[k][i]=(c<<8)^crctab[0][c>>8];
+  }
+}
+crcinit=1;
+}
+
+//***********************************************************************
+//* Reference implementation - two 4-bit steps per byte, as in the original csum()
+//***********************************************************************
+uint16_t crc16_nibble(uint16_t crc, const uint8_t* buf, uint32_t len) {
+
+static const uint16_t cconst[]={0,0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7, 0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF};
+uint32_t i,c,csum=crc;
+
+for (i=0;i<len;i++) {
+  c=buf[i];
+  csum=((csum<<4)&0xffff)^cconst[(c>>4)^(csum>>12)];
+  csum=((csum<<4)&0xffff)^cconst[(c&0xf)^(csum>>12)];
+}
+return csum;
+}
+
+//***********************************************************************
+//* One table lookup per byte
+//***********************************************************************
+uint16_t crc16_byte(uint16_t crc, const uint8_t* buf, uint32_t len) {
+
+uint32_t i;
+
+if (!crcinit) crc16_mktab();
+for (i=0;i<len;i++) crc=(crc<<8)^crctab[0][(crc>>8)^buf[i]];
+return crc;
+}
+
+//***********************************************************************
+//* Eight bytes per step with independent lookups
+//***********************************************************************
+uint16_t crc16_slice8(uint16_t crc, const uint8_t* buf, uint32_t len) {
+
+if (!crcinit) crc16_mktab();
+while (len>=8) {
+  crc=crctab[7][(crc>>8)^buf[0]] ^ crctab[6][(crc&0xff)^buf[1]] ^
+      crctab[5][buf[2]] ^ crctab[4][buf[3]] ^ crctab[3][buf[4]] ^
+      crctab[2][buf[5]] ^ crctab[1][buf[6]] ^ crctab[0][buf[7]];
+  buf+=8;
+  len-=8;
+}
+return crc16_byte(crc,buf,len);
+}
+
+#ifdef CRC16_X86
+// x^128 mod P and x^192 mod P, P=x^16+0x1021
+#define K128 0xaefc
+#define K192 0x650b
+
+//***********************************************************************
+//* PCLMUL - 16 bytes per step by carry-less multiply folding
+//*
+//* With the bytes taken most significant first, a 16-byte block is a
+//* polynomial A=H*x^64+L. Shifting it over the next block gives
+//* A*x^128 = H*x^192 + L*x^128, so it is replaced by
+//* H*(x^192 mod P) + L*(x^128 mod P), which is congruent modulo P and
+//* fits into 128 bits again. The running CRC enters as the first two
+//* bytes, and the 16 bytes left at the end go through the byte table.
+//***********************************************************************
+__attribute__((target("pclmul,ssse3")))
+static uint16_t crc16_clmul(uint16_t crc, const uint8_t* buf, uint32_t len) {
+
+const __m128i rev=_mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+__m128i acc,k;
+uint8_t first[16],last[16];
+
+if (len<CLMUL_MIN) return crc16_slice8(crc,buf,len);
+if (!crcinit) crc16_mktab();
+k=_mm_set_epi64x(K192,K128);
+
+memcpy(first,buf,16);
+first[0]^=crc>>8;
+first[1]^=crc&0xff;
+acc=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)first),rev);
+buf+=16;
+len-=16;
+while (len>=16) {
+  acc=_mm_xor_si128(_mm_clmulepi64_si128(acc,k,0x11),_mm_clmulepi64_si128(acc,k,0x00));
+  acc=_mm_xor_si128(acc,_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)buf),rev));
+  buf+=16;
+  len-=16;
+}
+_mm_storeu_si128((__m128i*)last,_mm_shuffle_epi8(acc,rev));
+return crc16_byte(crc16_byte(0,last,16),buf,len);
+}
+#endif
+
+//***********************************************************************
+//* Dispatch
+//***********************************************************************
+static const struct {
+  const char* name;
+  crc16_t fn;
+} impls[]={
+#ifdef CRC16_X86
+  {"pclmul", crc16_clmul},
+#endif
+  {"slice8", crc16_slice8},
+  {"byte",   crc16_byte},
+  {"nibble", crc16_nibble}
+};
+
+static int cur=-1;
+
+static int supported(const char* name) {
+
+#ifdef CRC16_X86
+__builtin_cpu_init();
+if (strcmp(name,"pclmul") == 0) return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#endif
+return 1;
+}
+
+// the first implementation of the list that the CPU supports
+static void select_impl() {
+
+int i;
+
+for(i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+  if (supported(impls[i].name)) break;
+}
+cur=i;
+}
+
+int crc16_force(const char* name) {
+
+int i;
+
+for(i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+  if ((strcmp(impls[i].name,name) == 0) && supported(name)) {
+    cur=i;
+    return 1;
+  }
+}
+return 0;
+}
+
+const char* crc16_impl() {
+
+if (cur<0) select_impl();
+return impls[cur].name;
+}
+
+//***********************************************************************
+//* Short pieces go through the byte table, the rest through the
+//* implementation chosen for this CPU
+//***********************************************************************
+uint16_t crc16_update(uint16_t crc, const uint8_t* buf, uint32_t len) {
+
+if (cur<0) select_impl();
+if (len<SLICE_MIN) return crc16_byte(crc,buf,len);
+return impls[cur].fn(crc,buf,len);
+}
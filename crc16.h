@@ -0,0 +1,22 @@
+// CRC-16/CCITT (polynomial 0x1021, initial value 0) of the boot protocol packets
+
+//***********************************************************************
+//* Continue the running CRC over len bytes of buf.
+//* The CRC of a whole packet is crc16_update(0, buf, len).
+//***********************************************************************
+uint16_t crc16_update(uint16_t crc, const uint8_t* buf, uint32_t len);
+
+//***********************************************************************
+//* Individual implementations, for verification and benchmarking
+//***********************************************************************
+uint16_t crc16_nibble(uint16_t crc, const uint8_t* buf, uint32_t len);
+uint16_t crc16_byte(uint16_t crc, const uint8_t* buf, uint32_t len);
+uint16_t crc16_slice8(uint16_t crc, const uint8_t* buf, uint32_t len);
+
+//***********************************************************************
+//* Implementation chosen for this CPU: pclmul or slice8 (byte and nibble
+//* can be forced). crc16_force() selects another one for benchmarking,
+//* returns 0 if it is not available here.
+//***********************************************************************
+const char* crc16_impl();
+int crc16_force(const char* name);
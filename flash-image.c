@@ -0,0 +1,1088 @@
+// Operations on a full flash dump, driven by the partition table:
+// the partitions are extracted, hashed or checked for erased blocks
+// concurrently, one worker per partition, straight from a mapping of the
+// dump. Manifests of erase block hashes are built by workers that share
+// the blocks of all partitions, and compared to plan a flashing.
+//
+// flash-image extract|hash|usage|manifest|diff [keys] <dump>
+//
+// Linux only.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "parts.h"
+#include "ptable-text.h"
+#include "sha256.h"
+#include "wordscan.h"
+#include "xxh64.h"
+
+#define CHUNK 0x100000   // bytes per step of a worker
+#define EBLOCK 0x20000   // erase block, as in show_map()
+#define PAGE 2048        // default page for usage
+#define UNITBLOCKS 64    // erase blocks per step of a manifest worker
+#define MAXWORKERS 64
+
+//***********************************************************************
+//* The dump: plain flash data, or pages followed by their spare area
+//***********************************************************************
+struct flash {
+  int fd;
+  uint8_t* map;
+  uint64_t size;         // of the file
+  uint32_t page,oob;     // -P page:oob, oob=0 - no spare area in the dump
+  uint64_t datasize;     // flash bytes in the dump
+};
+
+static struct flash fl;
+static struct ptable_t ptable;
+static char ptsource[300];   // where the table was taken from
+
+// Run of programmed erase blocks
+struct extent {
+  uint64_t off,len;
+};
+
+// One partition of the table
+struct part {
+  int n;
+  char name[17];
+  uint64_t start,len;    // from the table
+  uint64_t avail;        // bytes present in the dump
+  uint8_t hash[32];
+  char file[4200];       // output file
+  const char* err;
+  int copied;            // copy_file_range() was used
+  // usage
+  uint32_t blocks,eblocks;    // erase blocks present, erased ones
+  uint32_t pages,epages;      // pages present, erased ones
+  uint64_t dstart,dend;       // programmed data, flash offsets (dstart=dend - none)
+  struct extent* ext;
+  int next;
+  // manifest and diff
+  uint32_t nblk;
+  uint64_t* bh;               // hash of every erase block present
+  uint32_t changed;           // blocks that differ from the device
+  int layout;                 // 1 - not on the device, 2 - other start or length
+  struct extent* wr;          // runs to write
+  struct extent* er;          // runs to erase only
+  int nwr,ner;
+  double ms;
+};
+
+static struct part parts[41];
+static int nparts=0;
+static int nextpart=0;
+static int order[41];        // partitions in the order the workers take them
+
+// the device side of diff
+static struct part dev[41];
+static int ndev=0;
+
+// Step of a manifest worker: blocks of one partition
+struct unit {
+  struct part* p;
+  uint32_t first,count;
+};
+
+static struct unit* units;
+static int nunits=0;
+static int nextunit=0;
+
+// keys
+static char* outdir=NULL;    // -o
+static int hflag=0;          // hash
+static int sflag=0;          // -s: sparse output
+static int uflag=0;          // usage
+static int mflag=0;          // manifest
+static int dflag=0;          // diff
+static char* manfile=NULL;   // -m
+
+//***********************************************************************
+//* Flash offset -> data in the mapping
+//*
+//* Returns the address of off and in *len the number of flash bytes that
+//* follow it contiguously in the dump.
+//***********************************************************************
+static uint8_t* flash_ptr(uint64_t off, uint64_t* len) {
+
+uint64_t pg;
+
+if (fl.oob == 0) {
+  *len=fl.datasize-off;
+  return fl.map+off;
+}
+pg=off/fl.page;
+*len=fl.page-off%fl.page;
+return fl.map+pg*(fl.page+fl.oob)+off%fl.page;
+}
+
+static void flash_read(uint64_t off, void* dst, uint64_t len) {
+
+uint64_t n;
+uint8_t* p;
+
+while (len != 0) {
+  p=flash_ptr(off,&n);
+  if (n>len) n=len;
+  memcpy(dst,p,n);
+  dst=(uint8_t*)dst+n;
+  off+=n;
+  len-=n;
+}
+}
+
+//***********************************************************************
+//* Partition table: a loader, a binary table or the text of ptable-editor
+//***********************************************************************
+static int load_ptable(const char* file) {
+
+FILE* f;
+uint32_t hdr[17];    // signature, reserved, raminit and usbldr descriptors
+uint64_t off;
+
+f=fopen(file,"rb");
+if (f == NULL) {
+  printf("\n Error opening %s\n",file);
+  return 0;
+}
+memset(hdr,0,sizeof(hdr));
+fread(hdr,1,sizeof(hdr),f);
+rewind(f);
+if (hdr[0] == 0x20000) {
+  // usbloader: the table in usbldr
+  fseek(f,hdr[16],SEEK_SET);
+  off=find_ptable(f);
+  if ((off == 0) || (off+16 > (uint64_t)hdr[16]+hdr[14]) || (fread(&ptable,1,sizeof(ptable),f) < 16)) {
+    fclose(f);
+    printf("\n Partition table not found in the loader %s\n",file);
+    return 0;
+  }
+  snprintf(ptsource,sizeof(ptsource),"loader %s, offset %08llx",file,(unsigned long long)off);
+}
+else if (memcmp(hdr,headmagic,sizeof(headmagic)) == 0) {
+  fread(&ptable,1,sizeof(ptable),f);
+  snprintf(ptsource,sizeof(ptsource),"file %s",file);
+}
+else {
+  if (ptable_parse_text(f,&ptable) != 0) {
+    fclose(f);
+    printf("\n %s is neither a loader nor a partition table\n",file);
+    return 0;
+  }
+  snprintf(ptsource,sizeof(ptsource),"text %s",file);
+}
+fclose(f);
+return 1;
+}
+
+// the first table in the dump itself
+static int find_embedded() {
+
+uint32_t raw,unit;
+uint64_t off;
+
+raw=find_ptable_ram((char*)fl.map,(fl.size<0xfffffff0)?fl.size:0xfffffff0);
+if (raw == 0) {
+  printf("\n Partition table not found in the dump, give it with -t\n");
+  return 0;
+}
+off=raw;
+if (fl.oob != 0) {
+  // the header must lie in the data area of a page
+  unit=fl.page+fl.oob;
+  if (raw%unit+16 > fl.page) {
+    printf("\n Partition table not found in the dump, give it with -t\n");
+    return 0;
+  }
+  off=(uint64_t)(raw/unit)*fl.page+raw%unit;
+}
+memset(&ptable,0,sizeof(ptable));
+flash_read(off,&ptable,(fl.datasize-off<sizeof(ptable))?fl.datasize-off:sizeof(ptable));
+snprintf(ptsource,sizeof(ptsource),"dump, flash offset %08llx",(unsigned long long)off);
+return 1;
+}
+
+// partitions of the table, the list ends like in show_map()
+static void list_parts() {
+
+struct part* p;
+int n;
+
+for(n=0;(n<41) && (ptable.part[n].name[0] != 0) && (strcmp(ptable.part[n].name,"T") != 0);n++) {
+  p=&parts[nparts++];
+  memset(p,0,sizeof(*p));
+  p->n=n;
+  memcpy(p->name,ptable.part[n].name,16);
+  p->start=ptable.part[n].start;
+  p->len=ptable.part[n].length;
+  if (p->start >= fl.datasize) p->avail=0;
+  else p->avail=(fl.datasize-p->start<p->len)?fl.datasize-p->start:p->len;
+}
+}
+
+//***********************************************************************
+//* Output file of a partition: <dir>/<nn>-<name>.bin
+//***********************************************************************
+static void out_name(struct part* p) {
+
+char name[17];
+int i;
+
+strcpy(name,p->name);
+for(i=0;name[i] != 0;i++) {
+  if (!(((name[i] >= 'a') && (name[i] <= 'z')) || ((name[i] >= 'A') && (name[i] <= 'Z')) ||
+        ((name[i] >= '0') && (name[i] <= '9')) || (name[i] == '-') || (name[i] == '_') || (name[i] == '.'))) name[i]='_';
+}
+snprintf(p->file,sizeof(p->file),"%s/%02i-%s.bin",outdir,p->n,name);
+}
+
+// all-zero block
+static int is_zero(const uint8_t* buf, uint32_t len) {
+
+return (buf[0] == 0) && (memcmp(buf,buf+1,len-1) == 0);
+}
+
+//***********************************************************************
+//* Writing a piece of the partition; with -s the all-zero 4K blocks are
+//* left as holes
+//***********************************************************************
+static int write_piece(int fd, const uint8_t* buf, uint64_t len) {
+
+uint32_t n;
+ssize_t res;
+
+while (len != 0) {
+  n=(len<4096)?len:4096;
+  if (sflag && (n == 4096) && is_zero(buf,n)) {
+    if (lseek(fd,n,SEEK_CUR)<0) return 0;
+  }
+  else {
+    res=write(fd,buf,n);
+    if (res <= 0) return 0;
+    n=res;
+  }
+  buf+=n;
+  len-=n;
+}
+return 1;
+}
+
+//***********************************************************************
+//* Erased flash: all bytes 0xff
+//***********************************************************************
+static int is_erased(const uint8_t* buf, uint32_t len) {
+
+uint32_t n=len&~3;
+
+if (find_other_word(buf,0,n,0xffffffff) != n) return 0;
+for(;n<len;n++) if (buf[n] != 0xff) return 0;
+return 1;
+}
+
+// adding a range to a list of runs, joined with the last one if adjacent
+static int add_run(struct extent** ext, int* n, uint64_t off, uint64_t len) {
+
+struct extent* e;
+
+if ((*n != 0) && ((*ext)[*n-1].off+(*ext)[*n-1].len == off)) {
+  (*ext)[*n-1].len+=len;
+  return 1;
+}
+if ((*n & 15) == 0) {
+  e=realloc(*ext,(*n+16)*sizeof(struct extent));
+  if (e == NULL) return 0;
+  *ext=e;
+}
+(*ext)[*n].off=off;
+(*ext)[*n].len=len;
+(*n)++;
+return 1;
+}
+
+//***********************************************************************
+//* Erase block occupancy of a partition
+//*
+//* Every page present is checked for 0xff, with its spare area if the dump
+//* has one. An erase block is programmed if any of its pages is.
+//***********************************************************************
+static void do_usage(struct part* p) {
+
+uint64_t off,end,n,blk,cur=~0ULL;
+uint32_t page=fl.page?fl.page:PAGE;
+uint32_t len;
+uint8_t* data;
+int prog=0,i;
+
+end=p->start+p->avail;
+for(off=p->start;off<end;off+=n) {
+  blk=off/EBLOCK*EBLOCK;
+  if (blk != cur) {
+    if (prog && !add_run(&p->ext,&p->next,cur,EBLOCK)) {
+      p->err="not enough memory";
+      return;
+    }
+    if (prog) p->eblocks--;
+    cur=blk;
+    prog=0;
+    p->blocks++;
+    p->eblocks++;
+  }
+  // one page, or the part of it inside the partition
+  data=flash_ptr(off,&n);
+  if (n>page-off%page) n=page-off%page;
+  if (n>end-off) n=end-off;
+  len=n;
+  if ((fl.oob != 0) && ((off+n)%page == 0)) len+=fl.oob;
+  p->pages++;
+  if (is_erased(data,len)) {
+    p->epages++;
+    continue;
+  }
+  prog=1;
+  if (p->dstart == p->dend) p->dstart=off;
+  p->dend=off+n;
+}
+if (prog) {
+  if (!add_run(&p->ext,&p->next,cur,EBLOCK)) p->err="not enough memory";
+  p->eblocks--;
+}
+// runs are counted in whole blocks, clipped to the partition
+for(i=0;i<p->next;i++) {
+  if (p->ext[i].off<p->start) {
+    p->ext[i].len-=p->start-p->ext[i].off;
+    p->ext[i].off=p->start;
+  }
+  if (p->ext[i].off+p->ext[i].len>end) p->ext[i].len=end-p->ext[i].off;
+}
+}
+
+//***********************************************************************
+//* Manifest: the XXH64 of every erase block of every partition
+//*
+//* File, all numbers little-endian:
+//*   "BLFM", version (4), erase block (4), number of partitions (4),
+//*   flash bytes in the dump (8), then for every partition
+//*   name (16), start (8), length (8), bytes present (8),
+//*   number of blocks (4), the hash of every block (8 each)
+//* The last block of a partition cut by the end of the dump is hashed
+//* as far as it goes.
+//***********************************************************************
+static const char fmmagic[4]="BLFM";
+#define FMVERSION 1
+#define FMHEAD 24
+#define FMPART 44
+
+static void put32(uint8_t* p, uint32_t v) {
+
+int i;
+
+for(i=0;i<4;i++) p[i]=v>>(8*i);
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+
+int i;
+
+for(i=0;i<8;i++) p[i]=v>>(8*i);
+}
+
+static uint32_t get32(const uint8_t* p) {
+
+return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static uint64_t get64(const uint8_t* p) {
+
+return get32(p)|((uint64_t)get32(p+4)<<32);
+}
+
+// length of block k of a partition
+static uint32_t block_len(struct part* p, uint32_t k) {
+
+uint64_t rest=p->avail-(uint64_t)k*EBLOCK;
+
+return (rest<EBLOCK)?rest:EBLOCK;
+}
+
+// the work split into steps of UNITBLOCKS, so a large partition is hashed
+// by all workers
+static int plan_units() {
+
+struct part* p;
+uint32_t k;
+int i;
+
+for(i=0;i<nparts;i++) {
+  p=&parts[i];
+  p->nblk=(p->avail+EBLOCK-1)/EBLOCK;
+  p->bh=calloc(p->nblk+1,sizeof(uint64_t));
+  if (p->bh == NULL) return 0;
+  nunits+=(p->nblk+UNITBLOCKS-1)/UNITBLOCKS;
+}
+units=malloc((nunits+1)*sizeof(struct unit));
+if (units == NULL) return 0;
+nunits=0;
+for(i=0;i<nparts;i++) {
+  p=&parts[i];
+  for(k=0;k<p->nblk;k+=UNITBLOCKS) {
+    units[nunits].p=p;
+    units[nunits].first=k;
+    units[nunits].count=(p->nblk-k<UNITBLOCKS)?p->nblk-k:UNITBLOCKS;
+    nunits++;
+  }
+}
+return 1;
+}
+
+static void hash_unit(struct unit* u, uint8_t* buf) {
+
+struct part* p=u->p;
+uint64_t off;
+uint32_t k,len;
+
+for(k=u->first;k<u->first+u->count;k++) {
+  off=p->start+(uint64_t)k*EBLOCK;
+  len=block_len(p,k);
+  if (fl.oob != 0) {
+    flash_read(off,buf,len);
+    p->bh[k]=xxh64(buf,len,0);
+  }
+  else p->bh[k]=xxh64(fl.map+off,len,0);
+}
+}
+
+static void* mworker(void* arg) {
+
+uint8_t* buf=NULL;
+int i;
+
+if ((fl.oob != 0) && ((buf=malloc(EBLOCK)) == NULL)) return NULL;
+while ((i=__sync_fetch_and_add(&nextunit,1)) < nunits) hash_unit(&units[i],buf);
+free(buf);
+return NULL;
+}
+
+//***********************************************************************
+//* Saving and loading a manifest
+//***********************************************************************
+static int manifest_save(const char* file) {
+
+FILE* f;
+uint8_t head[FMHEAD];
+uint8_t ph[FMPART];
+uint8_t h[8];
+struct part* p;
+uint32_t k;
+int i,ok;
+
+f=fopen(file,"wb");
+if (f == NULL) return 0;
+memcpy(head,fmmagic,4);
+put32(head+4,FMVERSION);
+put32(head+8,EBLOCK);
+put32(head+12,nparts);
+put64(head+16,fl.datasize);
+ok=(fwrite(head,1,FMHEAD,f) == FMHEAD);
+for(i=0;ok && (i<nparts);i++) {
+  p=&parts[i];
+  memset(ph,0,16);
+  memcpy(ph,p->name,strlen(p->name));
+  put64(ph+16,p->start);
+  put64(ph+24,p->len);
+  put64(ph+32,p->avail);
+  put32(ph+40,p->nblk);
+  ok=(fwrite(ph,1,FMPART,f) == FMPART);
+  for(k=0;ok && (k<p->nblk);k++) {
+    put64(h,p->bh[k]);
+    ok=(fwrite(h,1,8,f) == 8);
+  }
+}
+if (fclose(f) != 0) ok=0;
+return ok;
+}
+
+static int manifest_load(const char* file, struct part* pp, int* n) {
+
+FILE* f;
+uint8_t head[FMHEAD];
+uint8_t ph[FMPART];
+uint8_t h[8];
+struct part* p;
+uint32_t k,cnt;
+int i;
+
+f=fopen(file,"rb");
+if (f == NULL) {
+  printf("\n Error opening %s\n",file);
+  return 0;
+}
+if ((fread(head,1,FMHEAD,f) != FMHEAD) || (memcmp(head,fmmagic,4) != 0) || (get32(head+4) != FMVERSION)) goto bad;
+if (get32(head+8) != EBLOCK) {
+  printf("\n %s is made for erase blocks of %08x bytes\n",file,get32(head+8));
+  fclose(f);
+  return 0;
+}
+cnt=get32(head+12);
+if (cnt>41) goto bad;
+for(i=0;i<cnt;i++) {
+  p=&pp[i];
+  memset(p,0,sizeof(*p));
+  if (fread(ph,1,FMPART,f) != FMPART) goto bad;
+  p->n=i;
+  memcpy(p->name,ph,16);
+  p->start=get64(ph+16);
+  p->len=get64(ph+24);
+  p->avail=get64(ph+32);
+  p->nblk=get32(ph+40);
+  if ((p->avail>p->len) || (p->nblk != (p->avail+EBLOCK-1)/EBLOCK)) goto bad;
+  p->bh=malloc((p->nblk+1)*sizeof(uint64_t));
+  if (p->bh == NULL) goto bad;
+  for(k=0;k<p->nblk;k++) {
+    if (fread(h,1,8,f) != 8) goto bad;
+    p->bh[k]=get64(h);
+  }
+}
+*n=cnt;
+fclose(f);
+return 1;
+
+bad:
+printf("\n %s is not a valid flash manifest\n",file);
+fclose(f);
+return 0;
+}
+
+// the file starts like a manifest
+static int is_manifest(const char* file) {
+
+FILE* f;
+char magic[4];
+int res=0;
+
+f=fopen(file,"rb");
+if (f == NULL) return 0;
+if ((fread(magic,1,4,f) == 4) && (memcmp(magic,fmmagic,4) == 0)) res=1;
+fclose(f);
+return res;
+}
+
+//***********************************************************************
+//* Flashing plan: the blocks of the target that differ from the device
+//*
+//* Partitions are matched by name. A partition that is missing on the
+//* device or lies elsewhere is changed as a whole. A changed block that
+//* is erased in the target only needs to be erased.
+//***********************************************************************
+static int diff_parts() {
+
+static uint8_t ff[EBLOCK];
+struct part* p;
+struct part* d;
+uint64_t off,ffhash,ffpart=0;
+uint32_t k,len,fflen=0;
+int i,j,ok;
+
+memset(ff,0xff,sizeof(ff));
+ffhash=xxh64(ff,EBLOCK,0);
+for(i=0;i<nparts;i++) {
+  p=&parts[i];
+  d=NULL;
+  for(j=0;j<ndev;j++) {
+    if (strcmp(dev[j].name,p->name) == 0) {
+      d=&dev[j];
+      break;
+    }
+  }
+  if (d == NULL) p->layout=1;
+  else if ((d->start != p->start) || (d->len != p->len)) p->layout=2;
+  for(k=0;k<p->nblk;k++) {
+    if ((p->layout == 0) && (k<d->nblk) && (d->bh[k] == p->bh[k])) continue;
+    p->changed++;
+    off=p->start+(uint64_t)k*EBLOCK;
+    len=block_len(p,k);
+    if ((len != EBLOCK) && (len != fflen)) {
+      fflen=len;
+      ffpart=xxh64(ff,len,0);
+    }
+    if (p->bh[k] == ((len == EBLOCK)?ffhash:ffpart)) ok=add_run(&p->er,&p->ner,off,len);
+    else ok=add_run(&p->wr,&p->nwr,off,len);
+    if (!ok) return 0;
+  }
+}
+return 1;
+}
+
+//***********************************************************************
+//* Processing one partition
+//*
+//* Without a spare area and holes the data is copied by the kernel with
+//* copy_file_range(); the hash is computed from the mapping. With a spare
+//* area the pages are gathered into a buffer first.
+//***********************************************************************
+static void do_part(struct part* p) {
+
+struct sha256 ctx;
+struct timespec t0,t1;
+uint64_t off,end,n;
+loff_t in;
+ssize_t res;
+uint8_t* data;
+uint8_t* buf=NULL;
+char tmp[4300];
+int fd=-1,ok=1;
+
+clock_gettime(CLOCK_MONOTONIC,&t0);
+if (uflag) {
+  do_usage(p);
+  goto done;
+}
+if (hflag) sha256_init(&ctx);
+if (outdir != NULL) {
+  out_name(p);
+  snprintf(tmp,sizeof(tmp),"%s.tmp%i",p->file,(int)getpid());
+  fd=open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0644);
+  if (fd<0) {
+    p->err="cannot create the output";
+    return;
+  }
+  if ((fl.oob == 0) && !sflag) {
+    // in-kernel copy, unless the file systems do not support it
+    in=p->start;
+    for(n=0;n<p->avail;n+=res) {
+      res=copy_file_range(fl.fd,&in,fd,NULL,p->avail-n,0);
+      if (res <= 0) break;
+    }
+    if (n == p->avail) p->copied=1;
+    else if (n != 0) ok=0;
+  }
+}
+
+end=p->start+p->avail;
+if (!hflag && (fd<0 || p->copied)) end=p->start;
+if ((fl.oob != 0) && (end != p->start)) {
+  buf=malloc(CHUNK);
+  if (buf == NULL) {
+    p->err="not enough memory";
+    ok=0;
+  }
+}
+for(off=p->start;ok && (off<end);off+=n) {
+  n=(end-off<CHUNK)?(end-off):CHUNK;
+  if (buf != NULL) {
+    flash_read(off,buf,n);
+    data=buf;
+  }
+  else data=fl.map+off;
+  if (hflag) sha256_update(&ctx,data,n);
+  if ((fd >= 0) && !p->copied) ok=write_piece(fd,data,n);
+}
+if (hflag) sha256_final(&ctx,p->hash);
+free(buf);
+
+if (fd >= 0) {
+  // the holes at the end need the size set
+  if (ok && sflag && (ftruncate(fd,p->avail) != 0)) ok=0;
+  if ((close(fd) != 0) || !ok || (rename(tmp,p->file) != 0)) {
+    unlink(tmp);
+    if (p->err == NULL) p->err="cannot write the output";
+  }
+}
+done:
+clock_gettime(CLOCK_MONOTONIC,&t1);
+p->ms=(t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6;
+}
+
+// largest partition first: its sequential SHA-256 bounds the run
+static int cmpsize(const void* a, const void* b) {
+
+uint64_t x=parts[*(int*)a].avail;
+uint64_t y=parts[*(int*)b].avail;
+
+if (x != y) return (x>y)?-1:1;
+return *(int*)a-*(int*)b;
+}
+
+static void* worker(void* arg) {
+
+int i;
+
+while ((i=__sync_fetch_and_add(&nextpart,1)) < nparts) do_part(&parts[order[i]]);
+return NULL;
+}
+
+//***********************************************************************
+//* Report
+//***********************************************************************
+static void json_str(const char* str) {
+
+putchar('"');
+for(;*str != 0;str++) {
+  if ((*str == '"') || (*str == '\\')) printf("\\%c",*str);
+  else if ((uint8_t)*str<0x20) printf("\\u%04x",*str);
+  else putchar(*str);
+}
+putchar('"');
+}
+
+//***********************************************************************
+//* Report of usage: blocks and pages, erased of them, the end of the data
+//* relative to the partition, the runs of programmed blocks
+//***********************************************************************
+static void report_usage(int json) {
+
+struct part* p;
+int i,k;
+
+if (!json) printf("\n ## ----- NAME ----- start    length   blocks  erased   pages    erased   data end runs\n--------------------------------------------------------------------------------------");
+for(i=0;i<nparts;i++) {
+  p=&parts[i];
+  if (json) {
+    printf("{\"n\": %i, \"name\": ",p->n);
+    json_str(p->name);
+    printf(", \"start\": %llu, \"length\": %llu, \"present\": %llu",(unsigned long long)p->start,(unsigned long long)p->len,(unsigned long long)p->avail);
+    printf(", \"blocks\": %u, \"erased_blocks\": %u, \"pages\": %u, \"erased_pages\": %u",p->blocks,p->eblocks,p->pages,p->epages);
+    if (p->dstart == p->dend) printf(", \"data\": null");
+    else printf(", \"data\": [%llu, %llu]",(unsigned long long)p->dstart,(unsigned long long)(p->dend-p->dstart));
+    printf(", \"extents\": [");
+    for(k=0;k<p->next;k++) printf("%s[%llu, %llu]",k?", ":"",(unsigned long long)p->ext[k].off,(unsigned long long)p->ext[k].len);
+    printf("]");
+    if (p->err != NULL) {
+      printf(", \"error\": ");
+      json_str(p->err);
+    }
+    printf(", \"ms\": %.1f}\n",p->ms);
+    continue;
+  }
+  printf("\n %02i %-16s %08llx %08llx %-7u %-7u  %-8u %-8u %08llx %u",p->n,p->name,(unsigned long long)p->start,(unsigned long long)p->len,
+         p->blocks,p->eblocks,p->pages,p->epages,(unsigned long long)((p->dstart == p->dend)?0:p->dend-p->start),p->next);
+  if (p->err != NULL) printf("  ! %s",p->err);
+  else if (p->avail<p->len) printf("  ! beyond the end of the dump");
+}
+}
+
+//***********************************************************************
+//* Report of a manifest: the blocks hashed
+//***********************************************************************
+static void report_manifest(int json) {
+
+struct part* p;
+int i;
+
+if (!json) printf("\n ## ----- NAME ----- start    length   present  blocks\n-----------------------------------------------------------");
+for(i=0;i<nparts;i++) {
+  p=&parts[i];
+  if (json) {
+    printf("{\"n\": %i, \"name\": ",p->n);
+    json_str(p->name);
+    printf(", \"start\": %llu, \"length\": %llu, \"present\": %llu, \"blocks\": %u}\n",(unsigned long long)p->start,(unsigned long long)p->len,(unsigned long long)p->avail,p->nblk);
+    continue;
+  }
+  printf("\n %02i %-16s %08llx %08llx %08llx %u",p->n,p->name,(unsigned long long)p->start,(unsigned long long)p->len,(unsigned long long)p->avail,p->nblk);
+  if (p->avail<p->len) printf("  ! beyond the end of the dump");
+}
+}
+
+//***********************************************************************
+//* Report of diff: the changed blocks, the runs to write and to erase
+//***********************************************************************
+static void json_runs(const char* key, struct extent* e, int n) {
+
+int k;
+
+printf(", \"%s\": [",key);
+for(k=0;k<n;k++) printf("%s[%llu, %llu]",k?", ":"",(unsigned long long)e[k].off,(unsigned long long)e[k].len);
+printf("]");
+}
+
+static void report_diff(int json) {
+
+static const char* layout[]={"","  ! not on the device","  ! start or length changed"};
+struct part* p;
+int i,k;
+
+if (!json) printf("\n ## ----- NAME ----- start    length   blocks  changed\n----------------------------------------------------------");
+for(i=0;i<nparts;i++) {
+  p=&parts[i];
+  if (json) {
+    printf("{\"n\": %i, \"name\": ",p->n);
+    json_str(p->name);
+    printf(", \"start\": %llu, \"length\": %llu, \"blocks\": %u, \"changed\": %u",(unsigned long long)p->start,(unsigned long long)p->len,p->nblk,p->changed);
+    printf(", \"layout\": %s",(p->layout == 1)?"\"new\"":(p->layout == 2)?"\"moved\"":"null");
+    json_runs("write",p->wr,p->nwr);
+    json_runs("erase",p->er,p->ner);
+    printf("}\n");
+    continue;
+  }
+  printf("\n %02i %-16s %08llx %08llx %-7u %u%s",p->n,p->name,(unsigned long long)p->start,(unsigned long long)p->len,p->nblk,p->changed,layout[p->layout]);
+  for(k=0;k<p->nwr;k++) printf("\n      write %08llx-%08llx",(unsigned long long)p->wr[k].off,(unsigned long long)(p->wr[k].off+p->wr[k].len));
+  for(k=0;k<p->ner;k++) printf("\n      erase %08llx-%08llx",(unsigned long long)p->er[k].off,(unsigned long long)(p->er[k].off+p->er[k].len));
+}
+}
+
+static void report(int json) {
+
+struct part* p;
+char hex[65];
+int i;
+
+if (uflag) {
+  report_usage(json);
+  return;
+}
+if (mflag) {
+  report_manifest(json);
+  return;
+}
+if (dflag) {
+  report_diff(json);
+  return;
+}
+
+if (!json) printf("\n ## ----- NAME ----- start    length   present  %s\n---------------------------------------------------------------------",hflag?"sha256":"");
+for(i=0;i<nparts;i++) {
+  p=&parts[i];
+  sha256_hex(p->hash,hex);
+  if (json) {
+    printf("{\"n\": %i, \"name\": ",p->n);
+    json_str(p->name);
+    printf(", \"start\": %llu, \"length\": %llu, \"present\": %llu",(unsigned long long)p->start,(unsigned long long)p->len,(unsigned long long)p->avail);
+    if (hflag) printf(", \"sha256\": \"%s\"",hex);
+    if (outdir != NULL) {
+      printf(", \"file\": ");
+      if (p->err == NULL) json_str(p->file);
+      else printf("null");
+    }
+    if (p->err != NULL) {
+      printf(", \"error\": ");
+      json_str(p->err);
+    }
+    printf(", \"ms\": %.1f}\n",p->ms);
+    continue;
+  }
+  printf("\n %02i %-16s %08llx %08llx %08llx",p->n,p->name,(unsigned long long)p->start,(unsigned long long)p->len,(unsigned long long)p->avail);
+  if (hflag) printf(" %s",hex);
+  if (p->err != NULL) printf("  ! %s",p->err);
+  else if (p->avail<p->len) printf("  ! beyond the end of the dump");
+}
+}
+
+//#######################################################################################################
+void main(int argc, char* argv[]) {
+
+struct stat st;
+struct timespec t0,t1;
+pthread_t th[MAXWORKERS];
+char* ptfile=NULL;
+char* cmd;
+int opt,json=0,nthreads=0,i,k;
+uint32_t blocks,used,changed;
+uint64_t total=0,wbytes,ebytes;
+double sec;
+
+if ((argc<2) || (strcmp(argv[1],"-h") == 0)) {
+  printf("\n Operations on a flash dump by the partition table\n\n\
+%s <command> [keys] <dump>\n\n\
+ Commands:\n\n\
+extract  - write every partition into a file of the -o directory (<nn>-<name>.bin)\n\
+hash     - SHA-256 of every partition; a partition is hashed by one worker, since\n\
+           SHA-256 is sequential, so the largest one bounds the run\n\
+usage    - erased and programmed erase blocks (0x20000) and pages of every partition,\n\
+           the end of the data and the runs of programmed blocks\n\
+manifest - write the hash of every erase block of every partition into the -m file\n\
+diff     - compare the device manifest (-m) with the target, a dump or a manifest:\n\
+           the block ranges of every partition to write and to erase\n\n\
+ The following keys are valid:\n\n\
+-t file  - partition table: a usbloader, a binary table or the text of ptable-editor\n\
+           (default - the first table found in the dump)\n\
+-P p:s   - the dump holds pages of p bytes, each followed by s spare bytes (2048:64);\n\
+           p:0 only sets the page for usage (default 2048)\n\
+-o dir   - output directory for extract\n\
+-m file  - manifest: written by manifest, the device side for diff\n\
+-H       - extract: hash the partitions as well\n\
+-s       - extract: leave the all-zero 4K blocks of the output files as holes\n\
+-j n     - number of workers (default - one per partition, for manifest and diff\n\
+           one per CPU)\n\
+-J       - report as JSON lines\n\n",argv[0]);
+  return;
+}
+cmd=argv[1];
+if (strcmp(cmd,"hash") == 0) hflag=1;
+else if (strcmp(cmd,"usage") == 0) uflag=1;
+else if (strcmp(cmd,"manifest") == 0) mflag=1;
+else if (strcmp(cmd,"diff") == 0) dflag=1;
+else if (strcmp(cmd,"extract") != 0) {
+  printf("\n Unknown command %s, for a hint use -h\n",cmd);
+  return;
+}
+
+while ((opt = getopt(argc-1, argv+1, "t:P:o:m:Hsj:J")) != -1) {
+  switch (opt) {
+   case 't':
+     ptfile=optarg;
+     break;
+
+   case 'P':
+     if ((sscanf(optarg,"%u:%u",&fl.page,&fl.oob) != 2) || (fl.page == 0)) {
+       printf("\n The page layout must be given as page:spare, for example 2048:64\n");
+       return;
+     }
+     break;
+
+   case 'o':
+     outdir=optarg;
+     break;
+
+   case 'm':
+     manfile=optarg;
+     break;
+
+   case 'H':
+     hflag=1;
+     break;
+
+   case 's':
+     sflag=1;
+     break;
+
+   case 'j':
+     nthreads=atoi(optarg);
+     break;
+
+   case 'J':
+     json=1;
+     break;
+
+   case '?':
+   case ':':
+     return;
+  }
+}
+optind++;
+if (optind>=argc) {
+  printf("\n No dump file specified\n");
+  return;
+}
+if ((strcmp(cmd,"extract") == 0) && (outdir == NULL)) {
+  printf("\n extract needs the output directory (-o)\n");
+  return;
+}
+if ((mflag || dflag) && (manfile == NULL)) {
+  printf("\n %s needs the manifest file (-m)\n",cmd);
+  return;
+}
+if (uflag || mflag || dflag) {
+  outdir=NULL;
+  hflag=0;
+}
+if (dflag) {
+  if (!manifest_load(manfile,dev,&ndev)) return;
+  if (is_manifest(argv[optind])) {
+    // both sides hashed already
+    if (!manifest_load(argv[optind],parts,&nparts)) return;
+    if (!diff_parts()) {
+      printf("\n Not enough memory\n");
+      return;
+    }
+    if (!json) printf("\n Device %s, target %s\n",manfile,argv[optind]);
+    report(json);
+    if (!json) printf("\n");
+    goto summary;
+  }
+}
+
+fl.fd=open(argv[optind],O_RDONLY);
+if ((fl.fd<0) || (fstat(fl.fd,&st) != 0) || (st.st_size == 0)) {
+  printf("\n Error opening %s\n",argv[optind]);
+  return;
+}
+fl.size=st.st_size;
+fl.datasize=(fl.oob == 0)?fl.size:fl.size/(fl.page+fl.oob)*fl.page;
+fl.map=mmap(NULL,fl.size,PROT_READ,MAP_SHARED,fl.fd,0);
+if (fl.map == MAP_FAILED) {
+  printf("\n Error mapping %s\n",argv[optind]);
+  return;
+}
+madvise(fl.map,fl.size,MADV_SEQUENTIAL);
+
+if ((ptfile != NULL)?!load_ptable(ptfile):!find_embedded()) return;
+list_parts();
+if (nparts == 0) {
+  printf("\n The partition table is empty\n");
+  return;
+}
+if ((outdir != NULL) && (mkdir(outdir,0755) != 0) && (errno != EEXIST)) {
+  printf("\n Error creating %s\n",outdir);
+  return;
+}
+if (!json) printf("\n Dump %s: %llu bytes of flash, partition table from the %s\n",argv[optind],(unsigned long long)fl.datasize,ptsource);
+
+if (mflag || dflag) {
+  if (!plan_units()) {
+    printf("\n Not enough memory\n");
+    return;
+  }
+  if (nthreads<1) nthreads=sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads>nunits) nthreads=nunits;
+}
+else if ((nthreads<1) || (nthreads>nparts)) nthreads=nparts;
+if (nthreads>MAXWORKERS) nthreads=MAXWORKERS;
+// the scan and SHA-256 code is chosen here, before the workers
+wordscan_impl();
+if (uflag && !json) printf("\n Blank check: %s, page %u%s\n",wordscan_impl(),fl.page?fl.page:PAGE,fl.oob?" with the spare area":"");
+if (hflag && !json) printf("\n SHA-256: %s, largest partition first\n",sha256_impl());
+else if (hflag) sha256_impl();
+for(i=0;i<nparts;i++) order[i]=i;
+qsort(order,nparts,sizeof(int),cmpsize);
+clock_gettime(CLOCK_MONOTONIC,&t0);
+for(i=0;i<nthreads;i++) {
+  if (pthread_create(&th[i],NULL,(mflag || dflag)?mworker:worker,NULL) != 0) break;
+}
+nthreads=i;
+if (nthreads == 0) {
+  if (mflag || dflag) mworker(NULL);
+  else worker(NULL);
+}
+for(i=0;i<nthreads;i++) pthread_join(th[i],NULL);
+clock_gettime(CLOCK_MONOTONIC,&t1);
+sec=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9;
+
+if (mflag && !manifest_save(manfile)) {
+  printf("\n Error writing %s\n",manfile);
+  return;
+}
+if (dflag && !diff_parts()) {
+  printf("\n Not enough memory\n");
+  return;
+}
+report(json);
+if (mflag && !json) printf("\n\n Manifest: %s",manfile);
+for(i=0;i<nparts;i++) total+=parts[i].avail;
+if (uflag && !json) {
+  for(i=0,used=0,blocks=0;i<nparts;i++) {
+    blocks+=parts[i].blocks;
+    used+=parts[i].blocks-parts[i].eblocks;
+  }
+  printf("\n\n Erase blocks: %u, programmed %u (%llu bytes)",blocks,used,(unsigned long long)used*EBLOCK);
+}
+if (!json) printf("\n\n Partitions: %i, %llu bytes, %.2f s, %.0f MB/s, %i workers\n",nparts,(unsigned long long)total,sec,total/1048576.0/sec,nthreads?nthreads:1);
+if (!dflag) return;
+
+summary:
+for(i=0,changed=0,wbytes=0,ebytes=0;i<nparts;i++) {
+  changed+=parts[i].changed;
+  for(k=0;k<parts[i].nwr;k++) wbytes+=parts[i].wr[k].len;
+  for(k=0;k<parts[i].ner;k++) ebytes+=parts[i].er[k].len;
+}
+if (!json) printf(" Changed blocks: %u, to write %llu bytes, to erase %llu bytes\n",changed,(unsigned long long)wbytes,(unsigned long long)ebytes);
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frames.h"
+#include "crc16.h"
+
+//***********************************************************************
+//* CRC of the frame into its last two bytes
+//***********************************************************************
+static void frame_crc(uint8_t* buf, uint32_t len) {
+
+uint16_t crc=crc16_update(0,buf,len-2);
+
+buf[len-2]=crc>>8;
+buf[len-1]=crc&0xff;
+}
+
+//***********************************************************************
+//* Payload length of data frame n (0-based)
+//***********************************************************************
+uint32_t frame_payload(struct frames* fr, int bl, uint32_t n) {
+
+struct frameblk* fb=&fr->blk[bl];
+
+if (n+1 < fb->npkt) return DATALEN;
+return fb->size-n*DATALEN;
+}
+
+//***********************************************************************
+//* Arena space and layout of the frames of component bl
+//***********************************************************************
+static uint8_t* add_block(struct frames* fr, int bl, uint32_t lmode, uint32_t adr, const uint8_t* pbuf, uint32_t size) {
+
+struct frameblk* fb=&fr->blk[bl];
+uint32_t npkt,need;
+uint8_t* arena;
+
+if (bl == 0) {
+  fr->arena=NULL;
+  fr->size=0;
+  fr->nblk=0;
+}
+if ((bl != fr->nblk) || (bl >= MAXFRAMEBLK) || (size == 0)) return NULL;
+
+npkt=(size+DATALEN-1)/DATALEN;
+need=14+npkt*5+5;
+arena=realloc(fr->arena,fr->size+need);
+if (arena == NULL) return NULL;
+fr->arena=arena;
+
+fb->lmode=lmode;
+fb->size=size;
+fb->adr=adr;
+fb->payload=pbuf;
+fb->npkt=npkt;
+fb->head=fr->size;
+fb->env=fb->head+14;
+fb->eod=fb->env+npkt*5;
+fr->size+=need;
+fr->nblk++;
+return arena;
+}
+
+//***********************************************************************
+//* Adding the frames of component bl
+//*
+//* The header, the envelopes of all data frames and the end of data frame
+//* are laid out in the arena with their CRCs precomputed, so sending the
+//* component needs no work per packet. Components must be added in order.
+//***********************************************************************
+int build_frames(struct frames* fr, int bl, uint32_t lmode, uint32_t adr, const uint8_t* pbuf, uint32_t size) {
+
+struct frameblk* fb=&fr->blk[bl];
+uint32_t npkt,i,len,seq;
+uint16_t crc;
+uint8_t* p;
+uint8_t* arena;
+
+arena=add_block(fr,bl,lmode,adr,pbuf,size);
+if (arena == NULL) return 0;
+npkt=fb->npkt;
+
+// block start packet
+p=arena+fb->head;
+p[0]=0xfe;
+p[1]=0;
+p[2]=0xff;
+p[3]=lmode;
+p[4]=size>>24; p[5]=size>>16; p[6]=size>>8; p[7]=size;
+p[8]=adr>>24;  p[9]=adr>>16;  p[10]=adr>>8; p[11]=adr;
+frame_crc(p,14);
+
+// data packets, numbered from 1
+for(i=0;i<npkt;i++) {
+  p=arena+fb->env+i*5;
+  len=frame_payload(fr,bl,i);
+  seq=i+1;
+  p[0]=0xda;
+  p[1]=seq;
+  p[2]=(~seq)&0xff;
+  crc=crc16_update(crc16_update(0,p,3),pbuf+i*DATALEN,len);
+  p[3]=crc>>8;
+  p[4]=crc&0xff;
+}
+
+// end of data packet
+p=arena+fb->eod;
+seq=npkt+1;
+p[0]=0xed;
+p[1]=seq;
+p[2]=(~seq)&0xff;
+frame_crc(p,5);
+return 1;
+}
+
+//***********************************************************************
+//* Adding the frames of component bl from a saved arena
+//*
+//* saved is the arena of a download built earlier with the same components;
+//* its part for component bl is copied instead of computing the CRCs again.
+//***********************************************************************
+int restore_frames(struct frames* fr, int bl, uint32_t lmode, uint32_t adr, const uint8_t* pbuf, uint32_t size, const uint8_t* saved) {
+
+struct frameblk* fb=&fr->blk[bl];
+uint8_t* arena;
+
+arena=add_block(fr,bl,lmode,adr,pbuf,size);
+if (arena == NULL) return 0;
+memcpy(arena+fb->head,saved+fb->head,fr->size-fb->head);
+return 1;
+}
+
+//***********************************************************************
+//* Scatter list of data frame n (0-based): head, payload, CRC
+//***********************************************************************
+int frame_iov(struct frames* fr, int bl, uint32_t n, struct iovec* iov) {
+
+struct frameblk* fb=&fr->blk[bl];
+uint8_t* env=fr->arena+fb->env+n*5;
+
+iov[0].iov_base=env;
+iov[0].iov_len=3;
+iov[1].iov_base=(void*)(fb->payload+n*DATALEN);
+iov[1].iov_len=frame_payload(fr,bl,n);
+iov[2].iov_base=env+3;
+iov[2].iov_len=2;
+return 3;
+}
+
+//***********************************************************************
+//* Releasing the arena
+//***********************************************************************
+void free_frames(struct frames* fr) {
+
+free(fr->arena);
+fr->arena=NULL;
+fr->size=0;
+fr->nblk=0;
+}
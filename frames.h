@@ -0,0 +1,42 @@
+// Prepared boot protocol frames of the loader components
+
+#ifndef WIN32
+#include <sys/uio.h>
+#else
+struct iovec {
+  void* iov_base;
+  size_t iov_len;
+};
+#endif
+
+#define DATALEN 1024             // payload of a full data frame
+#define FRAMELEN (DATALEN+5)     // data frame: 0xda, seq, ~seq, payload, crc
+#define MAXFRAMEBLK 2            // raminit and usbldr
+
+// Frames of one component
+struct frameblk {
+  uint32_t lmode;    // boot mode
+  uint32_t size;     // component size
+  uint32_t adr;      // component loading address
+  const uint8_t* payload;  // component image, must stay valid while the frames are used
+  uint32_t head;     // arena offset of the 14-byte header frame
+  uint32_t env;      // arena offset of the data frame envelopes: 3 bytes of head and 2 bytes of CRC per frame
+  uint32_t npkt;     // number of data frames
+  uint32_t eod;      // arena offset of the 5-byte end of data frame
+};
+
+// All frames of the download, built once before the port is opened.
+// The data frames are not copied: each one is sent as its head from the
+// arena, a slice of the component image and its CRC from the arena.
+struct frames {
+  uint8_t* arena;
+  uint32_t size;
+  int nblk;
+  struct frameblk blk[MAXFRAMEBLK];
+};
+
+int build_frames(struct frames* fr, int bl, uint32_t lmode, uint32_t adr, const uint8_t* pbuf, uint32_t size);
+int restore_frames(struct frames* fr, int bl, uint32_t lmode, uint32_t adr, const uint8_t* pbuf, uint32_t size, const uint8_t* saved);
+int frame_iov(struct frames* fr, int bl, uint32_t n, struct iovec* iov);
+uint32_t frame_payload(struct frames* fr, int bl, uint32_t n);
+void free_frames(struct frames* fr);
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "sha256.h"
+
+// Journal file, all numbers little-endian:
+//   "BLPJ", version (4), size (8), input hash (32), output hash (32),
+//   note (64), number of ranges (4), then for every range
+//   offset (8), length (4), input bytes, patched bytes
+static const char pjmagic[4]="BLPJ";
+#define PJVERSION 1
+#define PJHEAD (4+4+8+32+32+64+4)
+#define PJGAP 8        // equal bytes that do not split a range
+#define PJMAXLEN 4096  // longest range
+
+//***********************************************************************
+//* Little-endian fields
+//***********************************************************************
+static void put32(uint8_t* p, uint32_t v) {
+
+int i;
+
+for(i=0;i<4;i++) p[i]=v>>(8*i);
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+
+int i;
+
+for(i=0;i<8;i++) p[i]=v>>(8*i);
+}
+
+static uint32_t get32(const uint8_t* p) {
+
+return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static uint64_t get64(const uint8_t* p) {
+
+return get32(p)|((uint64_t)get32(p+4)<<32);
+}
+
+//***********************************************************************
+//* Adding a range
+//***********************************************************************
+static int add_entry(struct journal* j, uint64_t off, const uint8_t* orig, const uint8_t* patched, uint32_t len) {
+
+struct pjentry* e;
+
+if ((j->n & 15) == 0) {
+  e=realloc(j->e,(j->n+16)*sizeof(struct pjentry));
+  if (e == NULL) return 0;
+  j->e=e;
+}
+e=&j->e[j->n];
+e->off=off;
+e->len=len;
+e->orig=malloc(len);
+e->patched=malloc(len);
+if ((e->orig == NULL) || (e->patched == NULL)) {
+  free(e->orig);
+  free(e->patched);
+  return 0;
+}
+memcpy(e->orig,orig,len);
+memcpy(e->patched,patched,len);
+j->n++;
+return 1;
+}
+
+//***********************************************************************
+//* Building the journal from the input and the patched buffer
+//*
+//* Differing bytes closer than PJGAP make one range. Returns 0 if there
+//* is not enough memory.
+//***********************************************************************
+int journal_diff(struct journal* j, const uint8_t* orig, const uint8_t* patched, uint64_t size, const char* note) {
+
+uint64_t i,start,last;
+uint32_t blk;
+
+memset(j,0,sizeof(*j));
+j->size=size;
+strncpy(j->note,note,sizeof(j->note)-1);
+sha256(orig,size,j->inhash);
+sha256(patched,size,j->outhash);
+
+for(i=0;i<size;) {
+  // equal blocks are skipped with memcmp
+  blk=(size-i<64)?(size-i):64;
+  if (memcmp(orig+i,patched+i,blk) == 0) {
+    i+=blk;
+    continue;
+  }
+  while (orig[i] == patched[i]) i++;
+  start=last=i;
+  for(i++;(i<size) && (i-last<=PJGAP) && (i-start<PJMAXLEN);i++) {
+    if (orig[i] != patched[i]) last=i;
+  }
+  if (!add_entry(j,start,orig+start,patched+start,last-start+1)) return 0;
+  i=last+1;
+}
+return 1;
+}
+
+//***********************************************************************
+//* Saving the journal
+//***********************************************************************
+int journal_save(struct journal* j, const char* file) {
+
+FILE* f;
+uint8_t head[PJHEAD];
+uint8_t eh[12];
+int i,ok;
+
+f=fopen(file,"wb");
+if (f == NULL) return 0;
+memcpy(head,pjmagic,4);
+put32(head+4,PJVERSION);
+put64(head+8,j->size);
+memcpy(head+16,j->inhash,32);
+memcpy(head+48,j->outhash,32);
+memset(head+80,0,64);
+strncpy((char*)head+80,j->note,63);
+put32(head+144,j->n);
+ok=(fwrite(head,1,PJHEAD,f) == PJHEAD);
+for(i=0;ok && (i<j->n);i++) {
+  put64(eh,j->e[i].off);
+  put32(eh+8,j->e[i].len);
+  ok=(fwrite(eh,1,12,f) == 12) && (fwrite(j->e[i].orig,1,j->e[i].len,f) == j->e[i].len) &&
+     (fwrite(j->e[i].patched,1,j->e[i].len,f) == j->e[i].len);
+}
+if (fclose(f) != 0) ok=0;
+return ok;
+}
+
+//***********************************************************************
+//* Loading a journal
+//***********************************************************************
+int journal_load(struct journal* j, const char* file, char* err, int errlen) {
+
+FILE* f;
+uint8_t head[PJHEAD];
+uint8_t eh[12];
+uint8_t buf[2*PJMAXLEN];
+uint32_t n,len,i;
+uint64_t off;
+
+memset(j,0,sizeof(*j));
+f=fopen(file,"rb");
+if (f == NULL) {
+  snprintf(err,errlen,"Error opening %s",file);
+  return 0;
+}
+if ((fread(head,1,PJHEAD,f) != PJHEAD) || (memcmp(head,pjmagic,4) != 0) || (get32(head+4) != PJVERSION)) goto bad;
+j->size=get64(head+8);
+memcpy(j->inhash,head+16,32);
+memcpy(j->outhash,head+48,32);
+memcpy(j->note,head+80,63);
+n=get32(head+144);
+for(i=0;i<n;i++) {
+  if (fread(eh,1,12,f) != 12) goto bad;
+  off=get64(eh);
+  len=get32(eh+8);
+  if ((len == 0) || (len>PJMAXLEN) || (off>j->size) || (len>j->size-off)) goto bad;
+  if (fread(buf,1,2*len,f) != 2*len) goto bad;
+  if (!add_entry(j,off,buf,buf+len,len)) goto bad;
+}
+fclose(f);
+return 1;
+
+bad:
+snprintf(err,errlen,"%s is not a valid patch journal",file);
+fclose(f);
+journal_free(j);
+return 0;
+}
+
+//***********************************************************************
+void journal_free(struct journal* j) {
+
+int i;
+
+for(i=0;i<j->n;i++) {
+  free(j->e[i].orig);
+  free(j->e[i].patched);
+}
+free(j->e);
+j->e=NULL;
+j->n=0;
+}
+
+//***********************************************************************
+//* State of an open file: the journal ranges are read, nothing else
+//***********************************************************************
+int journal_state(struct journal* j, int fd) {
+
+uint8_t buf[PJMAXLEN];
+int i,orig=1,patched=1;
+
+for(i=0;i<j->n;i++) {
+  if (pread(fd,buf,j->e[i].len,j->e[i].off) != j->e[i].len) return PJ_IOERR;
+  if (memcmp(buf,j->e[i].orig,j->e[i].len) != 0) orig=0;
+  if (memcmp(buf,j->e[i].patched,j->e[i].len) != 0) patched=0;
+}
+// an empty journal leaves the file as it is
+if (patched) return PJ_PATCHED;
+if (orig) return PJ_ORIGINAL;
+return PJ_MIXED;
+}
+
+//***********************************************************************
+//* Writing the ranges: the patched bytes, or the input bytes for revert
+//***********************************************************************
+int journal_apply(struct journal* j, int fd, int revert) {
+
+int i;
+
+for(i=0;i<j->n;i++) {
+  if (pwrite(fd,revert?j->e[i].orig:j->e[i].patched,j->e[i].len,j->e[i].off) != j->e[i].len) return 0;
+}
+return 1;
+}
@@ -0,0 +1,47 @@
+// Patch journal - the bytes changed by the patcher, to be replayed onto an
+// identical loader without a search, verified and reverted
+
+// Changed range of the file
+struct pjentry {
+  uint64_t off;
+  uint32_t len;
+  uint8_t* orig;     // bytes of the input
+  uint8_t* patched;  // bytes written by the patcher
+};
+
+struct journal {
+  uint64_t size;        // file size, the same before and after
+  uint8_t inhash[32];   // SHA-256 of the input
+  uint8_t outhash[32];  // SHA-256 of the patched file
+  char note[64];        // what was patched, for the reader
+  int n;
+  struct pjentry* e;
+};
+
+// state of a file against the journal
+#define PJ_ORIGINAL 0  // all ranges hold the input bytes
+#define PJ_PATCHED  1  // all ranges hold the patched bytes
+#define PJ_MIXED   -1  // anything else
+#define PJ_IOERR   -2
+
+//***********************************************************************
+//* Building the journal from the input and the patched buffer
+//***********************************************************************
+int journal_diff(struct journal* j, const uint8_t* orig, const uint8_t* patched, uint64_t size, const char* note);
+
+//***********************************************************************
+//* Journal file: saving, loading (0 - error described in err), releasing
+//***********************************************************************
+int journal_save(struct journal* j, const char* file);
+int journal_load(struct journal* j, const char* file, char* err, int errlen);
+void journal_free(struct journal* j);
+
+//***********************************************************************
+//* Operations on an open file, touching only the journal ranges
+//*
+//* journal_state() - PJ_ORIGINAL, PJ_PATCHED, PJ_MIXED or PJ_IOERR
+//* journal_apply() - writes the patched bytes, or the input bytes if
+//*                   revert=1; returns 0 on a write error
+//***********************************************************************
+int journal_state(struct journal* j, int fd);
+int journal_apply(struct journal* j, int fd, int revert);
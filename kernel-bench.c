@@ -0,0 +1,124 @@
+// Benchmark of locate_kernel() of bootimg.c against the byte-by-byte
+// strncmp scan it replaced: on the given loaders as they are and with a
+// boot image header planted at 0x1000, the offsets must agree whenever no
+// valid header exists, then the time of one call is measured.
+//
+// kernel-bench <usbloader> ...
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootimg.h"
+
+#define PLANT 0x1000   // offset of the planted header
+
+static double now() {
+
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC,&ts);
+return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+//***********************************************************************
+//* The scan before bootimg.c
+//***********************************************************************
+static int old_locate(char* pbuf, uint32_t size) {
+
+int off;
+
+for(off=(size-8);off>0;off--) {
+  if (strncmp(pbuf+off,"ANDROID!",8) == 0) return off;
+}
+return 0;
+}
+
+//***********************************************************************
+//* Milliseconds per call, the old scan or locate_kernel()
+//***********************************************************************
+static int sink;
+
+static double mscall(int new, char* buf, uint32_t size) {
+
+struct bootinfo bi;
+double t0,t;
+int n=0;
+
+t0=now();
+do {
+  sink^=new?locate_kernel(buf,size,&bi):old_locate(buf,size);
+  n++;
+  t=now()-t0;
+} while (t<0.3);
+return t*1000/n;
+}
+
+//***********************************************************************
+//* One buffer: both offsets, then the times
+//***********************************************************************
+static int bench(const char* title, char* buf, uint32_t size) {
+
+struct bootinfo bi;
+int oldoff,newoff,bad;
+
+oldoff=old_locate(buf,size);
+newoff=locate_kernel(buf,size,&bi);
+// a valid header may be found before the last bare magic
+bad=!bi.valid && (oldoff != newoff);
+printf(" %-32s %8x %8x %5s %9.2f %9.3f%s\n",title,oldoff,newoff,bi.valid?"yes":"no",
+       mscall(0,buf,size),mscall(1,buf,size),bad?"  MISMATCH":"");
+return bad;
+}
+
+//#######################################################################################################
+int main(int argc, char* argv[]) {
+
+char* buf;
+char title[40];
+const char* name;
+uint32_t size,h[8];
+FILE* f;
+int i,total=0;
+
+if (argc<2) {
+  printf("\n %s <usbloader> ...\n\n",argv[0]);
+  return 1;
+}
+printf("\n %-32s %8s %8s %5s %9s %9s\n","","old","new","valid","old ms","new ms");
+for(i=1;i<argc;i++) {
+  f=fopen(argv[i],"rb");
+  if (f == NULL) {
+    printf("\n Error opening %s\n",argv[i]);
+    return 1;
+  }
+  fseek(f,0,SEEK_END);
+  size=ftell(f);
+  rewind(f);
+  buf=malloc(size+1);
+  if ((fread(buf,1,size,f) != size) || (size<PLANT+64)) {
+    printf("\n Error reading %s\n",argv[i]);
+    return 1;
+  }
+  fclose(f);
+  name=strrchr(argv[i],'/');
+  name=name?name+1:argv[i];
+  total+=bench(name,buf,size);
+
+  // kernel 4 MB, ramdisk 1 MB, 2K pages
+  memset(h,0,sizeof(h));
+  h[0]=0x400000;
+  h[2]=0x100000;
+  h[7]=2048;
+  memcpy(buf+PLANT,"ANDROID!",8);
+  memcpy(buf+PLANT+8,h,sizeof(h));
+  snprintf(title,sizeof(title),"  header at %x",PLANT);
+  total+=bench(title,buf,size);
+  free(buf);
+}
+printf("\n");
+if (sink == 0x5a5a5a5a) printf(" ");  // keeps the calls
+return total != 0;
+}
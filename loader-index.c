@@ -0,0 +1,767 @@
+// Index of a usbloader library: the header, partition table and patch
+// family of every loader are kept in one compact file and queried without
+// reading the loaders again.
+//
+// loader-index -f index -u <dirs, files or globs>   - build or update
+// loader-index -f index [key=pattern ...]           - query
+//
+// Linux only.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <glob.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "parts.h"
+#include "patcher.h"
+#include "sha256.h"
+#include "wordscan.h"
+
+//***********************************************************************
+//* Index file, little-endian:
+//*   head (IDXHEAD bytes), entries (ENTRYSIZE bytes each), string table
+//*   with the file names
+//* The fields follow each other in the order of the structures below.
+//***********************************************************************
+static const char idxmagic[8]="BLINDEX";
+#define IDXVERSION 2
+#define IDXHEAD (8+4+4+8+4+4)
+#define ENTRYSIZE (4+4+8+16+32+2*16+4+4+3*16+4+4)
+
+struct idxhead {
+  char magic[8];
+  uint32_t version;
+  uint32_t n;            // entries
+  uint64_t sigdigest;    // signatures the families were found with
+  uint32_t strsize;      // string table
+  uint32_t reserved;
+};
+
+// entry flags
+#define E_LOADER 1       // usbloader signature and sane blocks
+#define E_PTABLE 2       // partition table found in usbldr
+#define E_ERASE  4       // eraseall signature found
+#define E_ISBAD  8       // isbad signature found
+
+struct entry {
+  uint32_t path;         // offset in the string table
+  uint32_t flags;
+  uint64_t size;
+  int64_t mtime[2];      // seconds, nanoseconds
+  uint8_t hash[32];      // SHA-256 of the file
+  struct {
+    uint32_t lmode,size,adr,offset;
+  } blk[2];              // raminit, usbldr
+  uint32_t ptoff;        // file offset of the partition table
+  uint32_t nparts;
+  char version[16];      // of the partition table
+  char product[16];
+  char family[16];       // eraseall rule
+  uint32_t eoff,boff;    // eraseall and isbad signatures
+};
+
+//***********************************************************************
+//* Files of the update
+//***********************************************************************
+struct item {
+  char* path;
+  struct stat st;
+  struct entry e;
+  int state;             // 0 - reused, 1 - hashed only, 2 - analysed, 3 - error
+};
+
+static struct item* items=NULL;
+static int nitems=0;
+static int nextitem=0;
+
+// the old index
+static struct entry* old=NULL;
+static char* oldstr=NULL;
+static int nold=0;
+static int oldfamilies=0;  // the families of the old index are still valid
+static int* bypath=NULL;   // old entries sorted by path
+static int* byhash=NULL;   // and by hash
+
+//***********************************************************************
+//* Little-endian fields
+//***********************************************************************
+static void put32(uint8_t* p, uint32_t v) {
+
+int i;
+
+for(i=0;i<4;i++) p[i]=v>>(8*i);
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+
+int i;
+
+for(i=0;i<8;i++) p[i]=v>>(8*i);
+}
+
+static uint32_t get32(const uint8_t* p) {
+
+return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static uint64_t get64(const uint8_t* p) {
+
+return get32(p)|((uint64_t)get32(p+4)<<32);
+}
+
+//***********************************************************************
+//* Entry to and from its ENTRYSIZE bytes in the file
+//***********************************************************************
+static void put_entry(uint8_t* p, const struct entry* e) {
+
+int bl;
+
+put32(p,e->path);
+put32(p+4,e->flags);
+put64(p+8,e->size);
+put64(p+16,e->mtime[0]);
+put64(p+24,e->mtime[1]);
+memcpy(p+32,e->hash,32);
+p+=64;
+for(bl=0;bl<2;bl++,p+=16) {
+  put32(p,e->blk[bl].lmode);
+  put32(p+4,e->blk[bl].size);
+  put32(p+8,e->blk[bl].adr);
+  put32(p+12,e->blk[bl].offset);
+}
+put32(p,e->ptoff);
+put32(p+4,e->nparts);
+memcpy(p+8,e->version,16);
+memcpy(p+24,e->product,16);
+memcpy(p+40,e->family,16);
+put32(p+56,e->eoff);
+put32(p+60,e->boff);
+}
+
+static void get_entry(struct entry* e, const uint8_t* p) {
+
+int bl;
+
+e->path=get32(p);
+e->flags=get32(p+4);
+e->size=get64(p+8);
+e->mtime[0]=get64(p+16);
+e->mtime[1]=get64(p+24);
+memcpy(e->hash,p+32,32);
+p+=64;
+for(bl=0;bl<2;bl++,p+=16) {
+  e->blk[bl].lmode=get32(p);
+  e->blk[bl].size=get32(p+4);
+  e->blk[bl].adr=get32(p+8);
+  e->blk[bl].offset=get32(p+12);
+}
+e->ptoff=get32(p);
+e->nparts=get32(p+4);
+memcpy(e->version,p+8,16);
+memcpy(e->product,p+24,16);
+memcpy(e->family,p+40,16);
+// the strings are shown with %s
+e->version[15]=e->product[15]=e->family[15]=0;
+e->eoff=get32(p+56);
+e->boff=get32(p+60);
+}
+
+//***********************************************************************
+//* Loading an index, 0 - no index or not valid
+//***********************************************************************
+static int load_index(const char* file, struct entry** e, char** str, struct idxhead* h) {
+
+FILE* f;
+uint8_t buf[ENTRYSIZE];
+int i;
+
+*e=NULL;
+*str=NULL;
+f=fopen(file,"rb");
+if (f == NULL) return 0;
+if ((fread(buf,1,IDXHEAD,f) != IDXHEAD) || (memcmp(buf,idxmagic,8) != 0) || (get32(buf+8) != IDXVERSION)) goto bad;
+memcpy(h->magic,buf,8);
+h->version=get32(buf+8);
+h->n=get32(buf+12);
+h->sigdigest=get64(buf+16);
+h->strsize=get32(buf+24);
+h->reserved=get32(buf+28);
+*e=malloc((size_t)h->n*sizeof(struct entry)+1);
+*str=malloc((size_t)h->strsize+1);
+if ((*e == NULL) || (*str == NULL)) goto bad;
+for(i=0;i<h->n;i++) {
+  if (fread(buf,1,ENTRYSIZE,f) != ENTRYSIZE) goto bad;
+  get_entry(&(*e)[i],buf);
+  if ((*e)[i].path >= h->strsize) goto bad;
+}
+if (fread(*str,1,h->strsize,f) != h->strsize) goto bad;
+(*str)[h->strsize]=0;
+fclose(f);
+return 1;
+
+bad:
+fclose(f);
+free(*e);
+free(*str);
+*e=NULL;
+*str=NULL;
+return 0;
+}
+
+//***********************************************************************
+//* Writing the index: temporary file renamed over the old one
+//***********************************************************************
+static int save_index(const char* file) {
+
+FILE* f;
+struct idxhead h;
+char tmp[4200];
+uint8_t buf[ENTRYSIZE];
+uint32_t off=0;
+int i,ok;
+
+memset(&h,0,sizeof(h));
+memcpy(h.magic,idxmagic,8);
+h.version=IDXVERSION;
+for(i=0;i<nitems;i++) {
+  if (items[i].state == 3) continue;
+  items[i].e.path=off;
+  off+=strlen(items[i].path)+1;
+  h.n++;
+}
+h.strsize=off;
+h.sigdigest=sig_digest();
+
+snprintf(tmp,sizeof(tmp),"%s.tmp%i",file,(int)getpid());
+f=fopen(tmp,"wb");
+if (f == NULL) return 0;
+memcpy(buf,h.magic,8);
+put32(buf+8,h.version);
+put32(buf+12,h.n);
+put64(buf+16,h.sigdigest);
+put32(buf+24,h.strsize);
+put32(buf+28,h.reserved);
+ok=(fwrite(buf,1,IDXHEAD,f) == IDXHEAD);
+for(i=0;ok && (i<nitems);i++) {
+  if (items[i].state == 3) continue;
+  put_entry(buf,&items[i].e);
+  ok=(fwrite(buf,1,ENTRYSIZE,f) == ENTRYSIZE);
+}
+for(i=0;ok && (i<nitems);i++) {
+  if (items[i].state != 3) ok=(fwrite(items[i].path,1,strlen(items[i].path)+1,f) == strlen(items[i].path)+1);
+}
+if ((fclose(f) != 0) || !ok || (rename(tmp,file) != 0)) {
+  unlink(tmp);
+  return 0;
+}
+return 1;
+}
+
+//***********************************************************************
+//* Lookup in the old index
+//***********************************************************************
+static int cmppath(const void* a, const void* b) {
+
+return strcmp(oldstr+old[*(int*)a].path,oldstr+old[*(int*)b].path);
+}
+
+static int cmphash(const void* a, const void* b) {
+
+return memcmp(old[*(int*)a].hash,old[*(int*)b].hash,32);
+}
+
+static struct entry* find_path(const char* path) {
+
+int lo=0,hi=nold-1,mid,c;
+
+while (lo <= hi) {
+  mid=(lo+hi)/2;
+  c=strcmp(path,oldstr+old[bypath[mid]].path);
+  if (c == 0) return &old[bypath[mid]];
+  if (c<0) hi=mid-1;
+  else lo=mid+1;
+}
+return NULL;
+}
+
+static struct entry* find_hash(const uint8_t* hash) {
+
+int lo=0,hi=nold-1,mid,c;
+
+while (lo <= hi) {
+  mid=(lo+hi)/2;
+  c=memcmp(hash,old[byhash[mid]].hash,32);
+  if (c == 0) return &old[byhash[mid]];
+  if (c<0) hi=mid-1;
+  else lo=mid+1;
+}
+return NULL;
+}
+
+//***********************************************************************
+//* Collecting the files: directories are walked recursively
+//***********************************************************************
+static void add_item(const char* path, struct stat* st) {
+
+struct item* it;
+char* full;
+
+if ((nitems & 255) == 0) {
+  it=realloc(items,(nitems+256)*sizeof(struct item));
+  if (it == NULL) return;
+  items=it;
+}
+it=&items[nitems++];
+memset(it,0,sizeof(*it));
+// absolute names: the index is updated from any directory
+full=realpath(path,NULL);
+it->path=(full != NULL)?full:strdup(path);
+it->st=*st;
+}
+
+static int cmpitem(const void* a, const void* b) {
+
+return strcmp(((struct item*)a)->path,((struct item*)b)->path);
+}
+
+// search in the first n items, sorted
+static struct item* find_item(const char* path, int n) {
+
+struct item key;
+
+key.path=(char*)path;
+return bsearch(&key,items,n,sizeof(struct item),cmpitem);
+}
+
+static void add_path(const char* path) {
+
+struct dirent** names;
+struct stat st;
+char sub[4096];
+glob_t g;
+size_t k;
+int i,n;
+
+if ((strpbrk(path,"*?[") != NULL) && (glob(path,0,NULL,&g) == 0)) {
+  for(k=0;k<g.gl_pathc;k++) add_path(g.gl_pathv[k]);
+  globfree(&g);
+  return;
+}
+if (stat(path,&st) != 0) {
+  printf("\n ! %s: not found",path);
+  return;
+}
+if (S_ISREG(st.st_mode)) {
+  add_item(path,&st);
+  return;
+}
+if (!S_ISDIR(st.st_mode)) return;
+n=scandir(path,&names,NULL,alphasort);
+if (n<0) return;
+for(i=0;i<n;i++) {
+  if (names[i]->d_name[0] != '.') {
+    snprintf(sub,sizeof(sub),"%s/%s",path,names[i]->d_name);
+    add_path(sub);
+  }
+  free(names[i]);
+}
+free(names);
+}
+
+//***********************************************************************
+//* Analysis of one loader
+//***********************************************************************
+static void copy_field(char* dst, const char* src, int len) {
+
+size_t n;
+
+// up to 15 bytes, the table fields need no terminator
+n=strnlen(src,(len<15)?len:15);
+memset(dst,0,16);
+memcpy(dst,src,n);
+}
+
+static void analyse(struct entry* e, uint8_t* buf, uint64_t size) {
+
+uint32_t hits[MAXSIG];
+uint32_t ptoff;
+struct ptable_t* pt;
+int family,bl;
+
+memset(e->blk,0,sizeof(e->blk));
+e->flags=e->ptoff=e->nparts=e->eoff=e->boff=0;
+memset(e->version,0,16);
+memset(e->product,0,16);
+memset(e->family,0,16);
+if ((size<84) || (size>0xffffffffLL)) return;
+
+// header: signature, then the raminit and usbldr descriptors at 36
+if (*(uint32_t*)buf == 0x20000) {
+  memcpy(e->blk,buf+36,sizeof(e->blk));
+  e->flags=E_LOADER;
+  for(bl=0;bl<2;bl++) {
+    if ((uint64_t)e->blk[bl].offset+e->blk[bl].size > size) e->flags=0;
+  }
+}
+if (e->flags & E_LOADER) {
+  ptoff=find_ptable_ram((char*)buf+e->blk[1].offset,e->blk[1].size);
+  if ((ptoff != 0) && ((uint64_t)e->blk[1].offset+ptoff+sizeof(struct ptable_t) <= size)) {
+    e->flags|=E_PTABLE;
+    e->ptoff=e->blk[1].offset+ptoff;
+    pt=(struct ptable_t*)(buf+e->ptoff);
+    copy_field(e->version,(char*)pt->version,16);
+    copy_field(e->product,(char*)pt->product,16);
+    while ((e->nparts<41) && (pt->part[e->nparts].name[0] != 0) && (strncmp(pt->part[e->nparts].name,"T",16) != 0)) e->nparts++;
+  }
+}
+// the patch signatures are searched like loader-patch does, in the whole file
+scan_signatures(buf,size,hits);
+e->eoff=peraseall(buf,size,hits,&family);
+if (e->eoff != 0) {
+  e->flags|=E_ERASE;
+  copy_field(e->family,signame(family),strlen(signame(family)));
+}
+e->boff=pisbad(buf,size,hits);
+if (e->boff != 0) e->flags|=E_ISBAD;
+}
+
+//***********************************************************************
+//* Indexing one file
+//*
+//* A file with the size and modification time of the old index is not
+//* read. A changed file is hashed; if the contents are known the old
+//* analysis is taken, otherwise the file is analysed.
+//***********************************************************************
+static void index_item(struct item* it) {
+
+struct entry* o;
+uint8_t* buf;
+int fd;
+
+it->e.size=it->st.st_size;
+it->e.mtime[0]=it->st.st_mtim.tv_sec;
+it->e.mtime[1]=it->st.st_mtim.tv_nsec;
+o=find_path(it->path);
+if ((o != NULL) && oldfamilies && (o->size == it->e.size) && (o->mtime[0] == it->e.mtime[0]) && (o->mtime[1] == it->e.mtime[1])) {
+  it->e=*o;
+  return;
+}
+
+it->state=3;
+fd=open(it->path,O_RDONLY);
+if (fd<0) return;
+if (it->e.size == 0) buf=NULL;
+else {
+  // private mapping: the patcher writes into it
+  buf=mmap(NULL,it->e.size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+  if (buf == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+}
+close(fd);
+sha256(buf,it->e.size,it->e.hash);
+o=find_hash(it->e.hash);
+if ((o != NULL) && oldfamilies) {
+  // the same contents under another name or time
+  it->e=*o;
+  it->e.mtime[0]=it->st.st_mtim.tv_sec;
+  it->e.mtime[1]=it->st.st_mtim.tv_nsec;
+  it->state=1;
+}
+else {
+  analyse(&it->e,buf,it->e.size);
+  it->state=2;
+}
+if (buf != NULL) munmap(buf,it->e.size);
+}
+
+static void* worker(void* arg) {
+
+int i;
+
+while ((i=__sync_fetch_and_add(&nextitem,1)) < nitems) index_item(&items[i]);
+return NULL;
+}
+
+//***********************************************************************
+//* Building or updating the index
+//***********************************************************************
+static int update(const char* file, char** paths, int npaths, int nthreads) {
+
+pthread_t th[256];
+struct idxhead h;
+struct timespec t0,t1;
+struct stat st;
+int i,k,removed=0,n[4]={0,0,0,0};
+
+clock_gettime(CLOCK_MONOTONIC,&t0);
+if (load_index(file,&old,&oldstr,&h)) {
+  nold=h.n;
+  oldfamilies=(h.sigdigest == sig_digest());
+  bypath=malloc(nold*sizeof(int)+1);
+  byhash=malloc(nold*sizeof(int)+1);
+  for(i=0;i<nold;i++) bypath[i]=byhash[i]=i;
+  qsort(bypath,nold,sizeof(int),cmppath);
+  qsort(byhash,nold,sizeof(int),cmphash);
+}
+for(i=0;i<npaths;i++) add_path(paths[i]);
+qsort(items,nitems,sizeof(struct item),cmpitem);
+// a file given twice is indexed once
+for(i=k=0;i<nitems;i++) {
+  if ((k>0) && (strcmp(items[i].path,items[k-1].path) == 0)) free(items[i].path);
+  else items[k++]=items[i];
+}
+nitems=k;
+// the files of the old index outside the given paths stay while they exist
+k=nitems;
+for(i=0;i<nold;i++) {
+  if (find_item(oldstr+old[i].path,k) != NULL) continue;
+  if ((stat(oldstr+old[i].path,&st) == 0) && S_ISREG(st.st_mode)) add_item(oldstr+old[i].path,&st);
+  else removed++;
+}
+if (nitems>k) qsort(items,nitems,sizeof(struct item),cmpitem);
+
+// the matcher is compiled and the scan code chosen before the threads share them
+sig_count();
+wordscan_impl();
+if (nthreads<1) nthreads=sysconf(_SC_NPROCESSORS_ONLN);
+if (nthreads<1) nthreads=1;
+if (nthreads>256) nthreads=256;
+if (nthreads>nitems) nthreads=nitems;
+for(i=0;i<nthreads;i++) {
+  if (pthread_create(&th[i],NULL,worker,NULL) != 0) break;
+}
+nthreads=i;
+if (nthreads == 0) worker(NULL);
+for(i=0;i<nthreads;i++) pthread_join(th[i],NULL);
+
+for(i=0;i<nitems;i++) {
+  n[items[i].state]++;
+  if (items[i].state == 3) printf("\n ! %s: cannot read",items[i].path);
+}
+if (!save_index(file)) {
+  printf("\n Error writing the index %s\n",file);
+  return 0;
+}
+clock_gettime(CLOCK_MONOTONIC,&t1);
+printf("\n Index %s: %i files, %i unchanged, %i known contents, %i analysed, %i removed, %i errors, %.2f s",
+  file,nitems-n[3],n[0],n[1],n[2],removed,n[3],(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9);
+if ((nold != 0) && !oldfamilies) printf("\n The signatures have changed, all files were analysed again");
+printf("\n");
+return 1;
+}
+
+//***********************************************************************
+//* Query
+//*
+//* Every term is key=pattern; the string keys take shell patterns, the
+//* numbers are decimal or 0x hex. All terms must match.
+//***********************************************************************
+static const char* keys[]={"file","product","version","family","raminit","usbldr","size","parts","sha256","ptable","safe",NULL};
+
+static int match_num(uint64_t v, const char* pat) {
+
+return v == strtoull(pat,NULL,0);
+}
+
+static int match_str(const char* v, const char* pat) {
+
+return fnmatch(pat,v,0) == 0;
+}
+
+static int match(struct entry* e, const char* path, char* term) {
+
+char* eq;
+char hex[65];
+int k,res;
+
+eq=strchr(term,'=');
+*eq=0;
+for(k=0;(keys[k] != NULL) && (strcmp(keys[k],term) != 0);k++);
+eq++;
+switch (k) {
+  case 0:  res=match_str(path,eq); break;
+  case 1:  res=match_str(e->product,eq); break;
+  case 2:  res=match_str(e->version,eq); break;
+  case 3:  res=match_str(e->family,eq); break;
+  case 4:  res=(e->flags & E_LOADER) && match_num(e->blk[0].size,eq); break;
+  case 5:  res=(e->flags & E_LOADER) && match_num(e->blk[1].size,eq); break;
+  case 6:  res=match_num(e->size,eq); break;
+  case 7:  res=(e->flags & E_PTABLE) && match_num(e->nparts,eq); break;
+  case 8:
+    sha256_hex(e->hash,hex);
+    res=strncmp(hex,eq,strlen(eq)) == 0;
+    break;
+  // yes/no
+  case 9:  res=((e->flags & E_PTABLE) != 0) == (eq[0] == 'y'); break;
+  case 10: res=((e->flags & E_ERASE) == 0) == (eq[0] == 'y'); break;
+  default: res=0;
+}
+eq[-1]='=';
+return res;
+}
+
+static void json_str(const char* str) {
+
+putchar('"');
+for(;*str != 0;str++) {
+  if ((*str == '"') || (*str == '\\')) printf("\\%c",*str);
+  else if ((uint8_t)*str<0x20) printf("\\u%04x",*str);
+  else putchar(*str);
+}
+putchar('"');
+}
+
+static void show_entry(struct entry* e, const char* path, int json) {
+
+char hex[65];
+
+if (json) {
+  sha256_hex(e->hash,hex);
+  printf("{\"file\": ");
+  json_str(path);
+  printf(", \"size\": %llu, \"sha256\": \"%s\", \"loader\": %s",(unsigned long long)e->size,hex,(e->flags & E_LOADER)?"true":"false");
+  if (e->flags & E_LOADER) printf(", \"raminit\": {\"size\": %u, \"address\": %u}, \"usbldr\": {\"size\": %u, \"address\": %u}",
+                                  e->blk[0].size,e->blk[0].adr,e->blk[1].size,e->blk[1].adr);
+  if (e->flags & E_PTABLE) {
+    printf(", \"ptable\": {\"offset\": %u, \"version\": ",e->ptoff);
+    json_str(e->version);
+    printf(", \"product\": ");
+    json_str(e->product);
+    printf(", \"partitions\": %u}",e->nparts);
+  }
+  else printf(", \"ptable\": null");
+  if (e->flags & E_ERASE) {
+    printf(", \"family\": ");
+    json_str(e->family);
+    printf(", \"eraseall\": %u",e->eoff);
+  }
+  else printf(", \"family\": null, \"eraseall\": null");
+  if (e->flags & E_ISBAD) printf(", \"isbad\": %u}\n",e->boff);
+  else printf(", \"isbad\": null}\n");
+  return;
+}
+if (e->flags & E_LOADER) printf("\n %-16s %-16s %-8s %6u %8u  %s",e->product,e->version,(e->flags & E_ERASE)?e->family:"-",e->blk[0].size,e->blk[1].size,path);
+else printf("\n %-16s %-16s %-8s %6s %8s  %s","(not a loader)","",(e->flags & E_ERASE)?e->family:"-","","",path);
+}
+
+static void query(const char* file, char** terms, int nterms, int json, int count) {
+
+struct entry* e;
+char* str;
+struct idxhead h;
+int i,t,n=0;
+
+for(t=0;t<nterms;t++) {
+  for(i=0;keys[i] != NULL;i++) {
+    if ((strncmp(terms[t],keys[i],strlen(keys[i])) == 0) && (terms[t][strlen(keys[i])] == '=')) break;
+  }
+  if (keys[i] == NULL) {
+    printf("\n The query term %s is not key=pattern with a known key\n",terms[t]);
+    return;
+  }
+}
+if (!load_index(file,&e,&str,&h)) {
+  printf("\n %s is not a loader index, build it with -u\n",file);
+  return;
+}
+if (!json && !count) printf("\n %-16s %-16s %-8s %6s %8s  %s\n---------------------------------------------------------------------------","product","version","family","raminit","usbldr","file");
+for(i=0;i<h.n;i++) {
+  for(t=0;(t<nterms) && match(&e[i],str+e[i].path,terms[t]);t++);
+  if (t<nterms) continue;
+  n++;
+  if (!count) show_entry(&e[i],str+e[i].path,json);
+}
+if (count) printf("%i\n",n);
+else if (!json) printf("\n\n %i of %i files\n",n,h.n);
+free(e);
+free(str);
+}
+
+//#######################################################################################################
+void main(int argc, char* argv[]) {
+
+int opt,uflag=0,json=0,count=0,nthreads=0;
+char* file=NULL;
+char* sigfile=NULL;
+char sigerr[300];
+
+while ((opt = getopt(argc, argv, "hf:uj:d:Jc")) != -1) {
+  switch (opt) {
+   case 'h':
+
+printf("\n Index of a usbloader library\n\n\
+%s -f index -u <directories, files or globs> - build or update the index\n\
+%s -f index [key=pattern ...]                - query the index\n\n\
+ The following keys are valid:\n\n\
+-f file  - index file\n\
+-u       - add the files to the index; unchanged files (size, mtime) are not read,\n\
+           changed ones are hashed and analysed only if the contents are new\n\
+-j n     - number of threads (default - number of CPUs)\n\
+-d file  - take the patch signatures from the specified file instead of the built-in ones\n\
+-J       - query output as JSON lines\n\
+-c       - only count the matching files\n\n\
+ Query keys: file, product, version, family (shell patterns), raminit, usbldr (component\n\
+ sizes), size, parts (numbers), sha256 (prefix), ptable, safe (yes/no)\n\n\
+ %s -f lib.idx product='E3372*' family=V7R22 usbldr=0x1b7000\n\n",argv[0],argv[0],argv[0]);
+    return;
+
+   case 'f':
+     file=optarg;
+     break;
+
+   case 'u':
+     uflag=1;
+     break;
+
+   case 'j':
+     nthreads=atoi(optarg);
+     break;
+
+   case 'd':
+     sigfile=optarg;
+     break;
+
+   case 'J':
+     json=1;
+     break;
+
+   case 'c':
+     count=1;
+     break;
+
+   case '?':
+   case ':':
+     return;
+  }
+}
+
+if (file == NULL) {
+  printf("\n No index file specified (-f), for a hint use -h\n");
+  return;
+}
+if ((sigfile != NULL) && !load_signatures(sigfile,sigerr,sizeof(sigerr))) {
+  printf("\n %s\n",sigerr);
+  return;
+}
+if (uflag) {
+  if (optind>=argc) {
+    printf("\n No loader directories or files specified\n");
+    return;
+  }
+  update(file,argv+optind,argc-optind,nthreads);
+  return;
+}
+query(file,argv+optind,argc-optind,json,count);
+}
@@ -6,6 +6,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <glob.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #else
 //%%%%
 #include <windows.h>
@@ -14,7 +21,654 @@
 #endif
 
 #include "patcher.h"
+#ifndef WIN32
+#include "journal.h"
+#include "sha256.h"
+#include "wordscan.h"
+#endif
+
+#ifndef WIN32
+//***********************************************************************
+//* Batch mode: many loaders on a thread pool
+//***********************************************************************
+
+// One loader of the batch
+struct item {
+  char* path;          // input file
+  char* out;           // output file, NULL - check only
+  int status;          // 0 - patched, 1 - no eraseall signature, 2 - error, 3 - ambiguous (-a)
+  const char* err;
+  int family;          // erase rule found, -1 - none
+  uint32_t eoff;       // signature offsets, 0 - not found
+  uint32_t boff;
+  uint32_t size;
+  double ms;           // processing time
+  struct sighit* hits; // -a: all hits of the rules
+  int nhits;           // may be larger than MAXHITS
+  int esites,bsites;   // -a: distinct patch points of the classes
+};
+
+#define MAXHITS 256     // hits kept for one loader in the analysis
+
+static struct item* items=NULL;
+static int nitems=0;
+static int nextitem=0;  // next item for a worker
+static int batchbad=0;  // -b for the batch
+static int analyze=0;   // -a: report all hits, nothing is patched
+
+//***********************************************************************
+//* Adding a loader to the batch
+//***********************************************************************
+static void add_item(const char* path, const char* outdir, const char* rel) {
+
+struct item* it;
+
+if ((nitems & 255) == 0) {
+  it=realloc(items,(nitems+256)*sizeof(struct item));
+  if (it == NULL) return;
+  items=it;
+}
+it=&items[nitems++];
+memset(it,0,sizeof(*it));
+it->path=strdup(path);
+it->family=-1;
+if (outdir != NULL) {
+  it->out=malloc(strlen(outdir)+strlen(rel)+2);
+  sprintf(it->out,"%s/%s",outdir,rel);
+}
+}
+
+//***********************************************************************
+//* All files of a directory tree; the relative paths are kept in the
+//* output directory
+//***********************************************************************
+static void add_dir(const char* dir, const char* outdir, const char* rel) {
+
+struct dirent** names;
+struct stat st;
+char path[4096],sub[4096];
+int i,n;
+
+n=scandir(dir,&names,NULL,alphasort);
+if (n<0) return;
+for(i=0;i<n;i++) {
+  if (names[i]->d_name[0] != '.') {
+    snprintf(path,sizeof(path),"%s/%s",dir,names[i]->d_name);
+    snprintf(sub,sizeof(sub),"%s%s%s",rel,rel[0]?"/":"",names[i]->d_name);
+    if (stat(path,&st) == 0) {
+      if (S_ISDIR(st.st_mode)) add_dir(path,outdir,sub);
+      else if (S_ISREG(st.st_mode)) add_item(path,outdir,sub);
+    }
+  }
+  free(names[i]);
+}
+free(names);
+}
+
+//***********************************************************************
+//* Command line argument: file, directory or glob
+//***********************************************************************
+static void add_arg(const char* arg, const char* outdir) {
+
+struct stat st;
+glob_t g;
+size_t i;
+const char* base;
+
+if ((strpbrk(arg,"*?[") != NULL) && (glob(arg,0,NULL,&g) == 0)) {
+  for(i=0;i<g.gl_pathc;i++) add_arg(g.gl_pathv[i],outdir);
+  globfree(&g);
+  return;
+}
+if ((stat(arg,&st) == 0) && S_ISDIR(st.st_mode)) {
+  add_dir(arg,outdir,"");
+  return;
+}
+base=strrchr(arg,'/');
+add_item(arg,outdir,base?base+1:arg);
+}
+
+//***********************************************************************
+//* Inputs going to the same output file (same name in different
+//* directories given on the command line), 0 - none
+//***********************************************************************
+static int outcmp(const void* a, const void* b) {
+
+return strcmp((*(struct item**)a)->out,(*(struct item**)b)->out);
+}
+
+static int out_collisions() {
+
+struct item** sorted;
+int i,n=0;
+
+if ((nitems<2) || (items[0].out == NULL)) return 0;
+sorted=malloc(nitems*sizeof(struct item*));
+if (sorted == NULL) return 0;
+for(i=0;i<nitems;i++) sorted[i]=&items[i];
+qsort(sorted,nitems,sizeof(struct item*),outcmp);
+for(i=1;i<nitems;i++) {
+  if (strcmp(sorted[i-1]->out,sorted[i]->out) != 0) continue;
+  printf("\n %s and %s both go to %s",sorted[i-1]->path,sorted[i]->path,sorted[i]->out);
+  n++;
+}
+free(sorted);
+return n;
+}
+
+//***********************************************************************
+//* Creating the directories of a path
+//***********************************************************************
+static void make_dirs(const char* path) {
+
+char dir[4096];
+char* p;
+
+strncpy(dir,path,sizeof(dir)-1);
+dir[sizeof(dir)-1]=0;
+for(p=strchr(dir+1,'/');p != NULL;p=strchr(p+1,'/')) {
+  *p=0;
+  mkdir(dir,0755);
+  *p='/';
+}
+}
+
+//***********************************************************************
+//* Writing the patched loader: to a temporary file renamed over the output,
+//* so the output is either the old file or the whole new one
+//***********************************************************************
+static int write_atomic(const char* path, const uint8_t* buf, uint32_t size) {
+
+char tmp[4200];
+int fd,ok=1;
+ssize_t res;
+uint32_t done=0;
+
+make_dirs(path);
+snprintf(tmp,sizeof(tmp),"%s.tmp%i",path,(int)getpid());
+fd=open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0644);
+if (fd<0) return 0;
+while (ok && (done<size)) {
+  res=write(fd,buf+done,size-done);
+  if (res <= 0) ok=0;
+  else done+=res;
+}
+// the data must be on the disk before the name points to it
+if (ok && (fsync(fd) != 0)) ok=0;
+if ((close(fd) != 0) || !ok || (rename(tmp,path) != 0)) {
+  unlink(tmp);
+  return 0;
+}
+return 1;
+}
+
+//***********************************************************************
+//* Analysis of a loader: all hits of all rules. The loader is ambiguous if
+//* a class has more than one patch point - the patcher would take the first
+//* one, and the others stay as they are.
+//***********************************************************************
+static int count_sites(struct item* it, int cls) {
+
+int i,k,n=0;
+uint32_t pp;
+
+for(i=0;(i<it->nhits) && (i<MAXHITS);i++) {
+  if (sig_class(it->hits[i].sig) != cls) continue;
+  pp=sig_patchpoint(it->hits[i].sig,it->hits[i].off);
+  // several rules on the same patch point are one site
+  for(k=0;k<i;k++) {
+    if ((sig_class(it->hits[k].sig) == cls) && (sig_patchpoint(it->hits[k].sig,it->hits[k].off) == pp)) break;
+  }
+  if (k == i) n++;
+}
+return n;
+}
+
+static void analyze_item(struct item* it, uint8_t* buf) {
+
+it->hits=malloc(MAXHITS*sizeof(struct sighit));
+if (it->hits == NULL) {
+  it->err="out of memory";
+  return;
+}
+it->nhits=scan_all(buf,it->size,it->hits,MAXHITS);
+it->esites=count_sites(it,SIGC_ERASE);
+it->bsites=count_sites(it,SIGC_ISBAD);
+if ((it->esites>1) || (it->bsites>1) || (it->nhits>MAXHITS)) it->status=3;
+else if (it->esites == 0) it->status=1;
+else it->status=0;
+}
+
+//***********************************************************************
+//* Processing one loader
+//***********************************************************************
+static void patch_item(struct item* it) {
+
+struct stat st;
+struct timespec t0,t1;
+uint8_t* buf;
+uint32_t hits[MAXSIG];
+int fd;
+
+clock_gettime(CLOCK_MONOTONIC,&t0);
+it->status=2;
+fd=open(it->path,O_RDONLY);
+if (fd<0) {
+  it->err="cannot open";
+  return;
+}
+if ((fstat(fd,&st) != 0) || (st.st_size == 0) || (st.st_size>0xffffffffLL)) {
+  close(fd);
+  it->err="bad size";
+  return;
+}
+it->size=st.st_size;
+// private mapping: the patched pages are copied, the input stays intact
+buf=mmap(NULL,st.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+close(fd);
+if (buf == MAP_FAILED) {
+  it->err="cannot map";
+  return;
+}
+
+if (analyze) {
+  analyze_item(it,buf);
+  munmap(buf,st.st_size);
+  goto done;
+}
+scan_signatures(buf, it->size, hits);
+it->eoff=peraseall(buf, it->size, hits, &it->family);
+if (batchbad) it->boff=pisbad(buf, it->size, hits);
+if (it->eoff == 0) {
+  it->family=-1;
+  it->status=1;
+}
+else if ((it->out != NULL) && !write_atomic(it->out,buf,it->size)) it->err="cannot write the output";
+else it->status=0;
+munmap(buf,st.st_size);
+
+done:
+clock_gettime(CLOCK_MONOTONIC,&t1);
+it->ms=(t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6;
+}
+
+static void* batch_worker(void* arg) {
+
+int i;
+
+while ((i=__sync_fetch_and_add(&nextitem,1)) < nitems) patch_item(&items[i]);
+return NULL;
+}
+
+//***********************************************************************
+//* Report of the batch: CSV, or JSON for a .json file name
+//***********************************************************************
+static const char* statname[]={"patched","not-found","error","ambiguous"};
+static const char* anstatname[]={"unique","not-found","error","ambiguous"};
+static const char* classname[]={"erase","isbad"};
+
+static void json_str(FILE* f, const char* str) {
+
+fputc('"',f);
+for(;*str != 0;str++) {
+  if ((*str == '"') || (*str == '\\')) fprintf(f,"\\%c",*str);
+  else if ((uint8_t)*str<0x20) fprintf(f,"\\u%04x",*str);
+  else fputc(*str,f);
+}
+fputc('"',f);
+}
+
+static void csv_str(FILE* f, const char* str) {
+
+if (strpbrk(str,",\"\n") == NULL) {
+  fputs(str,f);
+  return;
+}
+fputc('"',f);
+for(;*str != 0;str++) {
+  if (*str == '"') fputc('"',f);
+  fputc(*str,f);
+}
+fputc('"',f);
+}
+
+//***********************************************************************
+//* Report of the analysis: JSON with the hits of every file, or CSV with
+//* a line for every hit (a line without a rule for a file without hits)
+//***********************************************************************
+static int write_analysis(FILE* f, int json) {
+
+struct item* it;
+struct sighit* h;
+int i,k,nh;
+
+if (json) fprintf(f,"[\n");
+else fprintf(f,"file,status,erase_sites,isbad_sites,hits,rule,class,offset,patch_point\n");
+for(i=0;i<nitems;i++) {
+  it=&items[i];
+  nh=(it->nhits<MAXHITS)?it->nhits:MAXHITS;
+  if (it->status == 2) nh=0;
+  if (json) {
+    fprintf(f,"  {\"file\": ");
+    json_str(f,it->path);
+    fprintf(f,", \"status\": \"%s\", \"erase_sites\": %i, \"isbad_sites\": %i, \"hits\": %i, \"size\": %u, \"ms\": %.3f",
+      anstatname[it->status],it->esites,it->bsites,it->nhits,it->size,it->ms);
+    if (it->err != NULL) {
+      fprintf(f,", \"error\": ");
+      json_str(f,it->err);
+    }
+    fprintf(f,", \"matches\": [");
+    for(k=0;k<nh;k++) {
+      h=&it->hits[k];
+      fprintf(f,"%s\n    {\"rule\": ",k?",":"");
+      json_str(f,signame(h->sig));
+      fprintf(f,", \"class\": \"%s\", \"offset\": %u, \"patch_point\": %u}",classname[sig_class(h->sig)],h->off,sig_patchpoint(h->sig,h->off));
+    }
+    fprintf(f,"%s]}%s\n",nh?"\n  ":"",(i+1<nitems)?",":"");
+  }
+  else {
+    for(k=0;(k<nh) || ((k == 0) && (nh == 0));k++) {
+      csv_str(f,it->path);
+      fprintf(f,",%s,%i,%i,%i,",(it->status == 2)?it->err:anstatname[it->status],it->esites,it->bsites,it->nhits);
+      if (nh != 0) {
+        h=&it->hits[k];
+        csv_str(f,signame(h->sig));
+        fprintf(f,",%s,0x%08x,0x%08x",classname[sig_class(h->sig)],h->off,sig_patchpoint(h->sig,h->off));
+      }
+      else fprintf(f,",,,");
+      fputc('\n',f);
+    }
+  }
+}
+if (json) fprintf(f,"]\n");
+return fclose(f) == 0;
+}
+
+static int write_report(const char* file) {
+
+FILE* f;
+struct item* it;
+int i,json;
+
+f=fopen(file,"w");
+if (f == NULL) return 0;
+json=(strlen(file)>5) && (strcmp(file+strlen(file)-5,".json") == 0);
+if (analyze) return write_analysis(f,json);
+if (json) fprintf(f,"[\n");
+else fprintf(f,"file,status,family,eraseall,isbad,size,ms,output\n");
+for(i=0;i<nitems;i++) {
+  it=&items[i];
+  if (json) {
+    fprintf(f,"  {\"file\": ");
+    json_str(f,it->path);
+    fprintf(f,", \"status\": \"%s\", \"family\": ",statname[it->status]);
+    if (it->family >= 0) json_str(f,signame(it->family));
+    else fprintf(f,"null");
+    if (it->eoff != 0) fprintf(f,", \"eraseall\": %u",it->eoff);
+    else fprintf(f,", \"eraseall\": null");
+    if (it->boff != 0) fprintf(f,", \"isbad\": %u",it->boff);
+    else fprintf(f,", \"isbad\": null");
+    fprintf(f,", \"size\": %u, \"ms\": %.3f, \"output\": ",it->size,it->ms);
+    if ((it->status == 0) && (it->out != NULL)) json_str(f,it->out);
+    else fprintf(f,"null");
+    if (it->err != NULL) {
+      fprintf(f,", \"error\": ");
+      json_str(f,it->err);
+    }
+    fprintf(f,"}%s\n",(i+1<nitems)?",":"");
+  }
+  else {
+    csv_str(f,it->path);
+    fprintf(f,",%s,%s,",(it->status == 2)?it->err:statname[it->status],(it->family >= 0)?signame(it->family):"");
+    if (it->eoff != 0) fprintf(f,"0x%08x",it->eoff);
+    fputc(',',f);
+    if (it->boff != 0) fprintf(f,"0x%08x",it->boff);
+    fprintf(f,",%u,%.3f,",it->size,it->ms);
+    if ((it->status == 0) && (it->out != NULL)) csv_str(f,it->out);
+    fputc('\n',f);
+  }
+}
+if (json) fprintf(f,"]\n");
+return fclose(f) == 0;
+}
+
+//***********************************************************************
+//* Running the batch
+//***********************************************************************
+static void batch(int nthreads, const char* report) {
+
+pthread_t th[256];
+struct timespec t0,t1;
+struct item* it;
+struct sighit* h;
+int i,k,n[4]={0,0,0,0};
+double sec;
+
+if (nitems == 0) {
+  printf("\n No files to process\n");
+  return;
+}
+// the matcher is compiled and the scan code chosen before the threads share them
+sig_count();
+wordscan_impl();
+if (nthreads<1) nthreads=sysconf(_SC_NPROCESSORS_ONLN);
+if (nthreads<1) nthreads=1;
+if (nthreads>256) nthreads=256;
+if (nthreads>nitems) nthreads=nitems;
+
+clock_gettime(CLOCK_MONOTONIC,&t0);
+for(i=0;i<nthreads;i++) {
+  if (pthread_create(&th[i],NULL,batch_worker,NULL) != 0) break;
+}
+nthreads=i;
+// without any thread the work is done here
+if (nthreads == 0) batch_worker(NULL);
+for(i=0;i<nthreads;i++) pthread_join(th[i],NULL);
+clock_gettime(CLOCK_MONOTONIC,&t1);
+sec=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9;
+
+for(i=0;i<nitems;i++) {
+  it=&items[i];
+  n[it->status]++;
+  if (analyze) {
+    if (it->status == 2) printf("\n! %-9s %-16s",it->err,"");
+    else printf("\n%c %-9s erase %-3i isbad %-3i",(it->status == 0)?'*':'!',anstatname[it->status],it->esites,it->bsites);
+    printf("  %s",it->path);
+    // the hits of the ambiguous loaders, or of the only one
+    if ((it->status == 3) || ((nitems == 1) && (it->status != 2))) {
+      for(k=0;(k<it->nhits) && (k<MAXHITS);k++) {
+        h=&it->hits[k];
+        printf("\n     %-5s %-10s %08x  patch point %08x",classname[sig_class(h->sig)],signame(h->sig),h->off,sig_patchpoint(h->sig,h->off));
+      }
+      if (it->nhits>MAXHITS) printf("\n     ... %i hits in total",it->nhits);
+    }
+    continue;
+  }
+  if (it->status == 0) printf("\n* %-8s %08x",signame(it->family),it->eoff);
+  else if (it->status == 1) printf("\n! %-17s","not found");
+  else printf("\n! %-17s",it->err);
+  if (batchbad) {
+    if (it->boff != 0) printf("  isbad %08x",it->boff);
+    else printf("  isbad %-8s","none");
+  }
+  printf("  %s",it->path);
+}
+if (analyze) printf("\n\n Files: %i, unique: %i, ambiguous: %i, no signature: %i, errors: %i, %.2f s, %i threads",nitems,n[0],n[3],n[1],n[2],sec,nthreads?nthreads:1);
+else printf("\n\n Files: %i, patched: %i, no signature: %i, errors: %i, %.2f s, %i threads",nitems,n[0],n[1],n[2],sec,nthreads?nthreads:1);
+if ((report != NULL) && !write_report(report)) printf("\n Error writing the report %s",report);
+printf("\n");
+}
+#endif
+
+
+#ifndef WIN32
+//***********************************************************************
+//* Streaming mode: a file of any size is searched in windows and patched
+//* in place, memory use is one window
+//***********************************************************************
+static void stream_file(const char* file, int bflag, int apply, uint32_t wsize) {
+
+struct stat st;
+uint64_t hits[MAXSIG];
+uint64_t off;
+int fd,family,res;
 
+fd=open(file,apply?O_RDWR:O_RDONLY);
+if ((fd<0) || (fstat(fd,&st) != 0)) {
+  printf("\n Error opening file %s\n",file);
+  return;
+}
+if (stream_signatures(fd,st.st_size,wsize,hits)<0) {
+  printf("\n Error reading file %s\n",file);
+  close(fd);
+  return;
+}
+
+res=stream_patch(fd,st.st_size,SIGC_ERASE,hits,apply,&family,&off);
+if (res>0) printf("\n* %s type signature found at offset %08llx",signame(family),(unsigned long long)off);
+else if (res == 0) printf("\n! Eraseall-patch signature not found");
+else printf("\n! Error writing the eraseall patch");
+
+if (bflag) {
+  res=stream_patch(fd,st.st_size,SIGC_ISBAD,hits,apply,&family,&off);
+  if (res>0) printf("\n* isbad signature found at offset %08llx",(unsigned long long)off);
+  else if (res == 0) printf("\n! isbad signature not found");
+  else printf("\n! Error writing the isbad patch");
+}
+if (apply && (close(fd) != 0)) printf("\n Error writing file %s",file);
+if (!apply) close(fd);
+printf("\n");
+}
+#endif
+
+#ifndef WIN32
+//***********************************************************************
+//* Patch journal operations: replay (-A), revert (-R), verify (-V)
+//*
+//* The file must have the size of the journal and hold the input (or, for
+//* revert, the patched) bytes in all ranges, and its SHA-256 must be that
+//* of the journal input (output). With -n the hash is not checked - the
+//* caller has identified the loader already - and replay touches only the
+//* journal ranges.
+//***********************************************************************
+#define PJ_REPLAY 1
+#define PJ_REVERT 2
+#define PJ_VERIFY 3
+
+static int copy_file(int in, const char* outfile) {
+
+char buf[65536];
+ssize_t res;
+int out;
+
+out=open(outfile,O_RDWR|O_CREAT|O_TRUNC,0644);
+if (out<0) return -1;
+while ((res=read(in,buf,sizeof(buf)))>0) {
+  if (write(out,buf,res) != res) {
+    close(out);
+    return -1;
+  }
+}
+if (res<0) {
+  close(out);
+  return -1;
+}
+return out;
+}
+
+static int file_hash(int fd, uint64_t size, uint8_t* hash) {
+
+void* map;
+
+map=mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+if (map == MAP_FAILED) return 0;
+sha256(map,size,hash);
+munmap(map,size);
+return 1;
+}
+
+static void journal_op(int op, const char* jfile, const char* file, const char* outfile, int inplace, int nohash) {
+
+struct journal j;
+struct stat st;
+char err[300];
+uint8_t hash[32];
+int fd,out,state,want,done;
+static const char* statename[]={"original","patched"};
+
+if (!journal_load(&j,jfile,err,sizeof(err))) {
+  printf("\n %s\n",err);
+  return;
+}
+printf("\n Journal: %s, ranges: %i",j.note[0]?j.note:"no patches",j.n);
+fd=open(file,(inplace && (op != PJ_VERIFY))?O_RDWR:O_RDONLY);
+if ((fd<0) || (fstat(fd,&st) != 0)) {
+  printf("\n Error opening file %s\n",file);
+  journal_free(&j);
+  return;
+}
+if (st.st_size != j.size) {
+  printf("\n ! The size of %s differs from the journal - this is another loader\n",file);
+  goto end;
+}
+state=journal_state(&j,fd);
+if (state == PJ_IOERR) {
+  printf("\n Error reading file %s\n",file);
+  goto end;
+}
+
+if ((op == PJ_VERIFY) || !nohash) {
+  if (!file_hash(fd,st.st_size,hash)) {
+    printf("\n Error reading file %s\n",file);
+    goto end;
+  }
+}
+if (op == PJ_VERIFY) {
+  if (memcmp(hash,j.outhash,32) == 0) printf("\n* Patched: identical to the output of the journal");
+  else if (memcmp(hash,j.inhash,32) == 0) printf("\n* Original: identical to the input of the journal");
+  else if (state == PJ_MIXED) printf("\n! The patch ranges hold neither the input nor the patched bytes");
+  else printf("\n! The patch ranges are %s, but the file differs from the journal elsewhere",statename[state]);
+  printf("\n");
+  goto end;
+}
+
+want=(op == PJ_REPLAY)?PJ_ORIGINAL:PJ_PATCHED;
+done=(op == PJ_REPLAY)?PJ_PATCHED:PJ_ORIGINAL;
+if ((state != want) && (state != done)) {
+  printf("\n ! The patch ranges of %s do not match the journal\n",file);
+  goto end;
+}
+if (!nohash && (memcmp(hash,(state == PJ_ORIGINAL)?j.inhash:j.outhash,32) != 0)) {
+  printf("\n ! %s is not the loader of the journal (SHA-256 differs)\n",file);
+  goto end;
+}
+if (state == done) printf("\n* The file is already %s",statename[done]);
+if (outfile != NULL) {
+  out=copy_file(fd,outfile);
+  if ((out<0) || ((state == want) && !journal_apply(&j,out,op == PJ_REVERT)) || (close(out) != 0)) {
+    printf("\n Error writing file %s\n",outfile);
+    goto end;
+  }
+}
+else if (inplace) {
+  if ((state == want) && !journal_apply(&j,fd,op == PJ_REVERT)) {
+    printf("\n Error writing file %s\n",file);
+    goto end;
+  }
+}
+else {
+  if (state == want) printf("\n* The journal can be %s, write it with -i or -o",(op == PJ_REPLAY)?"replayed":"reverted");
+  printf("\n");
+  goto end;
+}
+if (state == want) printf("\n* Ranges %s: %i",(op == PJ_REPLAY)?"patched":"restored",j.n);
+printf("\n");
+
+end:
+close(fd);
+journal_free(&j);
+}
+#endif
 
 //#######################################################################################################
 void main(int argc, char* argv[]) {
@@ -27,11 +681,29 @@ int opt;
 uint8_t outfilename[100];
 int oflag=0,bflag=0;
 uint32_t res;
+uint32_t hits[MAXSIG];
+char* sigfile=NULL;
+char sigerr[300];
+int family;
+#ifndef WIN32
+char* outdir=NULL;
+char* report=NULL;
+int nthreads=0,i;
+int sflag=0,iflag=0;
+uint32_t wsize=4;  // MB
+struct stat st;
+char* jfile=NULL;   // -J
+char* pjfile=NULL;  // -A, -R, -V
+int pjop=0,nohash=0;
+uint8_t* orig;
+struct journal j;
+char note[64];
+#endif
 
 
 // Command line parsing
 
-while ((opt = getopt(argc, argv, "o:bh")) != -1) {
+while ((opt = getopt(argc, argv, "o:bhd:O:r:j:SiW:J:A:R:V:na")) != -1) {
   switch (opt) {
    case 'h': 
      
@@ -40,7 +712,25 @@ printf("\n Program for automatic patching of Balong V7 platform loaders\n\n\
  The following keys are valid:\n\n\
 -o file  - output file name. By default, only a patch possibility check is performed\n\
 -b       - add a patch that disables checking for bad blocks\n\
-\n",argv[0]);
+-d file  - take the patch signatures from the specified file instead of the built-in ones\n"
+#ifndef WIN32
+"\n Batch mode - several files, directories or globs ('/srv/loaders/*.bin'):\n\n\
+-O dir   - write the patched loaders into the directory (subdirectories are kept)\n\
+-r file  - write a report of the batch, CSV or JSON (file name *.json)\n\
+-j n     - number of threads (default - number of CPUs)\n\
+-a       - analysis: find all hits of all signatures and flag the ambiguous loaders, nothing is patched\n\
+\n Streaming mode - files of any size (flash dumps, firmware containers):\n\n\
+-S       - search the file in windows instead of reading it whole\n\
+-i       - patch the file itself in place (implies -S)\n\
+-W n     - window size in megabytes (default 4)\n\
+\n Patch journal - the changed bytes with the hashes of the input and the result:\n\n\
+-J file  - write the journal of the patches made\n\
+-A file  - replay the journal onto the same loader without a search (-i - in place, -o - into a copy)\n\
+-R file  - revert the patches of the journal (-i or -o)\n\
+-V file  - check the file against the journal\n\
+-n       - replay or revert without checking the SHA-256 of the file (only the patch ranges are read)\n"
+#endif
+"\n",argv[0]);
     return;
 
    case 'o':
@@ -51,6 +741,59 @@ printf("\n Program for automatic patching of Balong V7 platform loaders\n\n\
    case 'b':
      bflag=1;
      break;
+
+   case 'd':
+     sigfile=optarg;
+     break;
+
+#ifndef WIN32
+   case 'O':
+     outdir=optarg;
+     break;
+
+   case 'r':
+     report=optarg;
+     break;
+
+   case 'j':
+     nthreads=atoi(optarg);
+     break;
+
+   case 'S':
+     sflag=1;
+     break;
+
+   case 'i':
+     sflag=iflag=1;
+     break;
+
+   case 'J':
+     jfile=optarg;
+     break;
+
+   case 'A':
+   case 'R':
+   case 'V':
+     pjfile=optarg;
+     pjop=(opt == 'A')?PJ_REPLAY:((opt == 'R')?PJ_REVERT:PJ_VERIFY);
+     break;
+
+   case 'n':
+     nohash=1;
+     break;
+
+   case 'a':
+     analyze=1;
+     break;
+
+   case 'W':
+     wsize=atoi(optarg);
+     if ((wsize<1) || (wsize>1024)) {
+       printf("\n Window size must be between 1 and 1024 MB\n");
+       return;
+     }
+     break;
+#endif
      
    case '?':
    case ':':  
@@ -66,6 +809,52 @@ printf("\n Program for automatic modification of Balong V7 loaders, (c) forth32"
     return;
 }  
     
+if ((sigfile != NULL) && !load_signatures(sigfile,sigerr,sizeof(sigerr))) {
+  printf("\n %s\n",sigerr);
+  return;
+}
+
+#ifndef WIN32
+if (pjop != 0) {
+  journal_op(pjop,pjfile,argv[optind],oflag?(char*)outfilename:NULL,iflag,nohash);
+  return;
+}
+if ((jfile != NULL) && (sflag || (optind+1<argc))) {
+  printf("\n The journal is written for one file in the usual mode\n");
+  return;
+}
+if (analyze && (oflag || sflag || (outdir != NULL) || (jfile != NULL))) {
+  printf("\n The analysis only reports the hits, -o, -O, -S and -J are not used with -a\n");
+  return;
+}
+
+if (sflag) {
+  if (oflag || (optind+1<argc)) {
+    printf("\n The streaming mode takes one file and patches it in place (-i)\n");
+    return;
+  }
+  stream_file(argv[optind],bflag,iflag,wsize<<20);
+  return;
+}
+
+// several inputs, a directory or the batch keys - batch mode
+if (analyze || (optind+1<argc) || (outdir != NULL) || (report != NULL) || (strpbrk(argv[optind],"*?[") != NULL) ||
+    ((stat(argv[optind],&st) == 0) && S_ISDIR(st.st_mode))) {
+  if (oflag) {
+    printf("\n -o takes one file, use -O in batch mode\n");
+    return;
+  }
+  batchbad=bflag;
+  for(i=optind;i<argc;i++) add_arg(argv[i],outdir);
+  if (out_collisions()) {
+    printf("\n Inputs with the same name would overwrite each other in %s, nothing is written\n",outdir);
+    return;
+  }
+  batch(nthreads,report);
+  return;
+}
+#endif
+
 in=fopen(argv[optind],"rb");
 if (in == 0) {
   printf("\n Error opening file %s",argv[optind]);
@@ -84,53 +873,45 @@ fclose(in);
 
 //==================================================================================
 
-res=pv7r1(buf, fsize);
-if (res != 0)  {
-  printf("\n* V7R1 type signature found at offset %08x",res);
-  goto endpatch;
-}  
-
-res=pv7r2(buf, fsize);
-if (res != 0)  {
-  printf("\n* V7R2 type signature found at offset %08x",res);
-  goto endpatch;
-}  
-
-res=pv7r11(buf, fsize);
-if (res != 0)  {
-  printf("\n* V7R11 type signature found at offset %08x",res);
-  goto endpatch;
-}   
-
-res=pv7r22(buf, fsize);
-if (res != 0)  {
-  printf("\n* V7R22 type signature found at offset %08x",res);
-  goto endpatch;
-}  
-
-res=pv7r22_2(buf, fsize);
-if (res != 0)  {
-  printf("\n* V7R22_2 type signature found at offset %08x",res);
-  goto endpatch;
+#ifndef WIN32
+// the journal is the difference from the input
+if (jfile != NULL) {
+  orig=malloc(fsize);
+  memcpy(orig,buf,fsize);
+  note[0]=0;
 }
+#endif
 
-res=pv7r22_3(buf, fsize);
-if (res != 0)  {
-  printf("\n* V7R22_3 type signature found at offset %08x",res);
-  goto endpatch;
-}
+// one pass finds all signatures
+scan_signatures(buf, fsize, hits);
 
-printf("\n! Eraseall-patch signature not found");
+res=peraseall(buf, fsize, hits, &family);
+if (res != 0)  printf("\n* %s type signature found at offset %08x",signame(family),res);
+else printf("\n! Eraseall-patch signature not found");
+#ifndef WIN32
+if (res != 0) snprintf(note,sizeof(note),"eraseall %s at %08x",signame(family),res);
+#endif
 
 //==================================================================================
-endpatch:
 
 if (bflag) {
-   res=perasebad(buf, fsize);
+   res=pisbad(buf, fsize, hits);
    if (res != 0) printf("\n* isbad signature found at offset %08x",res);  
    else  printf("\n! isbad signature not found");  
+#ifndef WIN32
+   if (res != 0) snprintf(note+strlen(note),sizeof(note)-strlen(note),"%sisbad at %08x",note[0]?", ":"",res);
+#endif
 }
 
+#ifndef WIN32
+if (jfile != NULL) {
+  if (!journal_diff(&j,orig,buf,fsize,note) || !journal_save(&j,jfile)) printf("\n Error writing the journal %s",jfile);
+  else printf("\n Journal written to %s, ranges: %i",jfile,j.n);
+  journal_free(&j);
+  free(orig);
+}
+#endif
+
 if (oflag) {
   out=fopen(outfilename,"wb");
   if (out != 0) {
@@ -1,6 +1,8 @@
+#define _FILE_OFFSET_BITS 64   // flash dumps past 2G on 32-bit hosts
 #include <stdio.h>
 #include <stdint.h>
 #ifndef WIN32
+#include <sys/types.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -10,23 +12,77 @@
 #endif
 
 #include "parts.h"
+#include "wordscan.h"
 
 // table header signature
 const uint8_t headmagic[16]={0x70, 0x54, 0x61, 0x62, 0x6c, 0x65, 0x48, 0x65, 0x61, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80};  
 
+#define PTBLOCK 0x10000  // block of the file search
+
+// 64-bit file positions
+#ifndef WIN32
+#define FTELL ftello
+#define FSEEK fseeko
+#else
+#define FTELL _ftelli64
+#define FSEEK _fseeki64
+#endif
+
+//*********************************************
+//* Table header at the offsets 0, 4, 8 ... of the buffer,
+//* size - if there is none
+//*********************************************
+static uint32_t match_ptable(const uint8_t* buf, uint32_t size) {
+
+uint32_t off,w,end;
+
+if (size<16) return size;
+// offsets where a whole header fits
+end=size-15;
+// only the offsets where the first word of the header matches are compared
+memcpy(&w,headmagic,4);
+for(off=find_word(buf,0,end,w);off<end;off=find_word(buf,off+4,end,w)) {
+  if (memcmp(buf+off,headmagic,16) == 0) return off;
+}
+return size;
+}
+
 //*********************************************
 //* Search for the partition table in the loader
+//*
+//* The file is searched from the current position in steps of 4 and read
+//* in large blocks; the bytes of the last incomplete candidates are carried
+//* over into the next block. On success the file is positioned at the table.
+//* The offset is 64-bit: flash dumps are larger than 4G.
 //*********************************************
-uint32_t find_ptable(FILE* ldr) {
+uint64_t find_ptable(FILE* ldr) {
 
-uint8_t rbuf[16];
-while (fread(rbuf,1,16,ldr) == 16) {
-  if (memcmp(rbuf,headmagic,16) == 0) {
-    fseek(ldr,-16,SEEK_CUR);
-    return ftell(ldr);
+uint8_t* buf;
+uint64_t base;
+uint32_t have=0,total,off,next;
+size_t n;
+
+if (FTELL(ldr)<0) return 0;
+base=FTELL(ldr);
+buf=malloc(PTBLOCK+16);
+if (buf == NULL) return 0;
+for(;;) {
+  n=fread(buf+have,1,PTBLOCK,ldr);
+  total=have+n;
+  off=match_ptable(buf,total);
+  if (off<total) {
+    free(buf);
+    FSEEK(ldr,base+off,SEEK_SET);
+    return base+off;
   }
-  fseek(ldr,-12,SEEK_CUR);
+  if (n == 0) break;
+  // the first candidate without a whole header in the buffer
+  next=(total<16)?0:((total-16)/4+1)*4;
+  have=total-next;
+  memmove(buf,buf+next,have);
+  base+=next;
 }
+free(buf);
 return 0;
 }
   
@@ -68,12 +124,9 @@ printf("\n");
 //*********************************************
 uint32_t find_ptable_ram(char* buf, uint32_t size) {
 
-// table header signature
 uint32_t off;
 
-for(off=0;off<(size-16);off+=4) {
-  if (memcmp(buf+off,headmagic,16) == 0)   return off;
-}
-return 0;
+off=match_ptable((uint8_t*)buf,size);
+return (off<size)?off:0;
 }
 
@@ -24,6 +24,6 @@ struct ptable_t {
 // table header signature
 extern const uint8_t headmagic[16];
 
-uint32_t find_ptable(FILE* ldr);
+uint64_t find_ptable(FILE* ldr);
 uint32_t find_ptable_ram(char* buf, uint32_t size);
 void show_map(struct ptable_t ptable);
@@ -1,38 +1,59 @@
+#include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include "patcher.h"
+#include "wordscan.h"
 #include <stdlib.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
 //***********************************************************************
-//* Signature search and patch application
+//* Applying the patch at the found signature
 //*
 //* ptype=0 - nop-patch
 //* ptype=1 - br-patch
 //***********************************************************************
-uint32_t patch(struct defpatch fp, uint8_t* buf, uint32_t fsize, uint32_t ptype) {
+static void patch_point(uint8_t* pp, uint32_t ptype) {
 
 // applied patch - mov r0,#0
 const char nop0[4]={0, 0, 0xa0, 0xe3};   
-uint32_t i;
-uint8_t c;
 
-for(i=8;i<(fsize-60);i+=4) {
+switch (ptype) {
+  case 0:
+    memcpy(pp,nop0,4);
+    return;
+
+  case 1:
+    *pp|=0xe0;
+    return;
+
+  default:
+    exit(11);
+}
+}
+
+static void apply_patch(struct defpatch* fp, uint8_t* buf, uint32_t i, uint32_t ptype) {
+
+patch_point(buf+i+fp->sigsize+fp->poffset,ptype);
+}
+
+//***********************************************************************
+//* Signature search and patch application
+//***********************************************************************
+uint32_t patch(struct defpatch fp, uint8_t* buf, uint32_t fsize, uint32_t ptype) {
+
+uint32_t i,w,end;
+
+if (fsize <= 68) return 0;
+end=fsize-60;
+// only the offsets where the first word of the signature matches are compared
+memcpy(&w,fp.sig,4);
+for(i=find_word(buf,8,end,w);i<end;i=find_word(buf,i+4,end,w)) {
   if (memcmp(buf+i,fp.sig, fp.sigsize) == 0) {
     // signature found - apply the patch and exit
-    switch (ptype) {
-      case 0:
-        memcpy(buf+i+fp.sigsize+fp.poffset,nop0,4);
-        return i;
-
-      case 1:
-        c=*(buf+i+fp.sigsize+fp.poffset);
-        c|=0xe0;
-        *(buf+i+fp.sigsize+fp.poffset)=c;
-        return i;
-
-      default:
-    exit(11);
-    }
+    apply_patch(&fp,buf,i,ptype);
+    return i;
   }
 }
 // signature not found
@@ -96,3 +117,689 @@ uint32_t pv7r22_2 (uint8_t* buf, uint32_t fsize) { return patch(patch_v7r22_2, b
 uint32_t pv7r22_3 (uint8_t* buf, uint32_t fsize) { return patch(patch_v7r22_3, buf, fsize,0); }
 uint32_t perasebad (uint8_t* buf, uint32_t fsize) { return patch(patch_erasebad, buf, fsize,0); }
 
+//****************************************************
+//* Signature database and one-pass scanner
+//****************************************************
+
+// Rule of the database: signature bytes with a don't-care mask
+struct sigrule {
+  char name[24];       // family
+  int cls;             // SIGC_ERASE or SIGC_ISBAD
+  uint32_t ptype;      // 0 - nop-patch, 1 - br-patch
+  int32_t poffset;     // offset to the patch point from the end of the signature
+  uint32_t len;        // signature length
+  uint8_t* pat;
+  uint8_t* mask;       // bits that must match: ff - byte, f0/0f - nibble, 00 - any
+  int exact;           // no don't-care bits
+  int32_t anchor;      // offset of the fully defined word the scan looks for, -1 - none
+  uint32_t aword;
+  int next;            // next rule in the same hash slot
+};
+
+static struct sigrule* rules=NULL;
+static int nrules=0;
+
+// Built-in rules - the patches above, in the order of the legacy pv*() chain
+static const struct {
+  const char* name;
+  int cls;
+  struct defpatch* dp;
+  uint32_t ptype;
+} builtin[]={
+  {"V7R1",    SIGC_ERASE, &patch_v7r1,     0},
+  {"V7R2",    SIGC_ERASE, &patch_v7r2,     0},
+  {"V7R11",   SIGC_ERASE, &patch_v7r11,    0},
+  {"V7R22",   SIGC_ERASE, &patch_v7r22,    1},
+  {"V7R22_2", SIGC_ERASE, &patch_v7r22_2,  0},
+  {"V7R22_3", SIGC_ERASE, &patch_v7r22_3,  0},
+  {"isbad",   SIGC_ISBAD, &patch_erasebad, 0}
+};
+
+// The matcher is compiled on first use. Signatures are looked for at
+// word-aligned offsets only, so the root of the automaton is a hash table
+// keyed by the anchor word - the first fully defined aligned word of the
+// signature; the rest is verified with the mask. With few distinct anchor
+// words find_words() skips the offsets where none of them is, otherwise a
+// bitmap of their low halves does. Rules without an anchor word are
+// checked at every offset.
+#define SIGHASHBITS 10
+#define SIGHASH(w) (((w)*0x9e3779b1u)>>(32-SIGHASHBITS))
+
+static int sighead[1<<SIGHASHBITS];   // first rule in the hash slot, -1 - none
+static uint32_t anchors[8];            // distinct anchor words
+static int nanchors;                   // -1 - more than 8, the bitmap is used
+static uint8_t abits[65536/8];         // low 16 bits of the anchor words
+static uint32_t maxanchor;
+static uint32_t maxback,maxreach;      // bytes a rule looks at before and after the signature start
+static int sigready=0;
+
+//***********************************************************************
+//* Adding a rule
+//***********************************************************************
+static int add_rule(const char* name, int cls, uint32_t ptype, int32_t poffset, const uint8_t* pat, const uint8_t* mask, uint32_t len) {
+
+struct sigrule* r;
+uint32_t a,k;
+
+if ((nrules >= MAXSIG) || (len<4) || (poffset<-MAXPOFFSET) || (poffset>MAXPOFFSET)) return 0;
+r=realloc(rules,(nrules+1)*sizeof(struct sigrule));
+if (r == NULL) return 0;
+rules=r;
+r=&rules[nrules];
+memset(r,0,sizeof(*r));
+strncpy(r->name,name,sizeof(r->name)-1);
+r->cls=cls;
+r->ptype=ptype;
+r->poffset=poffset;
+r->len=len;
+r->pat=malloc(len);
+r->mask=malloc(len);
+if ((r->pat == NULL) || (r->mask == NULL)) {
+  free(r->pat);
+  free(r->mask);
+  return 0;
+}
+r->exact=1;
+for(k=0;k<len;k++) {
+  r->mask[k]=mask?mask[k]:0xff;
+  r->pat[k]=pat[k]&r->mask[k];
+  if (r->mask[k] != 0xff) r->exact=0;
+}
+r->anchor=-1;
+for(a=0;a+4<=len;a+=4) {
+  if ((r->mask[a]&r->mask[a+1]&r->mask[a+2]&r->mask[a+3]) == 0xff) {
+    r->anchor=a;
+    memcpy(&r->aword,r->pat+a,4);
+    break;
+  }
+}
+nrules++;
+return 1;
+}
+
+//***********************************************************************
+//* Releasing all rules
+//***********************************************************************
+static void free_rules() {
+
+int i;
+
+for(i=0;i<nrules;i++) {
+  free(rules[i].pat);
+  free(rules[i].mask);
+}
+free(rules);
+rules=NULL;
+nrules=0;
+sigready=0;
+}
+
+//***********************************************************************
+//* Building the matcher
+//***********************************************************************
+static void compile_sigs() {
+
+int i,k;
+uint32_t h;
+int32_t pe;   // patch point from the signature start
+
+if (rules == NULL) {
+  for(i=0;i<sizeof(builtin)/sizeof(builtin[0]);i++) {
+    add_rule(builtin[i].name,builtin[i].cls,builtin[i].ptype,builtin[i].dp->poffset,
+             (const uint8_t*)builtin[i].dp->sig,NULL,builtin[i].dp->sigsize);
+  }
+}
+memset(sighead,-1,sizeof(sighead));
+memset(abits,0,sizeof(abits));
+nanchors=0;
+maxanchor=0;
+maxback=0;
+maxreach=0;
+for(i=nrules-1;i>=0;i--) {
+  // the patch point may lie before or after the signature
+  pe=(int32_t)rules[i].len+rules[i].poffset;
+  if ((pe<0) && (-pe>maxback)) maxback=(-pe+3)&~3;
+  if ((pe+4>0) && (pe+4>maxreach)) maxreach=pe+4;
+  if (rules[i].len>maxreach) maxreach=rules[i].len;
+  if (rules[i].anchor<0) continue;
+  h=SIGHASH(rules[i].aword);
+  rules[i].next=sighead[h];
+  sighead[h]=i;
+  abits[(rules[i].aword&0xffff)>>3] |= 1<<(rules[i].aword&7);
+  if (rules[i].anchor>maxanchor) maxanchor=rules[i].anchor;
+  if (nanchors<0) continue;
+  for(k=0;k<nanchors;k++) if (anchors[k] == rules[i].aword) break;
+  if (k<nanchors) continue;
+  if (nanchors == 8) nanchors=-1;
+  else anchors[nanchors++]=rules[i].aword;
+}
+sigready=1;
+}
+
+//***********************************************************************
+//* Next word of the line, NULL - none (strtok_r is missing in MSVC)
+//***********************************************************************
+static char* nextword(char** pos) {
+
+char* p;
+char* e;
+
+p=*pos+strspn(*pos," \t\r\n");
+if (*p == 0) return NULL;
+e=p+strcspn(p," \t\r\n");
+if (*e != 0) *e++=0;
+*pos=e;
+return p;
+}
+
+//***********************************************************************
+//* Loading the signature database
+//*
+//* One rule per line, # starts a comment:
+//*   <erase|isbad> <family> <nop|branch> <offset> <bytes>
+//* offset - from the end of the signature to the patch point, as in
+//* struct defpatch, decimal or 0x hex; bytes - hex, separated or not,
+//* ? stands for a nibble that does not matter (E? , ??). The erase rules are tried in the order
+//* of the file. The built-in rules are replaced.
+//* Returns the number of rules, 0 - error described in err.
+//***********************************************************************
+int load_signatures(const char* file, char* err, int errlen) {
+
+FILE* f;
+char line[4096];
+char* tok[4];
+char* p;
+char* save;
+char* end;
+long poffset;
+uint8_t pat[1024], mask[1024];
+uint32_t len;
+int lineno=0,i,cls,ptype,hi;
+char c;
+
+f=fopen(file,"r");
+if (f == NULL) {
+  snprintf(err,errlen,"Error opening %s",file);
+  return 0;
+}
+free_rules();
+while (fgets(line,sizeof(line),f) != NULL) {
+  lineno++;
+  p=strchr(line,'#');
+  if (p != NULL) *p=0;
+  save=line;
+  for(i=0;i<4;i++) {
+    tok[i]=nextword(&save);
+    if (tok[i] == NULL) break;
+  }
+  if (i == 0) continue;   // empty line
+  if (i<4) goto bad;
+  if (strcmp(tok[0],"erase") == 0) cls=SIGC_ERASE;
+  else if (strcmp(tok[0],"isbad") == 0) cls=SIGC_ISBAD;
+  else goto bad;
+  if (strcmp(tok[2],"nop") == 0) ptype=0;
+  else if (strcmp(tok[2],"branch") == 0) ptype=1;
+  else goto bad;
+  // checked here as well: a long out of the int32_t range would wrap
+  poffset=strtol(tok[3],&end,0);
+  if ((*end != 0) || (poffset<-MAXPOFFSET) || (poffset>MAXPOFFSET)) goto bad;
+
+  // signature bytes, two digits each
+  len=0;
+  hi=1;
+  while ((p=nextword(&save)) != NULL) {
+    for(;*p != 0;p++) {
+      c=*p;
+      if (hi) {
+        if (len >= sizeof(pat)) goto bad;
+        pat[len]=mask[len]=0;
+      }
+      if (c == '?') ;
+      else if ((c >= '0') && (c <= '9')) pat[len]|=(c-'0')<<(hi?4:0);
+      else if ((c >= 'a') && (c <= 'f')) pat[len]|=(c-'a'+10)<<(hi?4:0);
+      else if ((c >= 'A') && (c <= 'F')) pat[len]|=(c-'A'+10)<<(hi?4:0);
+      else goto bad;
+      if (c != '?') mask[len]|=hi?0xf0:0x0f;
+      if (!hi) len++;
+      hi=!hi;
+    }
+  }
+  if (!hi) goto bad;  // odd number of digits
+  if (!add_rule(tok[1],cls,ptype,poffset,pat,mask,len)) goto bad;
+}
+fclose(f);
+if (nrules == 0) {
+  snprintf(err,errlen,"No signatures in %s",file);
+  return 0;
+}
+compile_sigs();
+return nrules;
+
+bad:
+snprintf(err,errlen,"%s, line %i: invalid signature",file,lineno);
+fclose(f);
+free_rules();
+return 0;
+}
+
+//***********************************************************************
+//* Database contents
+//***********************************************************************
+int sig_count() {
+
+if (!sigready) compile_sigs();
+return nrules;
+}
+
+const char* signame(int sig) {
+
+if (!sigready) compile_sigs();
+if ((sig<0) || (sig>=nrules)) return "?";
+return rules[sig].name;
+}
+
+//***********************************************************************
+//* Fingerprint of the database (FNV-1a over all rules) - prepared loaders
+//* cached by an earlier run are valid only for the same rules
+//***********************************************************************
+static uint64_t fnv(uint64_t h, const void* data, uint32_t len) {
+
+const uint8_t* p=data;
+uint32_t i;
+
+for(i=0;i<len;i++) h=(h^p[i])*0x100000001b3ULL;
+return h;
+}
+
+uint64_t sig_digest() {
+
+uint64_t h=0xcbf29ce484222325ULL;
+int i;
+
+if (!sigready) compile_sigs();
+for(i=0;i<nrules;i++) {
+  h=fnv(h,rules[i].name,sizeof(rules[i].name));
+  h=fnv(h,&rules[i].cls,sizeof(rules[i].cls));
+  h=fnv(h,&rules[i].ptype,sizeof(rules[i].ptype));
+  h=fnv(h,&rules[i].poffset,sizeof(rules[i].poffset));
+  h=fnv(h,&rules[i].len,sizeof(rules[i].len));
+  h=fnv(h,rules[i].pat,rules[i].len);
+  h=fnv(h,rules[i].mask,rules[i].len);
+}
+return h;
+}
+
+//***********************************************************************
+//* Checking a rule at a signature offset
+//***********************************************************************
+static int rule_match(struct sigrule* r, uint8_t* buf, uint32_t fsize, uint32_t p) {
+
+uint32_t k;
+int64_t pp=(int64_t)p+r->len+r->poffset;
+
+// the signature and the patch point must be inside the buffer
+if ((uint64_t)p+r->len > fsize) return 0;
+if ((pp<0) || (pp+4 > fsize)) return 0;
+if (r->exact) return memcmp(buf+p,r->pat,r->len) == 0;
+for(k=0;k<r->len;k++) {
+  if ((buf[p+k]&r->mask[k]) != r->pat[k]) return 0;
+}
+return 1;
+}
+
+//***********************************************************************
+//* Search for one rule, the first signature starting in [from,to)
+//***********************************************************************
+static uint32_t scan_rule(int s, uint8_t* buf, uint32_t fsize, uint32_t from, uint32_t to) {
+
+struct sigrule* r=&rules[s];
+uint32_t i,p,send;
+
+if (r->anchor<0) {
+  for(p=from;p<to;p+=4) if (rule_match(r,buf,fsize,p)) return p;
+  return NOHIT;
+}
+send=((uint64_t)to+r->anchor < fsize-3)?to+r->anchor:fsize-3;
+for(i=find_word(buf,from+r->anchor,send,r->aword);i<send;i=find_word(buf,i+4,send,r->aword)) {
+  if (rule_match(r,buf,fsize,i-r->anchor)) return i-r->anchor;
+}
+return NOHIT;
+}
+
+//***********************************************************************
+//* Search for the signatures starting at from, from+4 ... below to
+//*
+//* Only the rules with hits[n] == NOHIT are looked for; the first hit of
+//* each goes into hits[n]. The signature and the patch point must be
+//* inside the buffer. Returns the number of rules found.
+//***********************************************************************
+int scan_window(uint8_t* buf, uint32_t fsize, uint32_t from, uint32_t to, uint32_t* hits) {
+
+uint32_t i,w,p,send;
+int s,found=0,left=0;
+
+if (!sigready) compile_sigs();
+if ((fsize<4) || (from >= to)) return 0;
+for(s=0;s<nrules;s++) if ((hits[s] == NOHIT) && (rules[s].anchor >= 0)) left++;
+// anchor words of the signatures starting below to
+send=((uint64_t)to+maxanchor < fsize-3)?to+maxanchor:fsize-3;
+
+for(i=from;left>0;i+=4) {
+  if (nanchors >= 0) {
+    i=find_words(buf,i,send,anchors,nanchors);
+    if (i >= send) break;
+    memcpy(&w,buf+i,4);
+  }
+  else {
+    if (i >= send) break;
+    memcpy(&w,buf+i,4);
+    if ((abits[(w&0xffff)>>3] & (1<<(w&7))) == 0) continue;
+  }
+  for(s=sighead[SIGHASH(w)];s>=0;s=rules[s].next) {
+    if ((w != rules[s].aword) || (hits[s] != NOHIT)) continue;
+    if (i<from+rules[s].anchor) continue;
+    p=i-rules[s].anchor;
+    if ((p >= to) || !rule_match(&rules[s],buf,fsize,p)) continue;
+    hits[s]=p;
+    found++;
+    left--;
+  }
+}
+// rules without an anchor word
+for(s=0;s<nrules;s++) {
+  if ((rules[s].anchor >= 0) || (hits[s] != NOHIT)) continue;
+  hits[s]=scan_rule(s,buf,fsize,from,to);
+  if (hits[s] != NOHIT) found++;
+}
+return found;
+}
+
+//***********************************************************************
+//* Search for all signatures in one pass
+//*
+//* hits[n] (sig_count() entries) receives the offset of the first hit of
+//* rule n, 0 - not found. The offsets and bounds are the same as in patch().
+//* Returns the number of rules found.
+//***********************************************************************
+int scan_signatures(uint8_t* buf, uint32_t fsize, uint32_t* hits) {
+
+int s,found;
+
+if (!sigready) compile_sigs();
+memset(hits,0,nrules*sizeof(uint32_t));
+if (fsize <= 68) return 0;
+for(s=0;s<nrules;s++) hits[s]=NOHIT;
+found=scan_window(buf,fsize,8,fsize-60,hits);
+for(s=0;s<nrules;s++) if (hits[s] == NOHIT) hits[s]=0;
+return found;
+}
+
+//***********************************************************************
+//* Search for all hits of all rules
+//*
+//* Every offset 8, 12 ... below fsize-60 where a rule matches goes to
+//* hits[] (up to max entries), ordered by offset and rule. Returns the
+//* number of hits, which may be larger than max.
+//***********************************************************************
+static int hitorder(const void* a, const void* b) {
+
+const struct sighit* x=a;
+const struct sighit* y=b;
+
+if (x->off != y->off) return (x->off<y->off)?-1:1;
+return x->sig-y->sig;
+}
+
+int scan_all(uint8_t* buf, uint32_t fsize, struct sighit* hits, int max) {
+
+uint32_t i,w,p,end,send;
+int s,n=0;
+
+if (!sigready) compile_sigs();
+if (fsize <= 68) return 0;
+end=fsize-60;
+send=((uint64_t)end+maxanchor < fsize-3)?end+maxanchor:fsize-3;
+
+// without anchored rules only the pass below is left
+for(i=8;nanchors != 0;i+=4) {
+  if (nanchors >= 0) {
+    i=find_words(buf,i,send,anchors,nanchors);
+    if (i >= send) break;
+    memcpy(&w,buf+i,4);
+  }
+  else {
+    if (i >= send) break;
+    memcpy(&w,buf+i,4);
+    if ((abits[(w&0xffff)>>3] & (1<<(w&7))) == 0) continue;
+  }
+  for(s=sighead[SIGHASH(w)];s>=0;s=rules[s].next) {
+    if ((w != rules[s].aword) || (i<8+rules[s].anchor)) continue;
+    p=i-rules[s].anchor;
+    if ((p >= end) || !rule_match(&rules[s],buf,fsize,p)) continue;
+    if (n<max) {
+      hits[n].sig=s;
+      hits[n].off=p;
+    }
+    n++;
+  }
+}
+// rules without an anchor word
+for(s=0;s<nrules;s++) {
+  if (rules[s].anchor >= 0) continue;
+  for(p=8;p<end;p+=4) {
+    if (!rule_match(&rules[s],buf,fsize,p)) continue;
+    if (n<max) {
+      hits[n].sig=s;
+      hits[n].off=p;
+    }
+    n++;
+  }
+}
+qsort(hits,(n<max)?n:max,sizeof(struct sighit),hitorder);
+return n;
+}
+
+//***********************************************************************
+//* Class of a rule and the patch point of its signature at off
+//***********************************************************************
+int sig_class(int sig) {
+
+if (!sigready) compile_sigs();
+if ((sig<0) || (sig>=nrules)) return -1;
+return rules[sig].cls;
+}
+
+uint32_t sig_patchpoint(int sig, uint32_t off) {
+
+if (!sigready) compile_sigs();
+if ((sig<0) || (sig>=nrules)) return 0;
+return off+rules[sig].len+rules[sig].poffset;
+}
+
+//***********************************************************************
+//* Applying the patch of a signature found by scan_signatures()
+//*
+//* The signature is checked again at its offset, since a patch applied
+//* in between may have overwritten it; then the full search is repeated.
+//***********************************************************************
+uint32_t patch_at(int sig, uint8_t* buf, uint32_t fsize, uint32_t off) {
+
+struct sigrule* r;
+
+if (!sigready) compile_sigs();
+if ((off == 0) || (sig<0) || (sig>=nrules)) return 0;
+r=&rules[sig];
+if (!rule_match(r,buf,fsize,off)) {
+  if (fsize <= 68) return 0;
+  off=scan_rule(sig,buf,fsize,8,fsize-60);
+  if (off == NOHIT) return 0;
+}
+patch_point(buf+off+r->len+r->poffset,r->ptype);
+return off;
+}
+
+//***********************************************************************
+//* Patching the first rule of a class that is found
+//***********************************************************************
+static uint32_t patch_class(int cls, uint8_t* buf, uint32_t fsize, uint32_t* hits, int* family) {
+
+uint32_t* myhits=NULL;
+uint32_t res=0;
+int s;
+
+if (!sigready) compile_sigs();
+if (hits == NULL) {
+  myhits=malloc(nrules*sizeof(uint32_t));
+  if (myhits == NULL) return 0;
+  scan_signatures(buf,fsize,myhits);
+  hits=myhits;
+}
+for(s=0;s<nrules;s++) {
+  if ((rules[s].cls != cls) || (hits[s] == 0)) continue;
+  res=patch_at(s,buf,fsize,hits[s]);
+  if (res == 0) continue;
+  if (family != NULL) *family=s;
+  break;
+}
+free(myhits);
+return res;
+}
+
+//***********************************************************************
+//* Removing the flash_eraseall procedure
+//*
+//* The first erase rule of the database that is found in the buffer gets
+//* patched; for the built-in rules the order is V7R1, V7R2, V7R11, V7R22,
+//* V7R22_2, V7R22_3. hits is the result of scan_signatures(), NULL - scan
+//* now. The patched rule is returned in *family. Returns the offset of the
+//* signature, 0 - none found.
+//***********************************************************************
+uint32_t peraseall(uint8_t* buf, uint32_t fsize, uint32_t* hits, int* family) {
+
+return patch_class(SIGC_ERASE,buf,fsize,hits,family);
+}
+
+//***********************************************************************
+//* Disabling the bad block check - the first isbad rule found
+//***********************************************************************
+uint32_t pisbad(uint8_t* buf, uint32_t fsize, uint32_t* hits) {
+
+return patch_class(SIGC_ISBAD,buf,fsize,hits,NULL);
+}
+
+#ifndef WIN32
+//***********************************************************************
+//* Reading a part of the file
+//***********************************************************************
+static int read_at(int fd, uint8_t* buf, uint32_t len, uint64_t off) {
+
+ssize_t res;
+
+while (len>0) {
+  res=pread(fd,buf,len,off);
+  if (res <= 0) return 0;
+  buf+=res;
+  len-=res;
+  off+=res;
+}
+return 1;
+}
+
+//***********************************************************************
+//* Streaming search over a file of any size
+//*
+//* The file is read in windows of wsize bytes, each extended by the bytes
+//* the rules look at before and after a signature, so a signature starting
+//* in the window is checked as in a buffer holding the whole file. hits[n]
+//* receives the file offset of the first hit of rule n, 0 - not found; the
+//* bounds are those of scan_signatures(). Memory use is one window.
+//* Returns the number of rules found, -1 - read error.
+//***********************************************************************
+int stream_signatures(int fd, uint64_t fsize, uint32_t wsize, uint64_t* hits) {
+
+uint8_t* buf;
+uint32_t whits[MAXSIG];
+uint64_t w,base,top,end;
+uint32_t len;
+int s,found=0;
+
+if (!sigready) compile_sigs();
+memset(hits,0,nrules*sizeof(uint64_t));
+if (fsize <= 68) return 0;
+wsize&=~3;
+if (wsize<4096) wsize=4096;
+buf=malloc((size_t)wsize+maxback+maxreach);
+if (buf == NULL) return -1;
+
+end=fsize-60;  // signatures start below end
+for(w=0;(w<end) && (found<nrules);w+=wsize) {
+  base=(w>maxback)?w-maxback:0;
+  top=w+wsize+maxreach;
+  if (top>fsize) top=fsize;
+  len=top-base;
+  if (!read_at(fd,buf,len,base)) {
+    free(buf);
+    return -1;
+  }
+  // rules found in the earlier windows are not looked for
+  for(s=0;s<nrules;s++) whits[s]=hits[s]?0:NOHIT;
+  if (scan_window(buf,len,((w<8)?8:w)-base,((w+wsize<end)?w+wsize:end)-base,whits) == 0) continue;
+  for(s=0;s<nrules;s++) {
+    if ((hits[s] != 0) || (whits[s] == NOHIT)) continue;
+    hits[s]=base+whits[s];
+    found++;
+  }
+}
+free(buf);
+return found;
+}
+
+//***********************************************************************
+//* Patching a file after stream_signatures()
+//*
+//* The first rule of class cls (SIGC_ERASE, SIGC_ISBAD) found in the file
+//* is taken, as peraseall() and pisbad() do. The signature is read and
+//* checked again and the 4 bytes of the patch point are written in place;
+//* with apply=0 nothing is written. The rule goes to *family, the signature
+//* offset to *off. Returns 1 - patched, 0 - no signature, -1 - I/O error.
+//***********************************************************************
+int stream_patch(int fd, uint64_t fsize, int cls, uint64_t* hits, int apply, int* family, uint64_t* off) {
+
+struct sigrule* r;
+uint8_t* buf;
+uint64_t base,top;
+uint32_t len,p,pp;
+int s,res=0;
+
+if (!sigready) compile_sigs();
+buf=malloc(maxback+maxreach);
+if (buf == NULL) return -1;
+for(s=0;s<nrules;s++) {
+  r=&rules[s];
+  if ((r->cls != cls) || (hits[s] == 0)) continue;
+  base=(hits[s]>maxback)?hits[s]-maxback:0;
+  top=hits[s]+maxreach;
+  if (top>fsize) top=fsize;
+  len=top-base;
+  if (!read_at(fd,buf,len,base)) {
+    res=-1;
+    break;
+  }
+  p=hits[s]-base;
+  // changed since the scan, by the patch of another rule for example
+  if (!rule_match(r,buf,len,p)) continue;
+  pp=p+r->len+r->poffset;
+  patch_point(buf+pp,r->ptype);
+  if (apply && (pwrite(fd,buf+pp,4,base+pp) != 4)) {
+    res=-1;
+    break;
+  }
+  *family=s;
+  *off=hits[s];
+  res=1;
+  break;
+}
+free(buf);
+return res;
+}
+#endif
@@ -25,3 +25,43 @@ uint32_t pv7r11 (uint8_t* buf, uint32_t fsize);
 uint32_t pv7r1 (uint8_t* buf, uint32_t fsize);
 uint32_t perasebad (uint8_t* buf, uint32_t fsize);
 
+//****************************************************
+//* Signature database and one-pass scanner
+//****************************************************
+
+#define MAXSIG 1024    // rules in the database
+#define MAXPOFFSET 65536  // limit of the patch point offset of a rule
+
+// classes of the rules
+#define SIGC_ERASE 0   // flash_eraseall procedure
+#define SIGC_ISBAD 1   // bad block check
+
+int load_signatures(const char* file, char* err, int errlen);
+int sig_count();
+const char* signame(int sig);
+uint64_t sig_digest();
+#define NOHIT 0xffffffff  // scan_window(): rule not found
+
+int scan_signatures(uint8_t* buf, uint32_t fsize, uint32_t* hits);
+int scan_window(uint8_t* buf, uint32_t fsize, uint32_t from, uint32_t to, uint32_t* hits);
+uint32_t patch_at(int sig, uint8_t* buf, uint32_t fsize, uint32_t off);
+uint32_t peraseall(uint8_t* buf, uint32_t fsize, uint32_t* hits, int* family);
+uint32_t pisbad(uint8_t* buf, uint32_t fsize, uint32_t* hits);
+
+// Analysis: every hit of every rule
+struct sighit {
+  int sig;        // rule
+  uint32_t off;   // signature offset
+};
+
+int scan_all(uint8_t* buf, uint32_t fsize, struct sighit* hits, int max);
+int sig_class(int sig);
+uint32_t sig_patchpoint(int sig, uint32_t off);
+
+#ifndef WIN32
+//****************************************************
+//* Streaming search and patching of files larger than memory
+//****************************************************
+int stream_signatures(int fd, uint64_t fsize, uint32_t wsize, uint64_t* hits);
+int stream_patch(int fd, uint64_t fsize, int cls, uint64_t* hits, int apply, int* family, uint64_t* off);
+#endif
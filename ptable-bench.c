@@ -0,0 +1,107 @@
+// Benchmark of the file search of the partition table, find_ptable() of
+// parts.c, against the routine it replaced (16-byte fread and fseek back
+// by 12 at every step). Each file is searched from the start and from just
+// past the first table, which mostly scans to the end; both routines must
+// give the same offset and leave the file at it.
+//
+// ptable-bench <usbloader or flash dump> ...
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parts.h"
+
+static double now() {
+
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC,&ts);
+return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+//***********************************************************************
+//* The search before the block reader
+//***********************************************************************
+static uint32_t old_find(FILE* ldr) {
+
+uint8_t rbuf[16];
+
+while (fread(rbuf,1,16,ldr) == 16) {
+  if (memcmp(rbuf,headmagic,16) == 0) {
+    fseek(ldr,-16,SEEK_CUR);
+    return ftell(ldr);
+  }
+  fseek(ldr,-12,SEEK_CUR);
+}
+return 0;
+}
+
+//***********************************************************************
+//* Milliseconds per search from start; off and the file position after
+//* the search are returned
+//***********************************************************************
+static double mscall(int new, FILE* f, long start, uint64_t* off, uint64_t* pos) {
+
+double t0,t;
+int n=0;
+
+t0=now();
+do {
+  fseek(f,start,SEEK_SET);
+  *off=new?find_ptable(f):old_find(f);
+  *pos=ftell(f);
+  n++;
+  t=now()-t0;
+} while (t<0.3);
+return t*1000/n;
+}
+
+//***********************************************************************
+//* One search: the results of both routines, then the times
+//***********************************************************************
+static int bench(FILE* f, const char* title, long start, uint64_t* found) {
+
+uint64_t oldoff,newoff,oldpos,newpos;
+double told,tnew;
+int bad;
+
+told=mscall(0,f,start,&oldoff,&oldpos);
+tnew=mscall(1,f,start,&newoff,&newpos);
+bad=(oldoff != newoff) || ((newoff != 0) && (oldpos != newpos));
+printf(" %-24s %9lx %9llx %9.2f %9.3f %6.0fx%s\n",title,start,(unsigned long long)newoff,told,tnew,
+       (tnew>0)?told/tnew:0.0,bad?"  MISMATCH":"");
+*found=newoff;
+return bad;
+}
+
+//#######################################################################################################
+int main(int argc, char* argv[]) {
+
+FILE* f;
+const char* name;
+uint64_t off;
+int i,total=0;
+
+if (argc<2) {
+  printf("\n %s <usbloader or flash dump> ...\n\n",argv[0]);
+  return 1;
+}
+printf("\n %-24s %9s %9s %9s %9s\n","","from","table","old ms","new ms");
+for(i=1;i<argc;i++) {
+  f=fopen(argv[i],"rb");
+  if (f == NULL) {
+    printf("\n Error opening %s\n",argv[i]);
+    return 1;
+  }
+  name=strrchr(argv[i],'/');
+  name=name?name+1:argv[i];
+  total+=bench(f,name,0,&off);
+  if (off != 0) total+=bench(f,"  past the table",off+4,&off);
+  fclose(f);
+}
+printf("\n");
+return total != 0;
+}
@@ -29,7 +29,8 @@ int mflag=0;
 char ptfile[100];
 int rflag=0,xflag=0;
 
-uint32_t ptaddr;
+uint64_t ptaddr;
+size_t ptlen;
 struct ptable_t ptable;
 
 FILE* ldr;
@@ -89,7 +90,7 @@ if (ptaddr == 0) {
   return ;
 }
 // read the current table
-fread(&ptable,sizeof(ptable),1,ldr);
+ptlen=fread(&ptable,1,sizeof(ptable),ldr);
 
 if (xflag) {
    out=fopen("ptable.bin","wb");
@@ -118,7 +119,8 @@ if (rflag) {
     printf("\n The input file is not a partition table\n");
     return;
   }
-  fseek(ldr,ptaddr,SEEK_SET);
+  // back to the table: the offset may not fit into fseek()
+  fseek(ldr,-(long)ptlen,SEEK_CUR);
   fwrite(&ptable,sizeof(ptable),1,ldr);
   fclose(ldr);
   
@@ -0,0 +1,9 @@
+// Text form of the partition table:
+//   version=, product=, tail= (64 hex digits), then for every partition
+//   [partition] with name=, start=, length=, lsize=, loadaddr=, entry=,
+//   nproperty=, type=, count=
+
+void ptable_write_text(FILE *out, const struct ptable_t *ptable);
+
+// 0 - parsed, -1 - error (reported on stderr)
+int ptable_parse_text(FILE *in, struct ptable_t *ptable);
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "sha256.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA256_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*sha256_blocks_t)(uint32_t*, const uint8_t*, size_t);
+
+static const uint32_t k[64]={
+  0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+  0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+  0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+  0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+  0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+  0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+  0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+  0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+#define ROR(x,n) (((x)>>(n))|((x)<<(32-(n))))
+
+//***********************************************************************
+//* Compression of one 64-byte block
+//***********************************************************************
+static void sha256_block(uint32_t* h, const uint8_t* p) {
+
+uint32_t w[64];
+uint32_t a,b,c,d,e,f,g,hh,t1,t2;
+int i;
+
+for(i=0;i<16;i++) w[i]=((uint32_t)p[4*i]<<24)|((uint32_t)p[4*i+1]<<16)|((uint32_t)p[4*i+2]<<8)|p[4*i+3];
+for(i=16;i<64;i++) {
+  t1=ROR(w[i-15],7)^ROR(w[i-15],18)^(w[i-15]>>3);
+  t2=ROR(w[i-2],17)^ROR(w[i-2],19)^(w[i-2]>>10);
+  w[i]=w[i-16]+t1+w[i-7]+t2;
+}
+
+a=h[0]; b=h[1]; c=h[2]; d=h[3]; e=h[4]; f=h[5]; g=h[6]; hh=h[7];
+for(i=0;i<64;i++) {
+  t1=hh+(ROR(e,6)^ROR(e,11)^ROR(e,25))+((e&f)^(~e&g))+k[i]+w[i];
+  t2=(ROR(a,2)^ROR(a,13)^ROR(a,22))+((a&b)^(a&c)^(b&c));
+  hh=g; g=f; f=e; e=d+t1;
+  d=c; c=b; b=a; a=t1+t2;
+}
+h[0]+=a; h[1]+=b; h[2]+=c; h[3]+=d; h[4]+=e; h[5]+=f; h[6]+=g; h[7]+=hh;
+}
+
+static void sha256_generic(uint32_t* h, const uint8_t* p, size_t n) {
+
+for(;n>0;n--,p+=64) sha256_block(h,p);
+}
+
+#ifdef SHA256_X86
+//***********************************************************************
+//* SHA extensions: sha256rnds2 does two rounds with the state split into
+//* ABEF and CDGH, sha256msg1/msg2 extend the message schedule. Group g
+//* of 4 rounds uses the words m[g&3]; the later words are computed three
+//* groups ahead, so that every group finds its words ready.
+//***********************************************************************
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_shani(uint32_t* h, const uint8_t* p, size_t n) {
+
+const __m128i bswap=_mm_set_epi64x(0x0c0d0e0f08090a0bULL,0x0405060700010203ULL);
+__m128i st0,st1,save0,save1,msg,tmp,m[4];
+int g;
+
+tmp=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)h),0xb1);      // CDAB
+st1=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(h+4)),0x1b);  // EFGH
+st0=_mm_alignr_epi8(tmp,st1,8);      // ABEF
+st1=_mm_blend_epi16(st1,tmp,0xf0);   // CDGH
+
+for(;n>0;n--,p+=64) {
+  save0=st0;
+  save1=st1;
+#pragma GCC unroll 16
+  for(g=0;g<16;g++) {
+    if (g<4) m[g]=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p+16*g)),bswap);
+    msg=_mm_add_epi32(m[g&3],_mm_loadu_si128((const __m128i*)(k+4*g)));
+    st1=_mm_sha256rnds2_epu32(st1,st0,msg);
+    if ((g >= 3) && (g <= 14)) {
+      tmp=_mm_alignr_epi8(m[g&3],m[(g-1)&3],4);
+      m[(g+1)&3]=_mm_sha256msg2_epu32(_mm_add_epi32(m[(g+1)&3],tmp),m[g&3]);
+    }
+    msg=_mm_shuffle_epi32(msg,0x0e);
+    st0=_mm_sha256rnds2_epu32(st0,st1,msg);
+    if ((g >= 1) && (g <= 12)) m[(g-1)&3]=_mm_sha256msg1_epu32(m[(g-1)&3],m[g&3]);
+  }
+  st0=_mm_add_epi32(st0,save0);
+  st1=_mm_add_epi32(st1,save1);
+}
+
+tmp=_mm_shuffle_epi32(st0,0x1b);     // FEBA
+st1=_mm_shuffle_epi32(st1,0xb1);     // DCHG
+_mm_storeu_si128((__m128i*)h,_mm_blend_epi16(tmp,st1,0xf0));      // DCBA
+_mm_storeu_si128((__m128i*)(h+4),_mm_alignr_epi8(st1,tmp,8));     // HGFE
+}
+#endif
+
+//***********************************************************************
+//* Dispatch
+//***********************************************************************
+static const struct {
+  const char* name;
+  sha256_blocks_t fn;
+} impls[]={
+#ifdef SHA256_X86
+  {"shani",   sha256_shani},
+#endif
+  {"generic", sha256_generic}
+};
+
+static int cur=-1;
+
+static int supported(const char* name) {
+
+#ifdef SHA256_X86
+__builtin_cpu_init();
+if (strcmp(name,"shani") == 0) return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#endif
+return 1;
+}
+
+// the first implementation of the list that the CPU supports
+static void select_impl() {
+
+int i;
+
+for(i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+  if (supported(impls[i].name)) break;
+}
+cur=i;
+}
+
+int sha256_force(const char* name) {
+
+int i;
+
+for(i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+  if ((strcmp(impls[i].name,name) == 0) && supported(name)) {
+    cur=i;
+    return 1;
+  }
+}
+return 0;
+}
+
+const char* sha256_impl() {
+
+if (cur<0) select_impl();
+return impls[cur].name;
+}
+
+//***********************************************************************
+void sha256_init(struct sha256* ctx) {
+
+static const uint32_t h0[8]={0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19};
+
+memcpy(ctx->h,h0,sizeof(h0));
+ctx->len=0;
+}
+
+//***********************************************************************
+void sha256_update(struct sha256* ctx, const void* data, size_t len) {
+
+const uint8_t* p=data;
+uint32_t fill=ctx->len&63;
+uint32_t n;
+
+if (cur<0) select_impl();
+ctx->len+=len;
+// complete the buffered block
+if (fill != 0) {
+  n=64-fill;
+  if (len<n) {
+    memcpy(ctx->buf+fill,p,len);
+    return;
+  }
+  memcpy(ctx->buf+fill,p,n);
+  impls[cur].fn(ctx->h,ctx->buf,1);
+  p+=n;
+  len-=n;
+}
+// whole blocks straight from the data
+impls[cur].fn(ctx->h,p,len/64);
+p+=len&~(size_t)63;
+len&=63;
+memcpy(ctx->buf,p,len);
+}
+
+//***********************************************************************
+void sha256_final(struct sha256* ctx, uint8_t* digest) {
+
+uint32_t fill=ctx->len&63;
+uint64_t bits=ctx->len*8;
+int i;
+
+ctx->buf[fill++]=0x80;
+if (fill>56) {
+  memset(ctx->buf+fill,0,64-fill);
+  sha256_block(ctx->h,ctx->buf);
+  fill=0;
+}
+memset(ctx->buf+fill,0,56-fill);
+for(i=0;i<8;i++) ctx->buf[56+i]=bits>>(56-8*i);
+sha256_block(ctx->h,ctx->buf);
+
+for(i=0;i<32;i++) digest[i]=ctx->h[i>>2]>>(24-8*(i&3));
+}
+
+//***********************************************************************
+void sha256(const void* data, size_t len, uint8_t* digest) {
+
+struct sha256 ctx;
+
+sha256_init(&ctx);
+sha256_update(&ctx,data,len);
+sha256_final(&ctx,digest);
+}
+
+//***********************************************************************
+void sha256_hex(const uint8_t* digest, char* str) {
+
+int i;
+
+for(i=0;i<32;i++) sprintf(str+2*i,"%02x",digest[i]);
+}
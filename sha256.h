@@ -0,0 +1,34 @@
+// SHA-256 (FIPS 180-4) - content keys of the prepared loaders
+
+#include <stddef.h>
+
+struct sha256 {
+  uint32_t h[8];
+  uint64_t len;      // bytes hashed so far
+  uint8_t buf[64];   // incomplete block
+};
+
+//***********************************************************************
+//* Incremental hashing: init, any number of updates, final
+//***********************************************************************
+void sha256_init(struct sha256* ctx);
+void sha256_update(struct sha256* ctx, const void* data, size_t len);
+void sha256_final(struct sha256* ctx, uint8_t* digest);
+
+//***********************************************************************
+//* Hash of one buffer
+//***********************************************************************
+void sha256(const void* data, size_t len, uint8_t* digest);
+
+//***********************************************************************
+//* Digest as 64 hex digits plus the terminating zero
+//***********************************************************************
+void sha256_hex(const uint8_t* digest, char* str);
+
+//***********************************************************************
+//* Implementation chosen for this CPU: shani (x86 SHA extensions) or
+//* generic. sha256_force() selects another one for benchmarking, returns
+//* 0 if it is not available here.
+//***********************************************************************
+const char* sha256_impl();
+int sha256_force(const char* name);
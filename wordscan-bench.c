@@ -0,0 +1,174 @@
+// Benchmark of the candidate filter of wordscan.c in patch(),
+// find_ptable_ram() and scan_signatures(): every implementation must give
+// the same result as the memcmp loops they replaced, then the time of one
+// call is measured on the given loaders and on a synthetic 64 MB buffer.
+//
+// wordscan-bench <usbloader> ...
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "patcher.h"
+#include "parts.h"
+#include "wordscan.h"
+
+#define SYNTHSIZE (64*1024*1024)
+
+static const char* names[]={"scalar","sse2","avx2","neon"};
+
+// a signature that is not in the loaders; its first word is an ARM
+// push {r4-r8,lr}, as common as the first words of the real ones
+static const char absent[16]={0xf0,0x41,0x2d,0xe9,0x5a,0xa5,0x13,0x37,0x00,0x50,0xa0,0xe1,0xc3,0x3c,0x77,0x19};
+
+static double now() {
+
+struct timespec ts;
+
+clock_gettime(CLOCK_MONOTONIC,&ts);
+return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+//***********************************************************************
+//* The loops before wordscan.c
+//***********************************************************************
+static uint32_t old_patch(struct defpatch fp, uint8_t* buf, uint32_t fsize) {
+
+uint32_t i;
+
+for(i=8;i<(fsize-60);i+=4) {
+  if (memcmp(buf+i,fp.sig,fp.sigsize) == 0) return i;
+}
+return 0;
+}
+
+static uint32_t old_ptable_ram(char* buf, uint32_t size) {
+
+uint32_t off;
+
+for(off=0;off<(size-16);off+=4) {
+  if (memcmp(buf+off,headmagic,16) == 0) return off;
+}
+return 0;
+}
+
+//***********************************************************************
+//* Milliseconds per call of the test t on the buffer
+//***********************************************************************
+static uint32_t hits[MAXSIG];
+static uint32_t sink;
+
+static uint32_t run(int t, uint8_t* buf, uint32_t size) {
+
+struct defpatch fp={absent,16,0};
+
+switch (t) {
+  case 0: return old_patch(fp,buf,size);
+  case 1: return patch(fp,buf,size,0);
+  case 2: return old_ptable_ram((char*)buf,size);
+  case 3: return find_ptable_ram((char*)buf,size);
+  default: return scan_signatures(buf,size,hits);
+}
+}
+
+static double mscall(int t, uint8_t* buf, uint32_t size) {
+
+double t0,t1;
+int n=0;
+
+t0=now();
+do {
+  sink^=run(t,buf,size);
+  n++;
+  t1=now()-t0;
+} while (t1<0.3);
+return t1*1000/n;
+}
+
+//***********************************************************************
+//* One buffer: results of every implementation, then the times
+//***********************************************************************
+static int bench(const char* title, uint8_t* buf, uint32_t size) {
+
+uint32_t ref[MAXSIG],rpatch,rpt;
+double tpatch[4],tpt[4],tscan[4];
+int k,t,nref,bad=0;
+int avail[4];
+
+rpatch=old_patch((struct defpatch){absent,16,0},buf,size);
+rpt=old_ptable_ram((char*)buf,size);
+wordscan_force("scalar");
+nref=scan_signatures(buf,size,ref);
+for(k=0;k<4;k++) {
+  avail[k]=wordscan_force(names[k]);
+  if (!avail[k]) continue;
+  if ((run(1,buf,size) != rpatch) || (run(3,buf,size) != rpt)) bad++;
+  if ((run(4,buf,size) != nref) || (memcmp(hits,ref,sig_count()*sizeof(uint32_t)) != 0)) bad++;
+  tpatch[k]=mscall(1,buf,size);
+  tpt[k]=mscall(3,buf,size);
+  tscan[k]=mscall(4,buf,size);
+}
+
+printf("\n %s, %.1f MB%s\n",title,size/1048576.0,bad?"  MISMATCH":"");
+printf("   %-18s %7s","","memcmp");
+for(k=0;k<4;k++) if (avail[k]) printf(" %7s",names[k]);
+printf("\n");
+for(t=0;t<3;t++) {
+  printf("   %-18s",(t == 0)?"patch (not found)":(t == 1)?"find_ptable_ram":"scan_signatures");
+  if (t == 0) printf(" %7.2f",mscall(0,buf,size));
+  else if (t == 1) printf(" %7.2f",mscall(2,buf,size));
+  else printf(" %7s","");
+  for(k=0;k<4;k++) if (avail[k]) printf(" %7.2f",(t == 0)?tpatch[k]:(t == 1)?tpt[k]:tscan[k]);
+  printf("\n");
+}
+return bad;
+}
+
+//#######################################################################################################
+int main(int argc, char* argv[]) {
+
+uint8_t* buf;
+uint32_t size,i,x=2463534242u;
+FILE* f;
+int total=0;
+
+if (argc<2) {
+  printf("\n %s <usbloader> ...\n\n",argv[0]);
+  return 1;
+}
+printf("\n Default implementation: %s, ms per call\n",wordscan_impl());
+for(i=1;i<argc;i++) {
+  f=fopen(argv[i],"rb");
+  if (f == NULL) {
+    printf("\n Error opening %s\n",argv[i]);
+    return 1;
+  }
+  fseek(f,0,SEEK_END);
+  size=ftell(f);
+  rewind(f);
+  buf=malloc(size+1);
+  if (fread(buf,1,size,f) != size) {
+    printf("\n Error reading %s\n",argv[i]);
+    return 1;
+  }
+  fclose(f);
+  total+=bench(argv[i],buf,size);
+  free(buf);
+}
+
+// xorshift noise: the filter stops only by chance
+buf=malloc(SYNTHSIZE);
+for(i=0;i<SYNTHSIZE;i+=4) {
+  x^=x<<13;
+  x^=x>>17;
+  x^=x<<5;
+  memcpy(buf+i,&x,4);
+}
+total+=bench("random",buf,SYNTHSIZE);
+free(buf);
+printf("\n");
+if (sink == 0x5a5a5a5a) printf(" ");  // keeps the calls
+return total != 0;
+}
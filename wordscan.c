@@ -0,0 +1,321 @@
+#include <stdint.h>
+#include <string.h>
+#include "wordscan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WORDSCAN_X86
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) || (defined(__ARM_NEON) && defined(__GNUC__))
+#define WORDSCAN_NEON
+#include <arm_neon.h>
+#endif
+
+typedef uint32_t (*find_word_t)(const uint8_t*, uint32_t, uint32_t, uint32_t);
+typedef uint32_t (*find_words_t)(const uint8_t*, uint32_t, uint32_t, const uint32_t*, int);
+typedef uint32_t (*find_other_t)(const uint8_t*, uint32_t, uint32_t, uint32_t);
+
+//***********************************************************************
+//* Scalar version - one position per step
+//***********************************************************************
+static uint32_t find_word_scalar(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w) {
+
+uint32_t i,v;
+
+for(i=start;i<end;i+=4) {
+  memcpy(&v,buf+i,4);
+  if (v == w) return i;
+}
+return end;
+}
+
+static uint32_t find_words_scalar(const uint8_t* buf, uint32_t start, uint32_t end, const uint32_t* w, int n) {
+
+uint32_t i,v;
+uint8_t low[32];  // bitmap of the low bytes of the words
+int k;
+
+memset(low,0,sizeof(low));
+for(k=0;k<n;k++) low[(w[k]&0xff)>>3] |= 1<<(w[k]&7);
+for(i=start;i<end;i+=4) {
+  memcpy(&v,buf+i,4);
+  if ((low[(v&0xff)>>3] & (1<<(v&7))) == 0) continue;
+  for(k=0;k<n;k++) if (v == w[k]) return i;
+}
+return end;
+}
+
+static uint32_t find_other_scalar(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w) {
+
+uint32_t i,v;
+
+for(i=start;i<end;i+=4) {
+  memcpy(&v,buf+i,4);
+  if (v != w) return i;
+}
+return end;
+}
+
+#ifdef WORDSCAN_X86
+//***********************************************************************
+//* SSE2 - 4 positions per 16-byte load
+//***********************************************************************
+__attribute__((target("sse2")))
+static uint32_t find_word_sse2(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w) {
+
+__m128i key=_mm_set1_epi32(w);
+__m128i v;
+uint32_t i=start;
+int m;
+
+for(;(uint64_t)i+12<end;i+=16) {
+  v=_mm_loadu_si128((const __m128i*)(buf+i));
+  m=_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v,key)));
+  if (m != 0) return i+4*__builtin_ctz(m);
+}
+return find_word_scalar(buf,i,end,w);
+}
+
+__attribute__((target("sse2")))
+static uint32_t find_words_sse2(const uint8_t* buf, uint32_t start, uint32_t end, const uint32_t* w, int n) {
+
+__m128i key[8];
+__m128i v,eq;
+uint32_t i=start;
+int k,m;
+
+for(k=0;k<n;k++) key[k]=_mm_set1_epi32(w[k]);
+for(;(uint64_t)i+12<end;i+=16) {
+  v=_mm_loadu_si128((const __m128i*)(buf+i));
+  eq=_mm_cmpeq_epi32(v,key[0]);
+  for(k=1;k<n;k++) eq=_mm_or_si128(eq,_mm_cmpeq_epi32(v,key[k]));
+  m=_mm_movemask_ps(_mm_castsi128_ps(eq));
+  if (m != 0) return i+4*__builtin_ctz(m);
+}
+return find_words_scalar(buf,i,end,w,n);
+}
+
+// runs of w (erased flash) are checked 64 bytes per step
+__attribute__((target("sse2")))
+static uint32_t find_other_sse2(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w) {
+
+__m128i key=_mm_set1_epi32(w);
+__m128i eq;
+uint32_t i=start;
+int m;
+
+for(;(uint64_t)i+60<end;i+=64) {
+  eq=_mm_and_si128(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(buf+i)),key),
+                   _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(buf+i+16)),key));
+  eq=_mm_and_si128(eq,_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(buf+i+32)),key));
+  eq=_mm_and_si128(eq,_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(buf+i+48)),key));
+  if (_mm_movemask_epi8(eq) != 0xffff) break;
+}
+for(;(uint64_t)i+12<end;i+=16) {
+  m=_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(buf+i)),key)));
+  if (m != 15) return i+4*__builtin_ctz(~m);
+}
+return find_other_scalar(buf,i,end,w);
+}
+
+//***********************************************************************
+//* AVX2 - 8 positions per 32-byte load
+//***********************************************************************
+__attribute__((target("avx2")))
+static uint32_t find_word_avx2(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w) {
+
+__m256i key=_mm256_set1_epi32(w);
+__m256i v;
+uint32_t i=start;
+int m;
+
+for(;(uint64_t)i+28<end;i+=32) {
+  v=_mm256_loadu_si256((const __m256i*)(buf+i));
+  m=_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v,key)));
+  if (m != 0) return i+4*__builtin_ctz(m);
+}
+return find_word_sse2(buf,i,end,w);
+}
+
+__attribute__((target("avx2")))
+static uint32_t find_words_avx2(const uint8_t* buf, uint32_t start, uint32_t end, const uint32_t* w, int n) {
+
+__m256i key[8];
+__m256i v,eq;
+uint32_t i=start;
+int k,m;
+
+for(k=0;k<n;k++) key[k]=_mm256_set1_epi32(w[k]);
+for(;(uint64_t)i+28<end;i+=32) {
+  v=_mm256_loadu_si256((const __m256i*)(buf+i));
+  eq=_mm256_cmpeq_epi32(v,key[0]);
+  for(k=1;k<n;k++) eq=_mm256_or_si256(eq,_mm256_cmpeq_epi32(v,key[k]));
+  m=_mm256_movemask_ps(_mm256_castsi256_ps(eq));
+  if (m != 0) return i+4*__builtin_ctz(m);
+}
+return find_words_sse2(buf,i,end,w,n);
+}
+
+__attribute__((target("avx2")))
+static uint32_t find_other_avx2(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w) {
+
+__m256i key=_mm256_set1_epi32(w);
+__m256i eq;
+uint32_t i=start;
+int m;
+
+for(;(uint64_t)i+124<end;i+=128) {
+  eq=_mm256_and_si256(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(buf+i)),key),
+                      _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(buf+i+32)),key));
+  eq=_mm256_and_si256(eq,_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(buf+i+64)),key));
+  eq=_mm256_and_si256(eq,_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(buf+i+96)),key));
+  if (_mm256_movemask_epi8(eq) != -1) break;
+}
+for(;(uint64_t)i+28<end;i+=32) {
+  m=_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(buf+i)),key)));
+  if (m != 255) return i+4*__builtin_ctz(~m);
+}
+return find_other_sse2(buf,i,end,w);
+}
+#endif
+
+#ifdef WORDSCAN_NEON
+//***********************************************************************
+//* NEON - 4 positions per 16-byte load
+//***********************************************************************
+static int neon_any(uint32x4_t eq) {
+
+uint32x2_t r=vorr_u32(vget_low_u32(eq),vget_high_u32(eq));
+return (vget_lane_u32(r,0)|vget_lane_u32(r,1)) != 0;
+}
+
+static uint32_t find_word_neon(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w) {
+
+uint32x4_t key=vdupq_n_u32(w);
+uint32x4_t v;
+uint32_t i=start;
+
+for(;(uint64_t)i+12<end;i+=16) {
+  v=vreinterpretq_u32_u8(vld1q_u8(buf+i));
+  if (neon_any(vceqq_u32(v,key))) return find_word_scalar(buf,i,i+16,w);
+}
+return find_word_scalar(buf,i,end,w);
+}
+
+static uint32_t find_words_neon(const uint8_t* buf, uint32_t start, uint32_t end, const uint32_t* w, int n) {
+
+uint32x4_t key[8];
+uint32x4_t v,eq;
+uint32_t i=start;
+int k;
+
+for(k=0;k<n;k++) key[k]=vdupq_n_u32(w[k]);
+for(;(uint64_t)i+12<end;i+=16) {
+  v=vreinterpretq_u32_u8(vld1q_u8(buf+i));
+  eq=vceqq_u32(v,key[0]);
+  for(k=1;k<n;k++) eq=vorrq_u32(eq,vceqq_u32(v,key[k]));
+  if (neon_any(eq)) return find_words_scalar(buf,i,i+16,w,n);
+}
+return find_words_scalar(buf,i,end,w,n);
+}
+
+static uint32_t find_other_neon(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w) {
+
+uint32x4_t key=vdupq_n_u32(w);
+uint32x4_t eq;
+uint32_t i=start;
+
+for(;(uint64_t)i+60<end;i+=64) {
+  eq=vandq_u32(vceqq_u32(vreinterpretq_u32_u8(vld1q_u8(buf+i)),key),vceqq_u32(vreinterpretq_u32_u8(vld1q_u8(buf+i+16)),key));
+  eq=vandq_u32(eq,vceqq_u32(vreinterpretq_u32_u8(vld1q_u8(buf+i+32)),key));
+  eq=vandq_u32(eq,vceqq_u32(vreinterpretq_u32_u8(vld1q_u8(buf+i+48)),key));
+  if (neon_any(vmvnq_u32(eq))) break;
+}
+return find_other_scalar(buf,i,end,w);
+}
+#endif
+
+//***********************************************************************
+//* Dispatch
+//***********************************************************************
+static const struct {
+  const char* name;
+  find_word_t fw;
+  find_words_t fws;
+  find_other_t fo;
+} impls[]={
+#ifdef WORDSCAN_X86
+  {"avx2",   find_word_avx2,   find_words_avx2,   find_other_avx2},
+  {"sse2",   find_word_sse2,   find_words_sse2,   find_other_sse2},
+#endif
+#ifdef WORDSCAN_NEON
+  {"neon",   find_word_neon,   find_words_neon,   find_other_neon},
+#endif
+  {"scalar", find_word_scalar, find_words_scalar, find_other_scalar}
+};
+
+static int cur=-1;
+
+static int supported(const char* name) {
+
+#ifdef WORDSCAN_X86
+__builtin_cpu_init();
+if (strcmp(name,"avx2") == 0) return __builtin_cpu_supports("avx2");
+if (strcmp(name,"sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+return 1;
+}
+
+// the fastest implementation that the CPU supports
+static void select_impl() {
+
+int i;
+
+for(i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+  if (supported(impls[i].name)) break;
+}
+cur=i;
+}
+
+int wordscan_force(const char* name) {
+
+int i;
+
+for(i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+  if ((strcmp(impls[i].name,name) == 0) && supported(name)) {
+    cur=i;
+    return 1;
+  }
+}
+return 0;
+}
+
+const char* wordscan_impl() {
+
+if (cur<0) select_impl();
+return impls[cur].name;
+}
+
+//***********************************************************************
+uint32_t find_word(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w) {
+
+if (cur<0) select_impl();
+if (start >= end) return end;
+return impls[cur].fw(buf,start,end,w);
+}
+
+//***********************************************************************
+uint32_t find_words(const uint8_t* buf, uint32_t start, uint32_t end, const uint32_t* w, int n) {
+
+if (cur<0) select_impl();
+if ((start >= end) || (n <= 0)) return end;
+return impls[cur].fws(buf,start,end,w,n);
+}
+
+//***********************************************************************
+uint32_t find_other_word(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w) {
+
+if (cur<0) select_impl();
+if (start >= end) return end;
+return impls[cur].fo(buf,start,end,w);
+}
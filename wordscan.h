@@ -0,0 +1,29 @@
+// Search for 32-bit words at every 4th offset of a buffer - the candidate
+// filter of the signature and partition table scans
+
+//***********************************************************************
+//* First position start, start+4, start+8 ... below end where the word
+//* equals w, or end if there is none. The 4 bytes of every position below
+//* end must be readable; buf needs no alignment.
+//***********************************************************************
+uint32_t find_word(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w);
+
+//***********************************************************************
+//* The same for any of n words (n<=8); with no words - end
+//***********************************************************************
+uint32_t find_words(const uint8_t* buf, uint32_t start, uint32_t end, const uint32_t* w, int n);
+
+//***********************************************************************
+//* First position start, start+4 ... below end where the word differs
+//* from w, or end if there is none - the blank check of erased flash
+//* (w=0xffffffff)
+//***********************************************************************
+uint32_t find_other_word(const uint8_t* buf, uint32_t start, uint32_t end, uint32_t w);
+
+//***********************************************************************
+//* Implementation chosen for this CPU: scalar, sse2, avx2 or neon.
+//* wordscan_force() selects another one for benchmarking, returns 0 if
+//* it is not available here.
+//***********************************************************************
+const char* wordscan_impl();
+int wordscan_force(const char* name);
@@ -0,0 +1,92 @@
+#include <stdint.h>
+#include <string.h>
+#include "xxh64.h"
+
+static const uint64_t p1=0x9e3779b185ebca87ULL;
+static const uint64_t p2=0xc2b2ae3d27d4eb4fULL;
+static const uint64_t p3=0x165667b19e3779f9ULL;
+static const uint64_t p4=0x85ebca77c2b2ae63ULL;
+static const uint64_t p5=0x27d4eb2f165667c5ULL;
+
+#define ROL(x,n) (((x)<<(n))|((x)>>(64-(n))))
+
+// little-endian words, as the flash stores them
+static uint64_t get64(const uint8_t* p) {
+
+uint64_t v;
+
+memcpy(&v,p,8);
+return v;
+}
+
+static uint32_t get32(const uint8_t* p) {
+
+uint32_t v;
+
+memcpy(&v,p,4);
+return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t v) {
+
+acc+=v*p2;
+acc=ROL(acc,31);
+return acc*p1;
+}
+
+static uint64_t merge64(uint64_t h, uint64_t v) {
+
+h^=round64(0,v);
+return h*p1+p4;
+}
+
+//***********************************************************************
+//* Four lanes over 32-byte stripes, then the tail and the avalanche
+//***********************************************************************
+uint64_t xxh64(const void* data, size_t len, uint64_t seed) {
+
+const uint8_t* p=data;
+const uint8_t* end=p+len;
+uint64_t v1,v2,v3,v4,h;
+
+if (len >= 32) {
+  v1=seed+p1+p2;
+  v2=seed+p2;
+  v3=seed;
+  v4=seed-p1;
+  for(;end-p >= 32;p+=32) {
+    v1=round64(v1,get64(p));
+    v2=round64(v2,get64(p+8));
+    v3=round64(v3,get64(p+16));
+    v4=round64(v4,get64(p+24));
+  }
+  h=ROL(v1,1)+ROL(v2,7)+ROL(v3,12)+ROL(v4,18);
+  h=merge64(h,v1);
+  h=merge64(h,v2);
+  h=merge64(h,v3);
+  h=merge64(h,v4);
+}
+else h=seed+p5;
+h+=len;
+
+for(;end-p >= 8;p+=8) {
+  h^=round64(0,get64(p));
+  h=ROL(h,27)*p1+p4;
+}
+if (end-p >= 4) {
+  h^=get32(p)*p1;
+  h=ROL(h,23)*p2+p3;
+  p+=4;
+}
+for(;p<end;p++) {
+  h^=*p*p5;
+  h=ROL(h,11)*p1;
+}
+
+h^=h>>33;
+h*=p2;
+h^=h>>29;
+h*=p3;
+h^=h>>32;
+return h;
+}
@@ -0,0 +1,9 @@
+// XXH64 - fast non-cryptographic hash of the erase blocks in flash
+// manifests
+
+#include <stddef.h>
+
+//***********************************************************************
+//* Hash of one buffer
+//***********************************************************************
+uint64_t xxh64(const void* data, size_t len, uint64_t seed);